@@ -9,10 +9,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 typedef struct Type Type;
 typedef struct Member Member;
-typedef struct Initializer Initializer;
+typedef struct Relocation Relocation;
+typedef struct Reg Reg;
 
 // 
 // tokenize.c
@@ -24,6 +26,7 @@ typedef enum {
     TK_IDENT, // Identifiers
     TK_STR, // String literals
 	TK_NUM, // number token
+    TK_PRAGMA, // #pragma GCC unroll, with the factor in val
 	TK_EOF, // end of input
 } TokenKind;
 
@@ -57,10 +60,15 @@ struct Var {
 
 	// Local variable
     int offset; // Offset from RBP based current func
+    Reg *reg; // virtual register if promoted by gen_ir()
+    int cg_reg; // register holding it in codegen(), plus one, or 0
+    int nuses; // references, counted by codegen()
+    bool escapes; // may not be kept in a register by codegen()
 
     // Global variable
     bool is_static;
-    Initializer *initializer;
+    char *init_data; // initial contents, or NULL if zero-initialized
+    Relocation *rel; // addresses stored in init_data
 };
 
 typedef struct VarList VarList;
@@ -69,16 +77,13 @@ struct VarList {
 	Var *var;
 };
 
-// Global variable initializer. Global variables can be initialized
-// either by a constant expression or a pointer to another global variable with an addend.
-struct Initializer {
-    Initializer *next;
-
-    // Constant expression.
-    int sz;
-    long val;
-
-    // Reference to another global variable
+// Global variable initializers are stored as the bytes of the variable
+// plus a list of relocations. A relocation is a pointer to another
+// global variable with an addend, which is only known at link-time,
+// stored at a given offset of the variable.
+struct Relocation {
+    Relocation *next;
+    int offset;
     char *label;
     long addend;
 };
@@ -92,6 +97,7 @@ typedef enum {
 	ND_PTR_DIFF, // ptr - ptr
 	ND_MUL, // *
 	ND_DIV, // /
+	ND_MOD, // %
 	ND_BITAND, // &
 	ND_BITOR, // |
 	ND_BITXOR, // ^
@@ -113,6 +119,7 @@ typedef enum {
 	ND_PTR_SUB_EQ, // -=
 	ND_MUL_EQ, // *=
 	ND_DIV_EQ, // /=
+	ND_MOD_EQ, // %=
     ND_SHL_EQ, // <<=
     ND_SHR_EQ, // >>=
     ND_BITAND_EQ, // &=
@@ -148,6 +155,11 @@ typedef enum {
 } NodeKind;
 
 // AST node type 
+//
+// Nodes are allocated only up to the last field their kind uses (see
+// node_size() in parser.c), so the fields are grouped by the kinds that
+// use them and each group only extends the ones before it. Accessing a
+// field of a later group is invalid for a smaller kind.
 typedef struct Node Node;
 struct Node {
 	NodeKind kind; // Node kind
@@ -155,41 +167,65 @@ struct Node {
 	Type *ty; // Type, e.g. int or pointer to int
 	Token *tok; // Representatie token
 
+    // Operators, expression statements and integer literals. Every
+    // expression node has room for val, so it can be turned into ND_NUM.
 	Node *lhs; // Left-hand side
 	Node *rhs; // Right-hand side
+	long val; // Integer literal(ND_NUM) or case value(ND_CASE)
 
-    // "if", "while" or "for" statement
-    Node *cond; // 条件式
-    Node *then;
-    Node *els;
-    Node *init; // only use "for"
-    Node *inc; // only use "for"
-
-    // Block or statement expression
-    Node *body;
+	// Variable(ND_VAR)
+	Var *var;
+    Node *init; // compound literal initializer, or "for" init
 
-    // Struct member access
+    // Struct member access(ND_MEMBER)
     Member *member;
 
-	// Function call
+	// Function call(ND_FUNCALL)
 	char *funcname;
 	Node *args;
 
-	// Goto or labeled statement
+	// Goto or labeled statement(ND_GOTO, ND_LABEL)
 	char *label_name;
 
-	// Switch-cases
+    // Block or statement expression(ND_BLOCK, ND_STMT_EXPR)
+    Node *body;
+
+    // "if", "while", "for", "do" statement or ?: operator
+    Node *cond; // 条件式
+    Node *then;
+    Node *els;
+    Node *inc; // only use "for"
+    int unroll; // loops: factor given by #pragma GCC unroll, or 0
+
+	// Switch-cases(ND_SWITCH, ND_CASE)
 	Node *case_next;
 	Node *default_case;
 	int case_label;
 	int case_end_label;
+};
 
-	// Variable(use only ND_VAR)
-	Var *var;
+// Growable stack of nodes used by the non-recursive AST walkers.
+// A walker remembers `len` on entry and only touches entries above it,
+// so walkers may nest while sharing one stack.
+typedef struct {
+    Node **data;
+    int len;
+    int cap;
+} NodeStack;
 
-	// Integer literal(use only ND_NUM)
-	long val;
-};
+void push_node(NodeStack *st, Node *node);
+void push_children(NodeStack *st, Node *node);
+
+// Growable stack of the slots (the fields pointing to a node) used by the
+// walkers that replace nodes in place.
+typedef struct {
+    Node ***data;
+    int len;
+    int cap;
+} SlotStack;
+
+void push_slot(SlotStack *st, Node **slot);
+void push_child_slots(SlotStack *st, Node *node);
 
 extern Token *token;
 extern char *filename;
@@ -199,10 +235,12 @@ extern char *user_input;
 // parser.c
 //
 
+typedef struct BB BB;
 typedef struct Function Function;
 struct Function {
 	Function *next;
 	char *name;
+	Token *tok;
 	VarList *params;
 	bool is_static;
     bool has_varargs;
@@ -210,6 +248,11 @@ struct Function {
     Node *node;
 	VarList *locals;
     int stack_size;
+
+    // Optimizing backend
+    BB *bbs; // basic blocks in layout order
+    int nregs; // number of virtual registers
+    int used_regs; // bitmask of allocated registers
 };
 
 typedef struct {
@@ -218,6 +261,14 @@ typedef struct {
 } Program;
 
 Program *program();
+Node *new_node(NodeKind kind, Token *tok);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok);
+Node *new_unary(NodeKind kind, Node *expr, Token *tok);
+Node *new_num(long val, Token *tok);
+Node *new_var_node(Var *var, Token *tok);
+Var *new_local(Function *fn, char *name, Type *ty);
+Node *clone_node(Node *node);
+void assign_offsets(Function *fn);
 
 // 
 // typing.c
@@ -246,6 +297,12 @@ struct Type {
 	int array_len; // array
     Member *members; // struct
 	Type *return_ty; // function
+
+    // Derived types are interned, so that there is only one "pointer to T"
+    // and one "array of n T" for each T. These link them from T.
+    Type *pointer; // canonical pointer to this type
+    Type *arrays; // complete arrays of this type
+    Type *next_array; // next array in base->arrays
 };
 
 // Struct member
@@ -268,6 +325,7 @@ bool is_integer(Type *ty);
 int align_to(int n, int align);
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
+Type *incomplete_array_of(Type *base);
 Type *func_type(Type *return_ty);
 Type *enum_type();
 Type *struct_type();
@@ -276,5 +334,285 @@ void add_type(Node *node);
 //
 // codegen.c
 //
+
+// A line of assembly. codegen() keeps the code of a function in memory
+// so that it can be optimized before it is printed. Instructions are
+// split into the mnemonic and up to two operands; labels and directives
+// are kept as text.
+typedef struct Insn Insn;
+struct Insn {
+    Insn *next;
+    Insn *prev;
+    char *op; // mnemonic, or NULL for a label or directive
+    char *dst; // first operand, or NULL
+    char *src; // second operand, or NULL
+    char *text; // label or directive
+};
+
+typedef struct {
+    Insn *first;
+    Insn *last;
+} InsnList;
+
+void emit_data(Program *prog);
 void codegen(Program *prog);
 
+//
+// peephole.c
+//
+int peephole(InsnList *insns);
+
+//
+// strength.c
+//
+int exact_log2(long val);
+bool can_mul_imm(long val);
+void emit_mul_imm(FILE *fp, char *reg, long val);
+bool can_div_imm(long val);
+void emit_div_imm(FILE *fp, long val, bool is_mod);
+
+//
+// switch.c
+//
+
+// How a switch statement dispatches to its cases
+typedef enum {
+    SW_LINEAR, // compare with each case in turn
+    SW_BSEARCH, // binary search over the sorted case values
+    SW_TABLE, // jump table indexed by the value minus the smallest case
+} SwitchKind;
+
+// Fewer cases than this are compared with one after another.
+enum { SWITCH_MIN_CASES = 4 };
+
+typedef struct {
+    SwitchKind kind;
+    Node **cases; // sorted by value
+    int ncases;
+    Node **table; // SW_TABLE: the case of each value, or NULL for default
+    int ntable;
+} SwitchPlan;
+
+SwitchPlan *plan_switch(Node *node);
+
+//
+// ir.c
+//
+
+// Three-address instructions of the optimizing backend. Operands are
+// virtual registers; "b" below is either a register or, if the b
+// register is NULL, the immediate value.
+typedef enum {
+    IR_IMM, // d = imm
+    IR_MOV, // d = a
+    IR_ADD, // d = a + b
+    IR_SUB, // d = a - b
+    IR_MUL, // d = a * b
+    IR_DIV, // d = a / b
+    IR_MOD, // d = a % b
+    IR_AND, // d = a & b
+    IR_OR, // d = a | b
+    IR_XOR, // d = a ^ b
+    IR_SHL, // d = a << b
+    IR_SHR, // d = a >> b
+    IR_EQ, // d = a == b
+    IR_NE, // d = a != b
+    IR_LT, // d = a < b
+    IR_LE, // d = a <= b
+    IR_BITNOT, // d = ~a
+    IR_TRUNC, // d = a sign-extended from its lower size bytes
+    IR_LVAR, // d = address of a local variable
+    IR_GVAR, // d = address of a global symbol
+    IR_LOAD, // d = *(a + imm), size bytes
+    IR_STORE, // *(a + imm) = b, size bytes
+    IR_PARAM, // d = imm-th argument, size bytes
+    IR_CALL, // d = name(args...)
+    IR_VA_START, // __builtin_va_start(a)
+    IR_JMP, // goto then
+    IR_BR, // if (a cmp b) goto then else goto els
+    IR_SWITCH, // goto succs[table[a - imm]], or succs[0] if out of the table
+    IR_RET, // return a (a may be NULL)
+    IR_PHI, // d = args[i] when coming from the i-th predecessor
+} IROp;
+
+// Virtual register
+struct Reg {
+    int vn; // virtual register number
+    int rn; // allocated register, or -1 if spilled
+    int spill; // offset of the spill slot from RBP
+
+    // Live interval computed by the register allocator
+    int start;
+    int end;
+};
+
+typedef struct IR IR;
+struct IR {
+    IROp op;
+    IR *next;
+    IR *prev;
+
+    Reg *d;
+    Reg *a;
+    Reg *b;
+    long imm;
+    int size;
+
+    IROp cmp; // IR_BR
+    BB *then; // IR_JMP, IR_BR
+    BB *els; // IR_BR
+    BB **succs; // IR_SWITCH: the default block, then the distinct cases
+    int nsuccs;
+    int *table; // IR_SWITCH: index into succs of each value from imm
+    int ntable;
+
+    char *name; // IR_GVAR, IR_CALL
+    Var *var; // IR_LVAR
+    Reg **args; // IR_CALL, IR_PHI
+    int nargs;
+
+    int pos; // instruction number, set by the pass using it
+};
+
+// Basic block. Every block ends with IR_JMP, IR_BR, IR_SWITCH or IR_RET,
+// and phis
+// are only at its beginning.
+struct BB {
+    BB *next; // next block in layout order
+    int label;
+    IR *first;
+    IR *last;
+
+    // Control-flow graph, set by compute_cfg()
+    int id; // index in layout order
+    BB **preds;
+    int npreds;
+
+    // Dominator tree, set by compute_dominators()
+    BB *idom;
+    int dom_pre; // preorder and postorder numbers in the dominator tree
+    int dom_post;
+
+    // Set by the register allocator
+    unsigned long *live_in;
+    unsigned long *live_out;
+};
+
+BB *new_bb();
+Reg *new_vreg(Function *fn);
+IR *new_ir(IROp op);
+void insert_ir(BB *bb, IR *pos, IR *ir);
+void remove_ir(BB *bb, IR *ir);
+bool is_terminator(IR *ir);
+int ir_num_uses(IR *ir);
+Reg *ir_use(IR *ir, int i);
+void set_ir_use(IR *ir, int i, Reg *r);
+int num_succs(BB *bb);
+BB *succ(BB *bb, int i);
+void set_succ(BB *bb, int i, BB *s);
+int compute_cfg(Function *fn);
+bool dominates(BB *x, BB *y);
+void dump_ir(Function *fn);
+void verify_ir(Function *fn, bool is_ssa);
+
+//
+// fold.c
+//
+int fold_fn(Function *fn);
+
+//
+// inline.c
+//
+int inline_fns(Program *prog);
+
+//
+// dce.c
+//
+int eliminate_dead_code(Function *fn);
+int eliminate_dead_insns(Function *fn);
+
+//
+// gvn.c
+//
+int gvn(Function *fn);
+
+//
+// memopt.c
+//
+int forward_stores(Function *fn);
+int eliminate_dead_stores(Function *fn);
+
+//
+// unroll.c
+//
+
+// A counted loop `for (init; i < n; i += step) body`
+typedef struct {
+    Var *ivar;
+    Node *bound;
+    Var *bound_var; // if the bound is a local
+    long step;
+} CountedLoop;
+
+char *check_counted_loop(Function *fn, Node *node, CountedLoop *cl);
+int unroll_loops(Function *fn);
+
+//
+// vector.c
+//
+int vectorize_loops(Function *fn);
+void emit_vector_kernels();
+
+//
+// tailcall.c
+//
+char *check_frame_reuse(Function *fn);
+int eliminate_tail_calls(Function *fn);
+
+//
+// gen_ir.c
+//
+int gen_ir(Program *prog);
+
+//
+// ssa.c
+//
+void compute_dominators(Function *fn);
+int build_ssa(Function *fn);
+int out_of_ssa(Function *fn);
+
+//
+// licm.c
+//
+int licm(Function *fn);
+
+//
+// regalloc.c
+//
+
+// Registers handed out by the allocator. The first NUM_CALLER_SAVED ones
+// are clobbered by calls, the rest are callee-saved.
+enum {
+    NUM_REGS = 7,
+    NUM_CALLER_SAVED = 2,
+};
+
+int alloc_regs(Program *prog);
+
+//
+// gen_x86.c
+//
+void gen_x86(Program *prog);
+
+//
+// pass.c
+//
+bool parse_pass_option(char *arg);
+bool run_passes(Program *prog);
+bool is_mode_enabled(char *name);
+bool is_pass_forced(char *name);
+bool is_remark_enabled(char *name, bool missed);
+void count_stat(char *name);
+void run_asm_passes(InsnList *insns);
+void print_pass_stats();
+
@@ -4,6 +4,23 @@ static int labelseq = 1; // ラベルのindex
 static int brkseq;
 static int contseq;
 static char *funcname;
+static int fn_stack_size;
+static bool strength_reduce; // multiply and divide by constants cheaply
+static bool has_frame; // false in a leaf function without locals
+static bool sibling_calls; // calls in tail position may reuse the frame
+
+// Callee-saved registers holding the most used scalar locals whose
+// address is never taken. Such a variable always holds its value
+// sign-extended to 64 bits, as load() would read it.
+static char *varreg[] = {"rbx", "r12", "r13", "r14", "r15"};
+
+enum {
+    NUM_VAR_REGS = 5,
+    MAX_ARGS = 6, // arguments are passed in registers only
+    MIN_USES = 3, // fewer uses do not pay for saving the register
+};
+
+static int nvar_regs; // registers in use by the current function
 
 // 汎用レジスタの下1bitだけ
 static char *argreg1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
@@ -11,8 +28,262 @@ static char *argreg2[] = {"di", "si", "dx", "cx", "r8w", "r9w"};
 static char *argreg4[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
 static char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 
+// Code of the function being generated. It is written as text to `out`
+// and then split into insns.
+static FILE *out;
+static char *out_buf;
+static unsigned long out_len;
+static InsnList insns;
+
+// Top-of-stack caching. In this mode the top of the expression stack is
+// kept in rax and the value below it in rdi; values only go to the
+// machine stack when a third one is pushed, or before a call or a
+// branch. The functions below push and pop values of the expression
+// stack, and emit plain pushes and pops when the mode is off.
+//
+// Nothing is cached at statement boundaries, and an expression with
+// branches flushes the cache first and leaves its value in rax on every
+// path, so the cache is in the same state on all edges into a label.
+enum {
+    TOS_NONE, // everything is in memory
+    TOS_RAX, // the top is in rax
+    TOS_RDI, // the top is in rdi
+    TOS_RDI_RAX, // the top is in rax and the value below it in rdi
+};
+
+static bool tos_cache;
+static int tos;
+
+// Number of 8-byte values on the machine stack below the local
+// variables. It is the same on every path to a given instruction, so
+// the alignment of RSP at a call is known at compile time.
+static int depth;
+
+// Registers of the cache by size: rax and rdi
+static char *tosreg1[] = {"al", "dil"};
+static char *tosreg2[] = {"ax", "di"};
+static char *tosreg4[] = {"eax", "edi"};
+static char *tosreg8[] = {"rax", "rdi"};
+
 static void gen(Node *node);
 
+static char *skip_spaces(char *p) {
+    while(*p == ' ') p++;
+    return p;
+}
+
+// Parses a line of assembly. Instructions are indented; anything else
+// is a label or a directive.
+static Insn *parse_insn(char *line, int len) {
+    Insn *insn = calloc(1, sizeof(Insn));
+    if(strncmp(line, "  ", 2)) {
+        insn->text = strndup(line, len);
+        return insn;
+    }
+
+    char *end = line + len;
+    char *p = skip_spaces(line);
+    char *q = p;
+    while(q < end && *q != ' ') q++;
+    insn->op = strndup(p, q - p);
+
+    p = skip_spaces(q);
+    if(p < end) {
+        char *comma = strstr(p, ", ");
+        if(comma && comma < end) {
+            insn->dst = strndup(p, comma - p);
+            insn->src = strndup(comma + 2, end - comma - 2);
+        } else {
+            insn->dst = strndup(p, end - p);
+        }
+    }
+    return insn;
+}
+
+static void begin_fn() {
+    out = open_memstream(&out_buf, &out_len);
+}
+
+// Splits the text of the current function into insns.
+static void end_fn() {
+    fclose(out);
+    insns.first = insns.last = NULL;
+
+    char *p = out_buf;
+    while(*p) {
+        char *eol = strchr(p, '\n');
+        Insn *insn = parse_insn(p, eol - p);
+        insn->prev = insns.last;
+        if(insns.last) {
+            insns.last->next = insn;
+        } else {
+            insns.first = insn;
+        }
+        insns.last = insn;
+        p = eol + 1;
+    }
+    free(out_buf);
+}
+
+static void print_insns() {
+    for(Insn *insn=insns.first; insn; insn=insn->next) {
+        if(!insn->op) {
+            printf("%s\n", insn->text);
+        } else if(insn->src) {
+            printf("  %s %s, %s\n", insn->op, insn->dst, insn->src);
+        } else if(insn->dst) {
+            printf("  %s %s\n", insn->op, insn->dst);
+        } else {
+            printf("  %s\n", insn->op);
+        }
+    }
+}
+
+// Moves the cached values to the machine stack.
+static void flush() {
+    if(tos == TOS_RDI || tos == TOS_RDI_RAX) {
+        fprintf(out, "  push rdi\n");
+        depth++;
+    }
+    if(tos == TOS_RAX || tos == TOS_RDI_RAX) {
+        fprintf(out, "  push rax\n");
+        depth++;
+    }
+    tos = TOS_NONE;
+}
+
+// Frees rax for a new value.
+static void make_room() {
+    if(tos == TOS_RDI_RAX) {
+        fprintf(out, "  push rdi\n");
+        depth++;
+    }
+    if(tos == TOS_RAX || tos == TOS_RDI_RAX) {
+        fprintf(out, "  mov rdi, rax\n");
+        tos = TOS_RDI;
+    }
+}
+
+// Pushes the value in rax, which must have been freed by make_room() or
+// a pop.
+static void push_rax() {
+    if(!tos_cache) {
+        fprintf(out, "  push rax\n");
+        depth++;
+        return;
+    }
+    assert(tos == TOS_NONE || tos == TOS_RDI);
+    tos = (tos == TOS_RDI) ? TOS_RDI_RAX : TOS_RAX;
+}
+
+// Pushes the value in rdi. Nothing may be cached.
+static void push_rdi() {
+    if(!tos_cache) {
+        fprintf(out, "  push rdi\n");
+        depth++;
+        return;
+    }
+    assert(tos == TOS_NONE);
+    tos = TOS_RDI;
+}
+
+// push takes a sign-extended 32-bit immediate only, so a wider constant
+// goes through rax.
+static void push_imm(long val) {
+    if(!tos_cache && val == (int)val) {
+        fprintf(out, "  push %ld\n", val);
+        depth++;
+        return;
+    }
+    make_room();
+    fprintf(out, "  mov rax, %ld\n", val);
+    push_rax();
+}
+
+static void pop_rax() {
+    if(tos == TOS_NONE) {
+        fprintf(out, "  pop rax\n");
+        depth--;
+    } else if(tos == TOS_RDI) {
+        fprintf(out, "  mov rax, rdi\n");
+        tos = TOS_NONE;
+    } else {
+        tos = (tos == TOS_RDI_RAX) ? TOS_RDI : TOS_NONE;
+    }
+}
+
+// Pops a function argument. Arguments are popped from the last one, so
+// rdi is the last register popped into.
+static void pop_arg(char *reg) {
+    if(tos == TOS_NONE) {
+        fprintf(out, "  pop %s\n", reg);
+        depth--;
+    } else if(tos == TOS_RDI) {
+        if(strcmp(reg, "rdi")) {
+            fprintf(out, "  mov %s, rdi\n", reg);
+        }
+        tos = TOS_NONE;
+    } else {
+        assert(tos == TOS_RAX || strcmp(reg, "rdi"));
+        fprintf(out, "  mov %s, rax\n", reg);
+        tos = (tos == TOS_RDI_RAX) ? TOS_RDI : TOS_NONE;
+    }
+}
+
+// Pops the two operands of a binary operator, the right one into rdi
+// and the left one into rax. If may_swap is true, cached operands are
+// left where they are, and true is returned if they are the other way
+// around.
+static bool pop2(bool may_swap) {
+    int t = tos;
+    tos = TOS_NONE;
+    if(t == TOS_RDI_RAX) {
+        if(may_swap) return true;
+        fprintf(out, "  xchg rax, rdi\n");
+        return false;
+    }
+    if(t == TOS_RAX) {
+        fprintf(out, "  mov rdi, rax\n");
+    } else if(t == TOS_NONE) {
+        fprintf(out, "  pop rdi\n");
+        depth--;
+    }
+    fprintf(out, "  pop rax\n");
+    depth--;
+    return false;
+}
+
+static void dup() {
+    if(!tos_cache) {
+        fprintf(out, "  push [rsp]\n");
+        depth++;
+        return;
+    }
+    pop_rax();
+    push_rax();
+    make_room();
+    push_rax();
+}
+
+static void drop() {
+    if(tos == TOS_NONE) {
+        fprintf(out, "  add rsp, 8\n");
+        depth--;
+    } else {
+        tos = (tos == TOS_RDI_RAX) ? TOS_RDI : TOS_NONE;
+    }
+}
+
+// Moves the top value into rax, where every arm of a branch leaves it.
+static void top_to_rax() {
+    if(!tos_cache) return;
+    pop_rax();
+    push_rax();
+}
+
+// Spines of left-associative chains being generated by gen().
+static NodeStack spine;
+
 // pushes the given node's address to the stack.
 static void gen_addr(Node *node) {
     switch(node->kind) {
@@ -22,12 +293,19 @@ static void gen_addr(Node *node) {
             }
 
             Var *var = node->var;
+            assert(!var->cg_reg);
             if(var->is_local) {
                 // [rbp-%d] アドレスの値をraxに入れる
-                printf("  lea rax, [rbp-%d]\n", var->offset);
-                printf("  push rax\n");
-            } else { // global
-                printf("  push offset %s\n", var->name);
+                make_room();
+                fprintf(out, "  lea rax, [rbp-%d]\n", var->offset);
+                push_rax();
+            } else if(!tos_cache) { // global
+                fprintf(out, "  push offset %s\n", var->name);
+                depth++;
+            } else {
+                make_room();
+                fprintf(out, "  mov rax, offset %s\n", var->name);
+                push_rax();
             }
             return;
         }
@@ -36,9 +314,9 @@ static void gen_addr(Node *node) {
             return;
         case ND_MEMBER:
             gen_addr(node->lhs);
-            printf("  pop rax\n");
-            printf("  add rax, %d\n", node->member->offset);
-            printf("  push rax\n");
+            pop_rax();
+            fprintf(out, "  add rax, %d\n", node->member->offset);
+            push_rax();
             return;
     }
 
@@ -53,179 +331,586 @@ static void gen_lval(Node *node) {
 }
 
 static void load(Type *ty) {
-    printf("  pop rax\n");
+    pop_rax();
 
     if(ty->size == 1) {
-        printf("  movsx rax, byte ptr [rax]\n");
+        fprintf(out, "  movsx rax, byte ptr [rax]\n");
     } else if(ty->size == 2) { 
-        printf("  movsx rax, word ptr [rax]\n");
+        fprintf(out, "  movsx rax, word ptr [rax]\n");
     } else if(ty->size == 4) {
-        printf("  movsxd rax, dword ptr [rax]\n");
+        fprintf(out, "  movsxd rax, dword ptr [rax]\n");
     } else {
         assert(ty->size == 8);
-        printf("  mov rax, [rax]\n");
+        fprintf(out, "  mov rax, [rax]\n");
     }
 
-    printf("  push rax\n");
+    push_rax();
 }
 
 // store data to variable
 static void store(Type *ty) {
-    printf("  pop rdi\n"); // value
-    printf("  pop rax\n"); // variable address
+    // The value is in rdi and the address in rax, or the other way
+    // around if they were both cached.
+    bool swapped = pop2(true);
+    char *addr = tosreg8[swapped ? 1 : 0];
+    int val = swapped ? 0 : 1;
 
     if(ty->kind == TY_BOOL) {
-        printf("  cmp rdi, 0\n");
-        printf("  setne dil\n");
-        printf("  movzb rdi, dil\n");
+        fprintf(out, "  cmp %s, 0\n", tosreg8[val]);
+        fprintf(out, "  setne %s\n", tosreg1[val]);
+        fprintf(out, "  movzb %s, %s\n", tosreg8[val], tosreg1[val]);
     }
 
     if(ty->size == 1) { // char 
-        printf("  mov [rax], dil\n");
+        fprintf(out, "  mov [%s], %s\n", addr, tosreg1[val]);
     } else if(ty->size == 2) { // short
-        printf("  mov [rax], di\n");
+        fprintf(out, "  mov [%s], %s\n", addr, tosreg2[val]);
     } else if(ty->size == 4) { // int
-        printf("  mov [rax], edi\n");
+        fprintf(out, "  mov [%s], %s\n", addr, tosreg4[val]);
     } else {
         assert(ty->size == 8); // long
-        printf("  mov [rax], rdi\n");
+        fprintf(out, "  mov [%s], %s\n", addr, tosreg8[val]);
     }
 
-    printf("  push rdi\n");
+    if(swapped) {
+        push_rax();
+    } else {
+        push_rdi();
+    }
 }
 
 // データのcast
 static void truncate(Type *ty) {
-    printf("  pop rax\n");
+    pop_rax();
 
     if(ty->kind == TY_BOOL) {
-        printf("  cmp rax, 0\n");
-        printf("  setne al\n");
+        fprintf(out, "  cmp rax, 0\n");
+        fprintf(out, "  setne al\n");
     }
 
     if(ty->size == 1) {
-        printf("  movsx rax, al\n");
+        fprintf(out, "  movsx rax, al\n");
     } else if(ty->size == 2) {
-        printf("  movsx rax, ax\n");
+        fprintf(out, "  movsx rax, ax\n");
     } else if(ty->size == 4) {
-        printf("  movsxd rax, eax\n");
+        fprintf(out, "  movsxd rax, eax\n");
     }
     // long -> 8byteのときはそのまま使えばよいため何もしない
-    printf("  push rax\n");
+    push_rax();
 }
 
 static void inc(Type *ty) {
-    printf("  pop rax\n");
-    printf("  add rax, %d\n", ty->base ? ty->base->size : 1);
-    printf("  push rax\n");
+    pop_rax();
+    fprintf(out, "  add rax, %d\n", ty->base ? ty->base->size : 1);
+    push_rax();
 }
 
 static void dec(Type *ty) {
-    printf("  pop rax\n");
-    printf("  sub rax, %d\n", ty->base ? ty->base->size : 1);
-    printf("  push rax\n");
+    pop_rax();
+    fprintf(out, "  sub rax, %d\n", ty->base ? ty->base->size : 1);
+    push_rax();
+}
+
+static Var *reg_var(Node *node) {
+    if(node->kind == ND_VAR && node->var->cg_reg) return node->var;
+    return NULL;
+}
+
+static void load_var_reg(Var *var) {
+    char *reg = varreg[var->cg_reg - 1];
+    if(!tos_cache) {
+        fprintf(out, "  push %s\n", reg);
+        depth++;
+        return;
+    }
+    make_room();
+    fprintf(out, "  mov rax, %s\n", reg);
+    push_rax();
+}
+
+// Stores the top value to a register variable. The value stays on the
+// stack, converted to the type of the variable.
+static void store_var_reg(Var *var) {
+    truncate(var->ty);
+    pop_rax();
+    fprintf(out, "  mov %s, rax\n", varreg[var->cg_reg - 1]);
+    push_rax();
+}
+
+// Pushes the value of an lvalue to be updated, after its address unless
+// it is in a register.
+static void load_for_update(Node *lhs, Type *ty) {
+    Var *var = reg_var(lhs);
+    if(var) {
+        load_var_reg(var);
+        return;
+    }
+    gen_lval(lhs);
+    dup();
+    load(ty);
+}
+
+// Stores the updated value pushed after load_for_update().
+static void store_update(Node *lhs, Type *ty) {
+    Var *var = reg_var(lhs);
+    if(var) {
+        store_var_reg(var);
+    } else {
+        store(ty);
+    }
+}
+
+// Returns true if gen_binary() can take the operands of an operator the
+// other way around.
+static bool can_swap(NodeKind kind) {
+    switch(kind) {
+        case ND_ADD:
+        case ND_ADD_EQ:
+        case ND_PTR_ADD:
+        case ND_PTR_ADD_EQ:
+        case ND_MUL:
+        case ND_MUL_EQ:
+        case ND_BITAND:
+        case ND_BITAND_EQ:
+        case ND_BITOR:
+        case ND_BITOR_EQ:
+        case ND_BITXOR:
+        case ND_BITXOR_EQ:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            return true;
+    }
+    return false;
 }
 
 static void gen_binary(Node *node) {
-	printf("  pop rdi\n"); // value2
-	printf("  pop rax\n"); // value1
+    // value1 in rax and value2 in rdi, or the other way around if the
+    // operator allows it
+    bool swapped = pop2(can_swap(node->kind));
+    char *lhs = tosreg8[swapped ? 1 : 0];
+    char *rhs = tosreg8[swapped ? 0 : 1];
 
     // gen expression stack上に値を1つ残す
 	switch (node->kind) {
         case ND_NUM:
-            printf("  push %ld\n", node->val);
+            fprintf(out, "  push %ld\n", node->val);
             if(node->val == (int)node->val) { // on int size
-                printf("  push %ld\n", node->val);
+                fprintf(out, "  push %ld\n", node->val);
             } else { // long type
-                printf("  movabs rax, %ld\n", node->val);
-                printf("  push rax\n");
+                fprintf(out, "  movabs rax, %ld\n", node->val);
+                fprintf(out, "  push rax\n");
             }
             return;
 		case ND_ADD:
         case ND_ADD_EQ:
-			printf("  add rax, rdi\n");
+			fprintf(out, "  add rax, rdi\n");
 			break;
         case ND_PTR_ADD:
         case ND_PTR_ADD_EQ:
-            printf("  imul rdi, %d\n", node->ty->base->size); // 型のサイズ分をかける
-            printf("  add rax, rdi\n");
+            if(strength_reduce) {
+                emit_mul_imm(out, rhs, node->ty->base->size);
+            } else {
+                fprintf(out, "  imul %s, %d\n", rhs, node->ty->base->size); // 型のサイズ分をかける
+            }
+            fprintf(out, "  add rax, rdi\n");
             break;
 		case ND_SUB:
         case ND_SUB_EQ:
-			printf("  sub rax, rdi\n");
+			fprintf(out, "  sub rax, rdi\n");
 			break;
         case ND_PTR_SUB:
         case ND_PTR_SUB_EQ:
-            printf("  imul rdi, %d\n", node->ty->base->size); // 型のサイズ分をかける
-            printf("  sub rax, rdi\n");
+            if(strength_reduce) {
+                emit_mul_imm(out, "rdi", node->ty->base->size);
+            } else {
+                fprintf(out, "  imul rdi, %d\n", node->ty->base->size); // 型のサイズ分をかける
+            }
+            fprintf(out, "  sub rax, rdi\n");
             break;
         case ND_PTR_DIFF:
-            printf("  sub rax, rdi\n");
-            printf("  cqo\n"); // raxを符号拡張して rdx:raxに設定
-            printf("  mov rdi, %d\n", node->lhs->ty->base->size);
-            printf("  idiv rdi\n"); // rdx:raxから型のサイズ分除算
+            fprintf(out, "  sub rax, rdi\n");
+            if(strength_reduce && can_div_imm(node->lhs->ty->base->size)) {
+                // The difference is a multiple of the size, so a shift
+                // needs no rounding.
+                int k = exact_log2(node->lhs->ty->base->size);
+                if(k < 0) {
+                    emit_div_imm(out, node->lhs->ty->base->size, false);
+                } else if(k > 0) {
+                    fprintf(out, "  sar rax, %d\n", k);
+                }
+                break;
+            }
+            fprintf(out, "  cqo\n"); // raxを符号拡張して rdx:raxに設定
+            fprintf(out, "  mov rdi, %d\n", node->lhs->ty->base->size);
+            fprintf(out, "  idiv rdi\n"); // rdx:raxから型のサイズ分除算
             break;
 		case ND_MUL:
         case ND_MUL_EQ:
-			printf("  imul rax, rdi\n");
+			fprintf(out, "  imul rax, rdi\n");
 			break;
 		case ND_DIV:
         case ND_DIV_EQ:
-			printf("  cqo\n");
-			printf("  idiv rdi\n");
+			fprintf(out, "  cqo\n");
+			fprintf(out, "  idiv rdi\n");
 			break;
+        case ND_MOD:
+        case ND_MOD_EQ:
+            fprintf(out, "  cqo\n");
+            fprintf(out, "  idiv rdi\n");
+            fprintf(out, "  mov rax, rdx\n");
+            break;
         case ND_BITAND:
         case ND_BITAND_EQ:
-            printf("  and rax, rdi\n");
+            fprintf(out, "  and rax, rdi\n");
             break;
         case ND_BITOR:
         case ND_BITOR_EQ:
-            printf("  or rax, rdi\n");
+            fprintf(out, "  or rax, rdi\n");
             break;
         case ND_BITXOR:
         case ND_BITXOR_EQ:
-            printf("  xor rax, rdi\n");
+            fprintf(out, "  xor rax, rdi\n");
             break;
         case ND_SHL:
         case ND_SHL_EQ:
-            printf("  mov cl, dil\n");
-            printf("  shl rax, cl\n");
+            fprintf(out, "  mov cl, dil\n");
+            fprintf(out, "  shl rax, cl\n");
             break;
         case ND_SHR:
         case ND_SHR_EQ:
-            printf("  mov cl, dil\n");
-            printf("  sar rax, cl\n");
+            fprintf(out, "  mov cl, dil\n");
+            fprintf(out, "  sar rax, cl\n");
             break;
 		case ND_EQ:
-			printf("  cmp rax, rdi\n");
-			printf("  sete al\n");
-			printf("  movzb rax, al\n");
+			fprintf(out, "  cmp %s, %s\n", lhs, rhs);
+			fprintf(out, "  sete al\n");
+			fprintf(out, "  movzb rax, al\n");
 			break;
 		case ND_NE:
-			printf("  cmp rax, rdi\n");
-			printf("  setne al\n");
-			printf("  movzb rax, al\n");
+			fprintf(out, "  cmp %s, %s\n", lhs, rhs);
+			fprintf(out, "  setne al\n");
+			fprintf(out, "  movzb rax, al\n");
 			break;
 		case ND_LT:
-			printf("  cmp rax, rdi\n");
-			printf("  setl al\n");
-			printf("  movzb rax, al\n");
+			fprintf(out, "  cmp %s, %s\n", lhs, rhs);
+			fprintf(out, "  setl al\n");
+			fprintf(out, "  movzb rax, al\n");
 			break;
 		case ND_LE:
-			printf("  cmp rax, rdi\n");
-			printf("  setle al\n");
-			printf("  movzb rax, al\n");
+			fprintf(out, "  cmp %s, %s\n", lhs, rhs);
+			fprintf(out, "  setle al\n");
+			fprintf(out, "  movzb rax, al\n");
 			break;
 	}
 
-	printf("  push rax\n");
+	push_rax();
+
+}
+
+// Applies an operator with a constant right operand to the value on top
+// of the stack, without pushing the constant. Multiplication and
+// division become shifts and the like. Returns false if the operator is
+// not one of those or the constant is out of range.
+static bool gen_binary_imm(Node *node) {
+    if(!strength_reduce || node->rhs->kind != ND_NUM) return false;
+    long val = node->rhs->val;
+
+    switch(node->kind) {
+        case ND_PTR_ADD:
+        case ND_PTR_ADD_EQ:
+        case ND_PTR_SUB:
+        case ND_PTR_SUB_EQ: {
+            long offset = val * node->ty->base->size;
+            if(offset != (int)offset) return false;
+            bool is_add = node->kind == ND_PTR_ADD || node->kind == ND_PTR_ADD_EQ;
+            pop_rax();
+            fprintf(out, "  %s rax, %ld\n", is_add ? "add" : "sub", offset);
+            push_rax();
+            return true;
+        }
+        case ND_MUL:
+        case ND_MUL_EQ:
+            if(!can_mul_imm(val)) return false;
+            pop_rax();
+            emit_mul_imm(out, "rax", val);
+            push_rax();
+            return true;
+        case ND_DIV:
+        case ND_DIV_EQ:
+        case ND_MOD:
+        case ND_MOD_EQ:
+            if(!can_div_imm(val)) return false;
+            pop_rax();
+            emit_div_imm(out, val, node->kind == ND_MOD || node->kind == ND_MOD_EQ);
+            push_rax();
+            return true;
+    }
+    return false;
+}
+
+// Returns true if a node is a binary operator that is generated by
+// evaluating both operands and then calling gen_binary().
+static bool is_plain_binary(NodeKind kind) {
+    switch(kind) {
+        case ND_ADD:
+        case ND_PTR_ADD:
+        case ND_SUB:
+        case ND_PTR_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_MOD:
+        case ND_BITAND:
+        case ND_BITOR:
+        case ND_BITXOR:
+        case ND_SHL:
+        case ND_SHR:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            return true;
+    }
+    return false;
+}
+
+// Generates a left-associative chain such as `a + b - c * d` without
+// recursing into the left operands. The nodes on the left spine are
+// collected first, then the leftmost operand is evaluated and every
+// operator is applied bottom-up.
+static void gen_binary_chain(Node *node) {
+    int base = spine.len;
+    for(Node *n=node; is_plain_binary(n->kind); n=n->lhs) {
+        push_node(&spine, n);
+    }
+
+    gen(spine.data[spine.len - 1]->lhs);
+    while(spine.len > base) {
+        Node *n = spine.data[--spine.len];
+        if(!gen_binary_imm(n)) {
+            gen(n->rhs);
+            gen_binary(n);
+        }
+    }
+}
+
+// Returns the jump taken if a comparison is true, or false if negate.
+static char *jump_of(NodeKind kind, bool negate) {
+    switch(kind) {
+        case ND_EQ:
+            return negate ? "jne" : "je";
+        case ND_NE:
+            return negate ? "je" : "jne";
+        case ND_LT:
+            return negate ? "jge" : "jl";
+    }
+    return negate ? "jg" : "jle";
+}
+
+// Jumps to .L.<name>.<seq> if a condition is `truth` and falls through
+// otherwise. Comparisons become a cmp and a conditional jump, and `&&`,
+// `||` and `!` only jump, without materializing their 0 or 1. The
+// value stack is the same at the jump and after it.
+static void gen_branch(Node *node, bool truth, char *name, int seq) {
+    switch(node->kind) {
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE: {
+            gen(node->lhs);
+            Node *rhs = node->rhs;
+            if(rhs->kind == ND_NUM && rhs->val == (int)rhs->val) {
+                pop_rax();
+                fprintf(out, "  cmp rax, %ld\n", rhs->val);
+            } else {
+                gen(rhs);
+                bool swapped = pop2(true);
+                fprintf(out, "  cmp %s, %s\n", tosreg8[swapped ? 1 : 0], tosreg8[swapped ? 0 : 1]);
+            }
+            fprintf(out, "  %s .L.%s.%d\n", jump_of(node->kind, !truth), name, seq);
+            return;
+        }
+        case ND_NOT:
+            gen_branch(node->lhs, !truth, name, seq);
+            return;
+        case ND_NUM:
+            if((node->val != 0) == truth) {
+                fprintf(out, "  jmp .L.%s.%d\n", name, seq);
+            }
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            // An operand that decides the result on its own jumps to the
+            // target if that result is `truth`, and past the rest if not.
+            bool is_and = node->kind == ND_LOGAND;
+            bool direct = (is_and != truth);
+            int skip = direct ? 0 : labelseq++;
+            int base = spine.len;
+            for(Node *n=node; n->kind == node->kind; n=n->lhs) {
+                push_node(&spine, n);
+            }
+
+            Node *operand = spine.data[spine.len - 1]->lhs;
+            while(spine.len > base) {
+                if(direct) {
+                    gen_branch(operand, truth, name, seq);
+                } else {
+                    gen_branch(operand, !truth, "skip", skip);
+                }
+                operand = spine.data[--spine.len]->rhs;
+            }
+            gen_branch(operand, truth, name, seq);
+            if(!direct) {
+                fprintf(out, ".L.skip.%d:\n", skip);
+            }
+            return;
+        }
+    }
 
+    gen(node);
+    pop_rax();
+    fprintf(out, "  cmp rax, 0\n");
+    fprintf(out, "  %s .L.%s.%d\n", truth ? "jne" : "je", name, seq);
+}
+
+// Generates `&&` or `||`. A chain of the same operator shares one
+// short-circuit label and is walked without recursion.
+static void gen_logical(Node *node) {
+    int seq = labelseq++;
+    bool is_and = (node->kind == ND_LOGAND);
+    char *target = is_and ? "false" : "true";
+
+    int base = spine.len;
+    for(Node *n=node; n->kind == node->kind; n=n->lhs) {
+        push_node(&spine, n);
+    }
+
+    flush();
+    gen_branch(spine.data[spine.len - 1]->lhs, !is_and, target, seq);
+    while(spine.len > base) {
+        Node *n = spine.data[--spine.len];
+        gen_branch(n->rhs, !is_and, target, seq);
+    }
+
+    int d = depth;
+    push_imm(is_and ? 1 : 0);
+    fprintf(out, "  jmp .L.end.%d\n", seq);
+    fprintf(out, ".L.%s.%d:\n", target, seq);
+    tos = TOS_NONE;
+    depth = d;
+    push_imm(is_and ? 0 : 1);
+    fprintf(out, ".L.end.%d:\n", seq);
+}
+
+// Loads the arguments of a call into the argument registers.
+static void gen_args(Node *node) {
+    // The callee may clobber the cached values.
+    flush();
+    int nargs = 0;
+    for(Node *arg = node->args; arg; arg=arg->next) {
+        gen(arg);
+        nargs++;
+    }
+    if(nargs > MAX_ARGS) error_tok(node->tok, "too many arguments");
+    for(int i=nargs-1; i>=0; i--) {
+        pop_arg(argreg8[i]);
+    }
+}
+
+// Returns true if a returned value is a call that can jump to the callee
+// with the frame torn down, leaving the return to it. A _Bool result
+// would have to be converted after the call.
+static bool is_sibling_call(Node *node) {
+    if(!sibling_calls || !node || node->kind != ND_FUNCALL) return false;
+    if(!strcmp(node->funcname, "__builtin_va_start")) return false;
+    return node->ty->kind != TY_BOOL && node->ty->kind != TY_STRUCT;
+}
+
+// Where the i-th register holding a variable is saved
+static int saved_reg_offset(int i) {
+    return fn_stack_size - (nvar_regs - 1 - i) * 8;
+}
+
+// Restores the saved registers and RSP as they were at the entry of the
+// function.
+static void emit_epilogue() {
+    for(int i=0; i<nvar_regs; i++) {
+        fprintf(out, "  mov %s, [rbp-%d]\n", varreg[i], saved_reg_offset(i));
+    }
+    if(has_frame) {
+        fprintf(out, "  mov rsp, rbp\n");
+        fprintf(out, "  pop rbp\n");
+    }
+}
+
+// Jumps to the default case of a switch, or out of it if it has none.
+// `op` is a jump instruction, or .quad for an entry of a jump table.
+static void emit_default(char *op, Node *sw) {
+    if(sw->default_case) {
+        fprintf(out, "  %s .L.case.%d\n", op, sw->default_case->case_label);
+    } else {
+        fprintf(out, "  %s .L.break.%d\n", op, sw->case_label);
+    }
+}
+
+// Dispatches on the value in rax by binary search over the sorted
+// cases[lo..hi).
+static void gen_case_bsearch(Node *sw, Node **cases, int lo, int hi) {
+    if(hi - lo < SWITCH_MIN_CASES) {
+        for(int i=lo; i<hi; i++) {
+            fprintf(out, "  cmp rax, %ld\n", cases[i]->val);
+            fprintf(out, "  je .L.case.%d\n", cases[i]->case_label);
+        }
+        emit_default("jmp", sw);
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+    int seq = labelseq++;
+    fprintf(out, "  cmp rax, %ld\n", cases[mid]->val);
+    fprintf(out, "  je .L.case.%d\n", cases[mid]->case_label);
+    fprintf(out, "  jl .L.lt.%d\n", seq);
+    gen_case_bsearch(sw, cases, mid + 1, hi);
+    fprintf(out, ".L.lt.%d:\n", seq);
+    gen_case_bsearch(sw, cases, lo, mid);
+}
+
+// Dispatches on the value in rax through a jump table in .rodata.
+static void gen_case_table(Node *sw, SwitchPlan *plan) {
+    long min = plan->cases[0]->val;
+    if(min) {
+        fprintf(out, "  sub rax, %ld\n", min);
+    }
+    fprintf(out, "  cmp rax, %d\n", plan->ntable - 1);
+    emit_default("ja", sw);
+    fprintf(out, "  jmp qword ptr [.L.table.%d+rax*8]\n", sw->case_label);
+
+    fprintf(out, ".section .rodata\n");
+    fprintf(out, ".align 8\n");
+    fprintf(out, ".L.table.%d:\n", sw->case_label);
+    for(int i=0; i<plan->ntable; i++) {
+        if(plan->table[i]) {
+            fprintf(out, "  .quad .L.case.%d\n", plan->table[i]->case_label);
+        } else {
+            emit_default(".quad", sw);
+        }
+    }
+    fprintf(out, ".text\n");
 }
 
 // generate code for a given node
+//
+// Left-associative chains of binary operators, && and || are walked
+// without recursion, so `a + a + ... + a` takes constant C stack however
+// long it is. Everything else still recurses once per level: right
+// operands, ?:, unary operators, nested statement expressions and
+// statements. The parser recurses on the same nesting, so it bounds the
+// depth gen() can reach.
 static void gen(Node *node) {
 	if(node->kind == ND_NUM) {
-		printf("  push %ld\n", node->val);
+		push_imm(node->val);
 		return;
 	}
 
@@ -234,6 +919,10 @@ static void gen(Node *node) {
         case ND_NULL:
             return;
         case ND_VAR:
+            if(node->var->cg_reg) {
+                load_var_reg(node->var);
+                return;
+            }
             if(node->init) {
                 gen(node->init);
             }
@@ -249,51 +938,53 @@ static void gen(Node *node) {
             }
             return;
         case ND_ASSIGN:
+            if(reg_var(node->lhs)) {
+                gen(node->rhs);
+                store_var_reg(node->lhs->var);
+                return;
+            }
             gen_lval(node->lhs);
             gen(node->rhs);
             store(node->ty);
             return;
         case ND_TERNARY: {
             int seq = labelseq++;
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je  .L.else.%d\n", seq);
+            flush();
+            gen_branch(node->cond, false, "else", seq);
+            int d = depth;
             gen(node->then);
-            printf("  jmp .L.end.%d\n", seq);
-            printf(".L.else.%d:\n", seq);
+            top_to_rax();
+            int then_depth = depth;
+            fprintf(out, "  jmp .L.end.%d\n", seq);
+            fprintf(out, ".L.else.%d:\n", seq);
+            tos = TOS_NONE;
+            depth = d;
             gen(node->els);
-            printf(".L.end.%d:\n", seq);
+            top_to_rax();
+            assert(depth == then_depth);
+            fprintf(out, ".L.end.%d:\n", seq);
             return;
         }
         case ND_PRE_INC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->ty);
+            load_for_update(node->lhs, node->ty);
             inc(node->ty);
-            store(node->ty);
+            store_update(node->lhs, node->ty);
             return;
         case ND_PRE_DEC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->ty);
+            load_for_update(node->lhs, node->ty);
             dec(node->ty);
-            store(node->ty);
+            store_update(node->lhs, node->ty);
             return;
         case ND_POST_INC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->ty);
+            load_for_update(node->lhs, node->ty);
             inc(node->ty);
-            store(node->ty);
+            store_update(node->lhs, node->ty);
             dec(node->ty);
             return;
         case ND_POST_DEC:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->ty);
+            load_for_update(node->lhs, node->ty);
             dec(node->ty);
-            store(node->ty);
+            store_update(node->lhs, node->ty);
             inc(node->ty);
             return;
         case ND_ADD_EQ:
@@ -302,17 +993,18 @@ static void gen(Node *node) {
         case ND_PTR_SUB_EQ:
         case ND_MUL_EQ:
         case ND_DIV_EQ:
+        case ND_MOD_EQ:
         case ND_SHL_EQ:
         case ND_SHR_EQ:
         case ND_BITAND_EQ:
         case ND_BITOR_EQ:
         case ND_BITXOR_EQ:
-            gen_lval(node->lhs);
-            printf("  push [rsp]\n");
-            load(node->lhs->ty);
-            gen(node->rhs);
-            gen_binary(node);
-            store(node->ty);
+            load_for_update(node->lhs, node->lhs->ty);
+            if(!gen_binary_imm(node)) {
+                gen(node->rhs);
+                gen_binary(node);
+            }
+            store_update(node->lhs, node->ty);
             return;
         case ND_COMMA:
             gen(node->lhs);
@@ -329,72 +1021,35 @@ static void gen(Node *node) {
             return;
         case ND_NOT:
             gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
-            printf("  push rax\n");
+            pop_rax();
+            fprintf(out, "  cmp rax, 0\n");
+            fprintf(out, "  sete al\n");
+            fprintf(out, "  movzb rax, al\n");
+            push_rax();
             return;
         case ND_BITNOT:
             gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  not rax\n");
-            printf("  push rax\n");
-            return;
-        case ND_LOGAND: {
-            // ０と比較してtrue(1)が帰ってきたらfalse(0)をpush, そうでなければ1をpush
-            int seq = labelseq++;
-            gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n"); 
-            printf("  je .L.false.%d\n", seq);
-            gen(node->rhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je .L.false.%d\n", seq);
-            printf("  push 1\n");
-            printf("  jmp .L.end.%d\n", seq);
-            printf(".L.false.%d:\n", seq);
-            printf("  push 0\n");
-            printf(".L.end.%d:\n", seq);
+            pop_rax();
+            fprintf(out, "  not rax\n");
+            push_rax();
             return;
-        }
-        case ND_LOGOR: {
-            int seq = labelseq++;
-            gen(node->lhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  jne .L.true.%d\n", seq);
-            gen(node->rhs);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  jne .L.true.%d\n", seq);
-            printf("  push 0\n");
-            printf("  jmp .L.end.%d\n", seq);
-            printf(".L.true.%d:\n", seq);
-            printf("  push 1\n");
-            printf(".L.end.%d:\n", seq);
+        case ND_LOGAND:
+        case ND_LOGOR:
+            gen_logical(node);
             return;
-        }
         case ND_IF: {
             int seq = labelseq++;
             if(node->els) {
-                gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je .L.else.%d\n", seq);
+                gen_branch(node->cond, false, "else", seq);
                 gen(node->then);
-                printf("  jmp .L.end.%d\n", seq);
-                printf(".L.else.%d:\n", seq);
+                fprintf(out, "  jmp .L.end.%d\n", seq);
+                fprintf(out, ".L.else.%d:\n", seq);
                 gen(node->els);
-                printf(".L.end.%d:\n", seq);
+                fprintf(out, ".L.end.%d:\n", seq);
             } else {
-				gen(node->cond);
-				printf("  pop rax\n");
-				printf("  cmp rax, 0\n");
-				printf("  je  .L.end.%d\n", seq);
+				gen_branch(node->cond, false, "end", seq);
 				gen(node->then);
-				printf(".L.end.%d:\n", seq);
+				fprintf(out, ".L.end.%d:\n", seq);
             }
             return;
         }
@@ -404,14 +1059,11 @@ static void gen(Node *node) {
             int cont = contseq;
             brkseq = contseq = seq;
 
-			printf(".L.continue.%d:\n", seq);
-			gen(node->cond);
-			printf("  pop rax\n");
-			printf("  cmp rax, 0\n");
-			printf("  je  .L.break.%d\n", seq);
+			fprintf(out, ".L.continue.%d:\n", seq);
+			gen_branch(node->cond, false, "break", seq);
 			gen(node->then);
-			printf("  jmp .L.continue.%d\n", seq);
-			printf(".L.break.%d:\n", seq);
+			fprintf(out, "  jmp .L.continue.%d\n", seq);
+			fprintf(out, ".L.break.%d:\n", seq);
 
             brkseq = brk;
             contseq = cont;
@@ -426,20 +1078,17 @@ static void gen(Node *node) {
 			if(node->init) {
 				gen(node->init);
 			}
-			printf(".L.begin.%d:\n", seq);
+			fprintf(out, ".L.begin.%d:\n", seq);
 			if(node->cond) {
-				gen(node->cond);
-				printf("  pop rax\n");
-				printf("  cmp rax, 0\n");
-				printf("  je  .L.break.%d\n", seq);
+				gen_branch(node->cond, false, "break", seq);
 			}
 			gen(node->then);
-            printf(".L.continue.%d:\n", seq);
+            fprintf(out, ".L.continue.%d:\n", seq);
 			if(node->inc) {
 				gen(node->inc);
 			}
-			printf("  jmp  .L.begin.%d\n", seq);
-			printf(".L.break.%d:\n", seq);
+			fprintf(out, "  jmp  .L.begin.%d\n", seq);
+			fprintf(out, ".L.break.%d:\n", seq);
 
             brkseq = brk;
             contseq = cont;
@@ -451,14 +1100,11 @@ static void gen(Node *node) {
             int cont = contseq;
             brkseq = contseq = seq;
 
-            printf(".L.begin.%d:\n", seq);
+            fprintf(out, ".L.begin.%d:\n", seq);
             gen(node->then);
-            printf(".L.continue.%d:\n", seq);
-            gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  jne .L.begin.%d\n", seq);
-            printf(".L.break.%d:\n", seq);
+            fprintf(out, ".L.continue.%d:\n", seq);
+            gen_branch(node->cond, true, "begin", seq);
+            fprintf(out, ".L.break.%d:\n", seq);
 
             brkseq = brk;
             contseq = cont;
@@ -471,40 +1117,51 @@ static void gen(Node *node) {
             node->case_label = seq;
 
             gen(node->cond);
-            printf("  pop rax\n");
+            pop_rax();
 
             for(Node *n = node->case_next; n; n=n->case_next) {
                 n->case_label = labelseq++;
                 n->case_end_label = seq;
-                printf("  cmp rax, %ld\n", n->val);
-                printf("  je .L.case.%d\n", n->case_label);
             }
-
             if(node->default_case) {
-                int i = labelseq++;
-                node->default_case->case_label = i;
+                node->default_case->case_label = labelseq++;
                 node->default_case->case_end_label = seq;
-                printf("  jmp .L.case.%d\n", i);
             }
 
-            printf("  jmp .L.break.%d\n", seq);
+            SwitchPlan *plan = plan_switch(node);
+            if(plan->kind == SW_TABLE) {
+                gen_case_table(node, plan);
+            } else if(plan->kind == SW_BSEARCH) {
+                gen_case_bsearch(node, plan->cases, 0, plan->ncases);
+            } else {
+                for(Node *n = node->case_next; n; n=n->case_next) {
+                    fprintf(out, "  cmp rax, %ld\n", n->val);
+                    fprintf(out, "  je .L.case.%d\n", n->case_label);
+                }
+                if(node->default_case) {
+                    fprintf(out, "  jmp .L.case.%d\n", node->default_case->case_label);
+                }
+                fprintf(out, "  jmp .L.break.%d\n", seq);
+            }
             gen(node->then);
-            printf(".L.break.%d:\n", seq);
+            fprintf(out, ".L.break.%d:\n", seq);
 
             brkseq = brk;
             return;
         }
         case ND_CASE:
-            printf(".L.case.%d:\n", node->case_label);
+            fprintf(out, ".L.case.%d:\n", node->case_label);
             gen(node->lhs);
             return;
         case ND_EXPR_STMT:
             gen(node->lhs);
 			// 式を評価した結果を捨てるためにstackを戻す
-            printf("  add rsp, 8\n");
+            drop();
             return;
 		case ND_BLOCK:
         case ND_STMT_EXPR:
+            // Statements start with nothing cached.
+            flush();
 			for(Node *n = node->body; n; n=n->next) {
 				gen(n);
 			}
@@ -513,72 +1170,75 @@ static void gen(Node *node) {
             if(brkseq == 0) {
                 error_tok(node->tok, "stray break");
             }
-            printf("  jmp .L.break.%d\n", brkseq);
+            fprintf(out, "  jmp .L.break.%d\n", brkseq);
             return;
         case ND_CONTINUE:
             if(contseq == 0) {
                 error_tok(node->tok, "stray continue");
             }
-            printf("  jmp .L.continue.%d\n", contseq);
+            fprintf(out, "  jmp .L.continue.%d\n", contseq);
             return;
         case ND_GOTO:
-            printf("  jmp .L.label.%s.%s\n", funcname, node->label_name);
+            fprintf(out, "  jmp .L.label.%s.%s\n", funcname, node->label_name);
             return;
         case ND_LABEL:
-            printf(".L.label.%s.%s:\n", funcname, node->label_name);
+            fprintf(out, ".L.label.%s.%s:\n", funcname, node->label_name);
             gen(node->lhs);
             return;
         case ND_FUNCALL: {
             if(!strcmp(node->funcname, "__builtin_va_start")) {
                 // dword:32bit, qword:64bit
-                printf("  pop rax\n");
-                printf("  mov edi, dword ptr [rbp-8]\n");
-                printf("  mov dword ptr [rax], 0\n");
-                printf("  mov dword ptr [rax+4], 0\n");
-                printf("  mov qword ptr [rax+8], rdi\n");
-                printf("  mov qword ptr [rax+16], 0\n");
+                gen(node->args);
+                pop_rax();
+                fprintf(out, "  mov edi, dword ptr [rbp-8]\n");
+                fprintf(out, "  mov dword ptr [rax], 0\n");
+                fprintf(out, "  mov dword ptr [rax+4], 0\n");
+                fprintf(out, "  mov qword ptr [rax+8], rdi\n");
+                fprintf(out, "  mov qword ptr [rax+16], 0\n");
+                push_rax();
                 return;
             }
-            int nargs = 0;
-            for(Node *arg = node->args; arg; arg=arg->next) {
-                gen(arg);
-                nargs++;
-            }
-            for(int i=nargs-1; i>=0; i--) {
-                printf("  pop %s\n", argreg8[i]);
-            }
+            gen_args(node);
 
             // We need to align RSP to a 16 byte boundary because it is ABI!
-            // RAX is set to 0 for variadict function.
-            int seq = labelseq++;
-            printf("  mov rax, rsp\n");
-            // 0でない場合jump
-            // 16で割り切れない <- 15とANDをとって0にならない
-            printf("  and rax, 15\n");
-            printf("  jnz .L.call.%d\n", seq);
-            printf("  mov rax, 0\n"); // 0にしておかないと次の関数を呼ぶときのノイズになる
-            printf("  call %s\n", node->funcname);
-            printf("  jmp .L.end.%d\n", seq);
-            printf(".L.call.%d:\n", seq);
-            printf("  sub rsp, 8\n"); // padding to align 16 byte boundary
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->funcname);
-            printf("  add rsp, 8\n"); // remove padding
-            printf(".L.end.%d:\n", seq);
+            // RBP is aligned, so the padding follows from the depth of
+            // the stack. RAX is set to 0 for variadict function.
+            bool pad = (fn_stack_size + depth * 8) % 16 != 0;
+            if(pad) {
+                fprintf(out, "  sub rsp, 8\n"); // padding to align 16 byte boundary
+            }
+            fprintf(out, "  mov rax, 0\n"); // 0にしておかないと次の関数を呼ぶときのノイズになる
+            fprintf(out, "  call %s\n", node->funcname);
+            if(pad) {
+                fprintf(out, "  add rsp, 8\n"); // remove padding
+            }
             if(node->ty->kind == TY_BOOL) {
-                printf("  movzb rax, al\n");
+                fprintf(out, "  movzb rax, al\n");
             }
-            printf("  push rax\n");
+            push_rax();
             return;
         }
         case ND_RETURN:
+            if(is_sibling_call(node->lhs)) {
+                gen_args(node->lhs);
+                emit_epilogue();
+                fprintf(out, "  mov rax, 0\n");
+                fprintf(out, "  jmp %s\n", node->lhs->funcname);
+                count_stat("sibling-calls");
+                return;
+            }
             // 左辺が存在する場合のみ, raxに返り値をpopする
             if(node->lhs) {
                 gen(node->lhs);
                 // raxにpopしてから呼び出し元に戻る
-                printf("  pop rax\n");
+                pop_rax();
             }
-            printf("  jmp .L.return.%s\n", funcname);
+            // Without RBP to restore RSP from, a return from inside an
+            // expression drops the values below it.
+            if(!has_frame && depth) {
+                fprintf(out, "  add rsp, %d\n", depth * 8);
+            }
+            fprintf(out, "  jmp .L.return.%s\n", funcname);
             return;
         case ND_CAST:
             gen(node->lhs);
@@ -586,14 +1246,129 @@ static void gen(Node *node) {
             return;
     }
 
-	gen(node->lhs);
-	gen(node->rhs);
+    gen_binary_chain(node);
+}
+
+static int count_zeros(char *buf, int pos, int end) {
+    int n = 0;
+    while(pos + n < end && !buf[pos + n]) {
+        n++;
+    }
+    return n;
+}
 
-    gen_binary(node);
+static bool is_text(char c) {
+    return (' ' <= c && c <= '~') || c == '\n' || c == '\t';
+}
+
+static int count_text(char *buf, int pos, int end) {
+    int n = 0;
+    while(pos + n < end && is_text(buf[pos + n])) {
+        n++;
+    }
+    return n;
+}
+
+// Returns the length of a run of zeros at pos that is worth a .zero
+// directive, or 0. The run is kept a multiple of the element size, a
+// power of two, so that the following elements stay aligned.
+static int zero_run(char *buf, int pos, int end, int unit) {
+    if(pos & (unit - 1)) return 0;
+    int n = count_zeros(buf, pos, end);
+    if(pos + n == end) return n;
+    n = n / unit * unit;
+    return (n >= 8) ? n : 0;
+}
+
+// Reads a little-endian signed integer of sz bytes.
+static long read_data(char *buf, int sz) {
+    unsigned long val = 0;
+    for(int i=sz-1; i>=0; i--) {
+        val = (val << 8) | (buf[i] & 255);
+    }
+    if(sz == 1) return (char)val;
+    if(sz == 2) return (short)val;
+    if(sz == 4) return (int)val;
+    return (long)val;
+}
+
+static char *data_directive(int sz) {
+    if(sz == 1) return ".byte";
+    if(sz == 2) return ".short";
+    if(sz == 4) return ".long";
+    return ".quad";
+}
+
+// Emits text as .string if it is followed by a NUL, or as .ascii.
+static void emit_text_data(char *buf, int len, bool is_string) {
+    printf("  %s \"", is_string ? ".string" : ".ascii");
+    for(int i=0; i<len; i++) {
+        char c = buf[i];
+        if(c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if(c == '\n') {
+            printf("\\n");
+        } else if(c == '\t') {
+            printf("\\t");
+        } else {
+            printf("%c", c);
+        }
+    }
+    printf("\"\n");
+}
+
+// Emits buf[pos..end). Runs of zeros become .zero, text in byte-sized
+// data becomes .ascii or .string, and other bytes are grouped into
+// lines of .byte/.short/.long/.quad of the variable's element size.
+static void emit_bytes(char *buf, int pos, int end, int unit) {
+    while(pos < end) {
+        int zeros = zero_run(buf, pos, end, unit);
+        if(zeros) {
+            printf("  .zero %d\n", zeros);
+            pos += zeros;
+            continue;
+        }
+
+        if(unit == 1) {
+            int len = count_text(buf, pos, end);
+            if(len) {
+                bool is_string = pos + len < end && !buf[pos + len];
+                emit_text_data(buf + pos, len, is_string);
+                pos += is_string ? len + 1 : len;
+                continue;
+            }
+        }
+
+        int sz = unit;
+        while((pos & (sz - 1)) || end - pos < sz) {
+            sz /= 2;
+        }
+
+        printf("  %s %ld", data_directive(sz), read_data(buf + pos, sz));
+        pos += sz;
+        for(int n=1; n<16 && end - pos >= sz; n++) {
+            if(zero_run(buf, pos, end, unit)) break;
+            if(unit == 1 && is_text(buf[pos])) break;
+            printf(", %ld", read_data(buf + pos, sz));
+            pos += sz;
+        }
+        printf("\n");
+    }
+}
+
+static void emit_gvar_data(Var *var) {
+    int pos = 0;
+    for(Relocation *rel = var->rel; rel; rel = rel->next) {
+        emit_bytes(var->init_data, pos, rel->offset, var->ty->align);
+        // .quad 64bitの数字を扱う時に使う(ほかは.byteと同じ)
+        printf("  .quad %s%+ld\n", rel->label, rel->addend);
+        pos = rel->offset + 8;
+    }
+    emit_bytes(var->init_data, pos, var->ty->size, var->ty->align);
 }
 
 // set global data
-static void emit_data(Program *prog) {
+void emit_data(Program *prog) {
     for(VarList *vl = prog->globals; vl; vl=vl->next) {
         if(!vl->var->is_static) {
             // global directive variable is able to access from other files.
@@ -606,7 +1381,7 @@ static void emit_data(Program *prog) {
 
     for(VarList *vl=prog->globals; vl; vl=vl->next) {
         Var *var = vl->var;
-        if(var->initializer) continue;
+        if(var->init_data) continue;
 
         printf(".align %d\n", var->ty->align);
         printf("%s:\n", var->name);
@@ -616,36 +1391,101 @@ static void emit_data(Program *prog) {
 
     for(VarList *vl=prog->globals; vl; vl = vl->next) {
         Var *var = vl->var;
-        if(!var->initializer) continue;
+        if(!var->init_data) continue;
 
         printf(".align %d\n", var->ty->align);
         printf("%s:\n", var->name);
-
-        for(Initializer *init = var->initializer; init; init = init->next) {
-            if(init->label) {
-                // .quad 64bitの数字を扱う時に使う(ほかは.byteと同じ)
-                printf("  .quad %s%+ld\n", init->label, init->addend);
-            } else if(init->sz == 1) {
-                printf("  .byte %ld\n", init->val);
-            } else {
-                printf("  .%dbyte %ld\n", init->sz, init->val);
-            }
-        }
+        emit_gvar_data(var);
     }
 }
 
 static void load_arg(Var *var, int idx) {
     int sz = var->ty->size;
+    if(var->cg_reg) {
+        char *reg = varreg[var->cg_reg - 1];
+        if(sz == 1) {
+            fprintf(out, "  movsx %s, %s\n", reg, argreg1[idx]);
+        } else if(sz == 2) {
+            fprintf(out, "  movsx %s, %s\n", reg, argreg2[idx]);
+        } else if(sz == 4) {
+            fprintf(out, "  movsxd %s, %s\n", reg, argreg4[idx]);
+        } else {
+            fprintf(out, "  mov %s, %s\n", reg, argreg8[idx]);
+        }
+        return;
+    }
     if(sz == 1) {
-        printf("  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
+        fprintf(out, "  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
     } else if(sz == 2) {
-        printf("  mov [rbp-%d], %s\n", var->offset, argreg2[idx]);
+        fprintf(out, "  mov [rbp-%d], %s\n", var->offset, argreg2[idx]);
     } else if(sz == 4) {
-        printf("  mov [rbp-%d], %s\n", var->offset, argreg4[idx]);
+        fprintf(out, "  mov [rbp-%d], %s\n", var->offset, argreg4[idx]);
     } else {
         assert(sz==8);
-        printf("  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+        fprintf(out, "  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+    }
+}
+
+static bool can_be_in_reg(Var *var) {
+    return var->is_local && (is_integer(var->ty) || var->ty->kind == TY_PTR);
+}
+
+// Gives registers to the scalar locals used most often, provided their
+// address is never taken.
+static void assign_var_regs(Function *fn) {
+    nvar_regs = 0;
+    for(VarList *vl=fn->locals; vl; vl=vl->next) {
+        vl->var->cg_reg = 0;
+        vl->var->nuses = 0;
+        vl->var->escapes = false;
+    }
+    if(!is_mode_enabled("mem2reg")) return;
+
+    NodeStack st = {};
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&st, node);
+    }
+    while(st.len) {
+        Node *node = st.data[--st.len];
+        if(node->kind == ND_VAR && can_be_in_reg(node->var)) {
+            node->var->nuses++;
+            if(node->init) node->var->escapes = true;
+        }
+        if(node->kind == ND_ADDR && node->lhs->kind == ND_VAR) {
+            node->lhs->var->escapes = true;
+        }
+        push_children(&st, node);
+    }
+    free(st.data);
+
+    while(nvar_regs < NUM_VAR_REGS) {
+        Var *best = NULL;
+        for(VarList *vl=fn->locals; vl; vl=vl->next) {
+            Var *var = vl->var;
+            if(var->cg_reg || var->escapes || var->nuses < MIN_USES) continue;
+            if(!best || var->nuses > best->nuses) {
+                best = var;
+            }
+        }
+        if(!best) return;
+        best->cg_reg = ++nvar_regs;
+        count_stat("var-in-reg");
+    }
+}
+
+static bool has_call(Function *fn) {
+    NodeStack st = {};
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&st, node);
+    }
+    bool found = false;
+    while(st.len && !found) {
+        Node *node = st.data[--st.len];
+        found = node->kind == ND_FUNCALL;
+        push_children(&st, node);
     }
+    free(st.data);
+    return found;
 }
 
 // set program code
@@ -653,16 +1493,35 @@ static void emit_text(Program *prog) {
     printf(".text\n");
 
     for(Function *fn = prog->fns; fn; fn=fn->next) {
+        begin_fn();
         if(!fn->is_static) {
-            printf(".global %s\n", fn->name);
+            fprintf(out, ".global %s\n", fn->name);
         }
-        printf("%s:\n", fn->name);
+        fprintf(out, "%s:\n", fn->name);
         funcname = fn->name;
-        
-        // Prologue
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-        printf("  sub rsp, %d\n", fn->stack_size); // main関数内のlocal変数の領域を確保
+        assign_var_regs(fn);
+        // The registers holding variables are saved below the locals.
+        fn_stack_size = fn->stack_size + nvar_regs * 8;
+        depth = 0;
+        tos_cache = is_mode_enabled("tos-cache");
+        tos = TOS_NONE;
+        strength_reduce = is_mode_enabled("strength-reduce");
+        sibling_calls = is_mode_enabled("sibling-calls") && !check_frame_reuse(fn);
+
+        // Prologue. The expression stack grows below RSP, so only a
+        // leaf function without locals can do without a frame.
+        has_frame = !is_mode_enabled("omit-frame-pointer") || fn_stack_size || has_call(fn);
+        if(has_frame) {
+            fprintf(out, "  push rbp\n");
+            fprintf(out, "  mov rbp, rsp\n");
+            fprintf(out, "  sub rsp, %d\n", fn_stack_size); // main関数内のlocal変数の領域を確保
+        } else {
+            count_stat("frame-omitted");
+        }
+
+        for(int i=0; i<nvar_regs; i++) {
+            fprintf(out, "  mov [rbp-%d], %s\n", saved_reg_offset(i), varreg[i]);
+        }
 
         // Save arg registers if function is variadic
         if(fn->has_varargs) {
@@ -672,18 +1531,19 @@ static void emit_text(Program *prog) {
                 n++;
             }
 
-            printf("mov dword ptr [rbp-8], %d\n", n * 8);
-            printf("mov [rbp-16], r9\n");
-            printf("mov [rbp-24], r8\n");
-            printf("mov [rbp-32], rcx\n");
-            printf("mov [rbp-40], rdx\n");
-            printf("mov [rbp-48], rsi\n");
-            printf("mov [rbp-56], rdi\n");
+            fprintf(out, "  mov dword ptr [rbp-8], %d\n", n * 8);
+            fprintf(out, "  mov [rbp-16], r9\n");
+            fprintf(out, "  mov [rbp-24], r8\n");
+            fprintf(out, "  mov [rbp-32], rcx\n");
+            fprintf(out, "  mov [rbp-40], rdx\n");
+            fprintf(out, "  mov [rbp-48], rsi\n");
+            fprintf(out, "  mov [rbp-56], rdi\n");
         }
 
         // Push arguments to the stack.
         int i = 0;
         for(VarList *vl = fn->params; vl; vl = vl->next) {
+            if(i == MAX_ARGS) error_tok(fn->tok, "too many parameters");
             // 関数を指しているrbpの次から引数を積む(6個まで)
             load_arg(vl->var, i++);
         }
@@ -692,13 +1552,17 @@ static void emit_text(Program *prog) {
         // gen for each statement;
         for(Node *node=fn->node; node; node=node->next) {
             gen(node);
+            assert(depth == 0);
         }
         //
         // Epilogue
-        printf(".L.return.%s:\n", funcname);
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
+        fprintf(out, ".L.return.%s:\n", funcname);
+        emit_epilogue();
+        fprintf(out, "  ret\n");
+
+        end_fn();
+        run_asm_passes(&insns);
+        print_insns();
     }
 }
 
@@ -707,4 +1571,5 @@ void codegen(Program *prog) {
 	printf(".intel_syntax noprefix\n");
     emit_data(prog);
     emit_text(prog);
+    emit_vector_kernels();
 }
@@ -0,0 +1,283 @@
+#include "chibicc.h"
+
+// Dead code elimination, on the AST for both code generators and on the
+// IR in SSA form.
+//
+// On the AST, statements that cannot be reached are removed: those after
+// a return, break, continue or goto in the same list, up to one that
+// holds a label and may be jumped to, and loops whose condition is a
+// constant 0. Labels no goto refers to are dropped first, so they do not
+// keep code alive. Expression statements without side effects and empty
+// statements are removed as well.
+//
+// On the IR, instructions without side effects whose result is never
+// used are removed, and then those that only they used. A phi that only
+// feeds itself around a loop is kept. Unreachable blocks are already
+// removed by compute_cfg().
+
+static Function *fn;
+static int nchanges;
+static NodeStack walk;
+
+// Names of the labels gotos jump to
+static char **targets;
+static int ntargets;
+
+static void collect_targets() {
+    ntargets = 0;
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&walk, node);
+    }
+    while(walk.len) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_GOTO) {
+            targets = realloc(targets, sizeof(char *) * (ntargets + 1));
+            targets[ntargets++] = node->label_name;
+        }
+        push_children(&walk, node);
+    }
+}
+
+static bool is_target(char *name) {
+    for(int i=0; i<ntargets; i++) {
+        if(!strcmp(targets[i], name)) return true;
+    }
+    return false;
+}
+
+// Returns true if a statement may be jumped into from outside.
+static bool has_label(Node *node) {
+    int base = walk.len;
+    push_node(&walk, node);
+    while(walk.len > base) {
+        Node *n = walk.data[--walk.len];
+        if((n->kind == ND_LABEL && is_target(n->label_name)) || n->kind == ND_CASE) {
+            walk.len = base;
+            return true;
+        }
+        push_children(&walk, n);
+    }
+    return false;
+}
+
+static bool has_side_effects(Node *expr) {
+    int base = walk.len;
+    push_node(&walk, expr);
+    while(walk.len > base) {
+        Node *n = walk.data[--walk.len];
+        switch(n->kind) {
+            case ND_ASSIGN:
+            case ND_ADD_EQ:
+            case ND_PTR_ADD_EQ:
+            case ND_SUB_EQ:
+            case ND_PTR_SUB_EQ:
+            case ND_MUL_EQ:
+            case ND_DIV_EQ:
+            case ND_MOD_EQ:
+            case ND_SHL_EQ:
+            case ND_SHR_EQ:
+            case ND_BITAND_EQ:
+            case ND_BITOR_EQ:
+            case ND_BITXOR_EQ:
+            case ND_PRE_INC:
+            case ND_PRE_DEC:
+            case ND_POST_INC:
+            case ND_POST_DEC:
+            case ND_FUNCALL:
+            case ND_STMT_EXPR:
+                walk.len = base;
+                return true;
+            case ND_VAR:
+                if(n->init) {
+                    walk.len = base;
+                    return true;
+                }
+                break;
+        }
+        push_children(&walk, n);
+    }
+    return false;
+}
+
+// Returns true if control never goes past the end of a statement.
+static bool ends_in_jump(Node *node) {
+    switch(node->kind) {
+        case ND_RETURN:
+        case ND_BREAK:
+        case ND_CONTINUE:
+        case ND_GOTO:
+            return true;
+        case ND_BLOCK: {
+            Node *last = node->body;
+            while(last && last->next) {
+                last = last->next;
+            }
+            return last && ends_in_jump(last);
+        }
+        case ND_IF:
+            return node->els && ends_in_jump(node->then) && ends_in_jump(node->els);
+    }
+    return false;
+}
+
+// Returns true if a statement does nothing.
+static bool is_empty(Node *node) {
+    switch(node->kind) {
+        case ND_NULL:
+            return true;
+        case ND_EXPR_STMT:
+            return !has_side_effects(node->lhs);
+        case ND_WHILE:
+            return node->cond->kind == ND_NUM && !node->cond->val && !has_label(node->then);
+    }
+    return false;
+}
+
+// Removes dead statements from a list. The last node of the body of a
+// statement expression is its value, which is always kept.
+static void eliminate_list(Node **slot, bool keep_last) {
+    while(*slot) {
+        Node *node = *slot;
+        if(keep_last && !node->next) return;
+
+        if(node->kind == ND_LABEL && !is_target(node->label_name)) {
+            node->lhs->next = node->next;
+            *slot = node->lhs;
+            nchanges++;
+            continue;
+        }
+
+        // for (init; 0; inc) body  =>  init
+        if(node->kind == ND_FOR && node->cond && node->cond->kind == ND_NUM && !node->cond->val &&
+           !has_label(node->then)) {
+            Node *init = node->init;
+            if(init) {
+                init->next = node->next;
+                *slot = init;
+            } else {
+                *slot = node->next;
+            }
+            nchanges++;
+            continue;
+        }
+
+        if(is_empty(node)) {
+            *slot = node->next;
+            nchanges++;
+            continue;
+        }
+
+        if(ends_in_jump(node)) {
+            while(node->next && !(keep_last && !node->next->next) && !has_label(node->next)) {
+                node->next = node->next->next;
+                nchanges++;
+            }
+        }
+        slot = &node->next;
+    }
+}
+
+// Removes dead statements from a function. Returns the number of
+// statements removed.
+int eliminate_dead_code(Function *f) {
+    fn = f;
+    nchanges = 0;
+    collect_targets();
+
+    eliminate_list(&fn->node, false);
+    NodeStack st = {};
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&st, node);
+    }
+    while(st.len) {
+        Node *node = st.data[--st.len];
+        if(node->kind == ND_BLOCK) {
+            eliminate_list(&node->body, false);
+        } else if(node->kind == ND_STMT_EXPR) {
+            eliminate_list(&node->body, true);
+        }
+        push_children(&st, node);
+    }
+    free(st.data);
+    return nchanges;
+}
+
+//
+// IR
+//
+
+static bool is_removable(IROp op) {
+    switch(op) {
+        case IR_IMM:
+        case IR_MOV:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_SHL:
+        case IR_SHR:
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+        case IR_BITNOT:
+        case IR_TRUNC:
+        case IR_LVAR:
+        case IR_GVAR:
+        case IR_LOAD:
+        case IR_PHI:
+            return true;
+    }
+    return false;
+}
+
+// Removes the instructions whose results are not used. Returns the
+// number of instructions removed.
+int eliminate_dead_insns(Function *f) {
+    fn = f;
+    nchanges = 0;
+    int *nuses = calloc(fn->nregs, sizeof(int));
+    IR **def = calloc(fn->nregs, sizeof(IR *));
+    BB **def_bb = calloc(fn->nregs, sizeof(BB *));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->d) {
+                def[ir->d->vn] = ir;
+                def_bb[ir->d->vn] = bb;
+            }
+            for(int i=0; i<ir_num_uses(ir); i++) {
+                Reg *r = ir_use(ir, i);
+                if(r) nuses[r->vn]++;
+            }
+        }
+    }
+
+    // Registers whose definitions are dead
+    int *stack = calloc(fn->nregs, sizeof(int));
+    int len = 0;
+    for(int vn=0; vn<fn->nregs; vn++) {
+        if(def[vn] && !nuses[vn] && is_removable(def[vn]->op)) stack[len++] = vn;
+    }
+    while(len) {
+        int vn = stack[--len];
+        IR *ir = def[vn];
+        remove_ir(def_bb[vn], ir);
+        nchanges++;
+        for(int i=0; i<ir_num_uses(ir); i++) {
+            Reg *r = ir_use(ir, i);
+            if(!r) continue;
+            if(--nuses[r->vn] == 0 && def[r->vn] && is_removable(def[r->vn]->op)) {
+                stack[len++] = r->vn;
+            }
+        }
+    }
+
+    free(stack);
+    free(nuses);
+    free(def);
+    free(def_bb);
+    verify_ir(fn, true);
+    return nchanges;
+}
@@ -0,0 +1,246 @@
+#include "chibicc.h"
+
+// Constant folding on the AST of function bodies.
+//
+// Folding follows what codegen() would compute at runtime: arithmetic is
+// done on 64-bit values, and only ND_CAST truncates, like truncate().
+// Besides operators with constant operands, it removes the dead branch
+// of an "if" or ?: with a constant condition and simplifies algebraic
+// identities such as x+0 and x*1.
+//
+// The tree is walked without recursion. Slots, the fields pointing to
+// nodes, are collected in pre-order and then folded in reverse, so
+// children are folded before their parents. A folded node is either
+// turned into ND_NUM in place, which every expression node has room
+// for, or replaced by another node through its slot. The `next` field
+// of a node counts as a child slot, so the rest of a list is folded
+// before the node in front of it.
+
+static int nchanges;
+static NodeStack walk;
+
+static SlotStack slots;
+static SlotStack order;
+
+static bool is_num(Node *node, long val) {
+    return node->kind == ND_NUM && node->val == val;
+}
+
+static void to_num(Node *node, long val) {
+    node->kind = ND_NUM;
+    node->val = val;
+    nchanges++;
+}
+
+static void replace(Node **slot, Node *node) {
+    node->next = (*slot)->next;
+    *slot = node;
+    nchanges++;
+}
+
+// Returns true if a statement may be jumped into from outside, so it
+// must be kept even if it is never reached from the front.
+static bool has_label(Node *node) {
+    if(!node) return false;
+    int base = walk.len;
+    push_node(&walk, node);
+    while(walk.len > base) {
+        Node *n = walk.data[--walk.len];
+        if(n->kind == ND_LABEL || n->kind == ND_CASE) {
+            walk.len = base;
+            return true;
+        }
+        push_children(&walk, n);
+    }
+    return false;
+}
+
+static long truncate_val(Type *ty, long val) {
+    if(ty->kind == TY_BOOL) return val != 0;
+    if(ty->size == 1) return (char)val;
+    if(ty->size == 2) return (short)val;
+    if(ty->size == 4) return (int)val;
+    return val;
+}
+
+// Folds a binary operator with constant operands. Division by zero and
+// out-of-range shifts are left to fail at runtime. Arithmetic that may
+// overflow is done in unsigned long, so it wraps as the machine does
+// instead of being undefined in the compiler.
+static bool fold_binary(Node *node) {
+    long l = node->lhs->val;
+    long r = node->rhs->val;
+    unsigned long ul = l;
+    unsigned long ur = r;
+    switch(node->kind) {
+        case ND_ADD: to_num(node, (long)(ul + ur)); return true;
+        case ND_SUB: to_num(node, (long)(ul - ur)); return true;
+        case ND_MUL: to_num(node, (long)(ul * ur)); return true;
+        case ND_DIV:
+            if(r == 0 || r == -1) return false;
+            to_num(node, l / r);
+            return true;
+        case ND_MOD:
+            if(r == 0 || r == -1) return false;
+            to_num(node, l % r);
+            return true;
+        case ND_BITAND: to_num(node, l & r); return true;
+        case ND_BITOR: to_num(node, l | r); return true;
+        case ND_BITXOR: to_num(node, l ^ r); return true;
+        case ND_SHL:
+        case ND_SHR:
+            if(r < 0 || r > 63) return false;
+            to_num(node, node->kind == ND_SHL ? (long)(ul << r) : l >> r);
+            return true;
+        case ND_EQ: to_num(node, l == r); return true;
+        case ND_NE: to_num(node, l != r); return true;
+        case ND_LT: to_num(node, l < r); return true;
+        case ND_LE: to_num(node, l <= r); return true;
+        case ND_LOGAND: to_num(node, l && r); return true;
+        case ND_LOGOR: to_num(node, l || r); return true;
+    }
+    return false;
+}
+
+// Turns `x && 1`, `1 && x`, `x || 0` and `0 || x` into `x != 0`. The
+// constant operand node is reused as the 0.
+static void to_nonzero(Node *node, Node *x, Node *num) {
+    node->kind = ND_NE;
+    node->lhs = x;
+    node->rhs = num;
+    num->val = 0;
+    nchanges++;
+}
+
+static void fold_logical(Node *node) {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+    bool is_and = node->kind == ND_LOGAND;
+
+    if(lhs->kind == ND_NUM) {
+        // The right-hand side is only evaluated if it decides the value.
+        if(is_and == (lhs->val != 0)) {
+            to_nonzero(node, rhs, lhs);
+        } else {
+            to_num(node, !is_and);
+        }
+    } else if(rhs->kind == ND_NUM && is_and == (rhs->val != 0)) {
+        to_nonzero(node, lhs, rhs);
+    }
+}
+
+// Folds `x op c` or `c op x` where the constant does not change x.
+static void fold_identity(Node **slot) {
+    Node *node = *slot;
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+    switch(node->kind) {
+        case ND_ADD:
+        case ND_BITOR:
+        case ND_BITXOR:
+            if(is_num(rhs, 0)) replace(slot, lhs);
+            else if(is_num(lhs, 0)) replace(slot, rhs);
+            return;
+        case ND_MUL:
+            if(is_num(rhs, 1)) replace(slot, lhs);
+            else if(is_num(lhs, 1)) replace(slot, rhs);
+            else if(is_num(rhs, 0) && lhs->kind == ND_VAR) to_num(node, 0);
+            else if(is_num(lhs, 0) && rhs->kind == ND_VAR) to_num(node, 0);
+            return;
+        case ND_BITAND:
+            if(is_num(rhs, 0) && lhs->kind == ND_VAR) to_num(node, 0);
+            else if(is_num(lhs, 0) && rhs->kind == ND_VAR) to_num(node, 0);
+            return;
+        case ND_SUB:
+        case ND_SHL:
+        case ND_SHR:
+            if(is_num(rhs, 0)) replace(slot, lhs);
+            return;
+        case ND_DIV:
+            if(is_num(rhs, 1)) replace(slot, lhs);
+            return;
+    }
+}
+
+static void fold_node(Node **slot) {
+    Node *node = *slot;
+    switch(node->kind) {
+        case ND_ADD:
+        case ND_SUB:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_MOD:
+        case ND_BITAND:
+        case ND_BITOR:
+        case ND_BITXOR:
+        case ND_SHL:
+        case ND_SHR:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            if(node->lhs->kind == ND_NUM && node->rhs->kind == ND_NUM && fold_binary(node)) {
+                return;
+            }
+            fold_identity(slot);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR:
+            if(node->lhs->kind == ND_NUM && node->rhs->kind == ND_NUM) {
+                fold_binary(node);
+            } else {
+                fold_logical(node);
+            }
+            return;
+        case ND_NOT:
+            if(node->lhs->kind == ND_NUM) to_num(node, !node->lhs->val);
+            return;
+        case ND_BITNOT:
+            if(node->lhs->kind == ND_NUM) to_num(node, ~node->lhs->val);
+            return;
+        case ND_CAST:
+            if(node->lhs->kind == ND_NUM && is_integer(node->ty)) {
+                to_num(node, truncate_val(node->ty, node->lhs->val));
+            }
+            return;
+        case ND_TERNARY: {
+            if(node->cond->kind != ND_NUM) return;
+            Node *taken = node->cond->val ? node->then : node->els;
+            Node *dead = node->cond->val ? node->els : node->then;
+            if(!has_label(dead)) replace(slot, taken);
+            return;
+        }
+        case ND_IF: {
+            if(node->cond->kind != ND_NUM) return;
+            Node *taken = node->cond->val ? node->then : node->els;
+            Node *dead = node->cond->val ? node->els : node->then;
+            if(has_label(dead)) return;
+            if(taken) {
+                replace(slot, taken);
+            } else {
+                node->kind = ND_NULL;
+                nchanges++;
+            }
+            return;
+        }
+    }
+}
+
+// Folds the body of a function. Returns the number of nodes folded.
+int fold_fn(Function *fn) {
+    nchanges = 0;
+    slots.len = 0;
+    order.len = 0;
+
+    push_slot(&slots, &fn->node);
+    while(slots.len) {
+        Node **slot = slots.data[--slots.len];
+        push_slot(&order, slot);
+        push_child_slots(&slots, *slot);
+    }
+
+    while(order.len) {
+        fold_node(order.data[--order.len]);
+    }
+    return nchanges;
+}
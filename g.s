@@ -0,0 +1,4 @@
+.intel_syntax noprefix
+.bss
+.data
+.text
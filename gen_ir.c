@@ -0,0 +1,889 @@
+#include "chibicc.h"
+
+// Lowers the AST of each function into basic blocks of three-address
+// instructions for the optimizing backend. Values live in an unlimited
+// number of virtual registers, which alloc_regs() later maps onto
+// machine registers or stack slots.
+//
+// Scalar local variables whose address is never taken are promoted to
+// virtual registers, so reading or writing them needs no memory access.
+
+enum {
+    MAX_ARGS = 6, // arguments are passed in registers only
+};
+
+static Function *fn; // current function
+static BB *out; // block being appended to
+static BB *last_bb; // last block in layout order
+static int ninsts; // number of instructions emitted
+
+static BB *brk_bb;
+static BB *cont_bb;
+
+// Blocks of the labels and case labels of the current function.
+typedef struct Target Target;
+struct Target {
+    Target *next;
+    char *name; // goto label
+    Node *node; // ND_CASE
+    BB *bb;
+};
+
+static Target *targets;
+
+// Spines of left-associative chains being lowered.
+static NodeStack spine;
+
+static Reg *gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+static Reg *new_reg() {
+    return new_vreg(fn);
+}
+
+static bool is_terminated(BB *bb) {
+    return bb->last && is_terminator(bb->last);
+}
+
+static void start_bb(BB *bb);
+
+static IR *emit(IROp op) {
+    // Code after a jump is unreachable, but it still needs a block.
+    if(is_terminated(out)) {
+        start_bb(new_bb());
+    }
+
+    IR *ir = new_ir(op);
+    insert_ir(out, NULL, ir);
+    ninsts++;
+    return ir;
+}
+
+// Jumps to a block unless control cannot reach this point anyway.
+static void jmp(BB *bb) {
+    if(is_terminated(out)) return;
+    IR *ir = emit(IR_JMP);
+    ir->then = bb;
+}
+
+// Appends a block to the function and continues emitting into it. The
+// previous block falls through to it.
+static void start_bb(BB *bb) {
+    jmp(bb);
+    last_bb->next = bb;
+    last_bb = bb;
+    out = bb;
+}
+
+static bool is_imm(long val) {
+    return val == (int)val;
+}
+
+static Reg *imm(long val) {
+    IR *ir = emit(IR_IMM);
+    ir->d = new_reg();
+    ir->imm = val;
+    return ir->d;
+}
+
+static void mov(Reg *d, Reg *a) {
+    IR *ir = emit(IR_MOV);
+    ir->d = d;
+    ir->a = a;
+}
+
+static Reg *binop(IROp op, Reg *a, Reg *b) {
+    IR *ir = emit(op);
+    ir->d = new_reg();
+    ir->a = a;
+    ir->b = b;
+    return ir->d;
+}
+
+static Reg *binop_imm(IROp op, Reg *a, long val) {
+    if(!is_imm(val)) {
+        return binop(op, a, imm(val));
+    }
+    IR *ir = emit(op);
+    ir->d = new_reg();
+    ir->a = a;
+    ir->imm = val;
+    return ir->d;
+}
+
+static void br(IROp cmp, Reg *a, Reg *b, long val, BB *then, BB *els) {
+    if(!b && !is_imm(val)) {
+        b = imm(val);
+    }
+    IR *ir = emit(IR_BR);
+    ir->cmp = cmp;
+    ir->a = a;
+    ir->b = b;
+    ir->imm = val;
+    ir->then = then;
+    ir->els = els;
+}
+
+static int mem_size(Type *ty) {
+    if(ty->size == 1 || ty->size == 2 || ty->size == 4) {
+        return ty->size;
+    }
+    return 8;
+}
+
+static Reg *load(Reg *addr, Type *ty) {
+    IR *ir = emit(IR_LOAD);
+    ir->d = new_reg();
+    ir->a = addr;
+    ir->size = mem_size(ty);
+    return ir->d;
+}
+
+// Stores a value and returns the value of the assignment expression,
+// which, as in codegen.c, is only normalized for _Bool.
+static Reg *store(Reg *addr, Reg *val, Type *ty) {
+    if(ty->kind == TY_BOOL) {
+        val = binop_imm(IR_NE, val, 0);
+    }
+    IR *ir = emit(IR_STORE);
+    ir->a = addr;
+    ir->b = val;
+    ir->size = mem_size(ty);
+    return val;
+}
+
+// Converts a value as if it were stored to and loaded from a variable
+// of the given type.
+static Reg *truncate(Reg *val, Type *ty) {
+    if(ty->kind == TY_BOOL) {
+        return binop_imm(IR_NE, val, 0);
+    }
+    if(mem_size(ty) == 8) {
+        return val;
+    }
+    IR *ir = emit(IR_TRUNC);
+    ir->d = new_reg();
+    ir->a = val;
+    ir->size = ty->size;
+    return ir->d;
+}
+
+static Reg *lvar_addr(Var *var) {
+    IR *ir = emit(IR_LVAR);
+    ir->d = new_reg();
+    ir->var = var;
+    return ir->d;
+}
+
+// Returns the register of a promoted variable, or NULL if the node is
+// not a promoted variable.
+static Reg *var_reg(Node *node) {
+    if(node->kind == ND_VAR && !node->init) {
+        return node->var->reg;
+    }
+    return NULL;
+}
+
+static Reg *assign_var(Var *var, Reg *val) {
+    mov(var->reg, truncate(val, var->ty));
+    return val;
+}
+
+static Reg *gen_addr(Node *node) {
+    switch(node->kind) {
+        case ND_VAR: {
+            if(node->init) {
+                gen_stmt(node->init);
+            }
+
+            Var *var = node->var;
+            if(var->is_local) {
+                return lvar_addr(var);
+            }
+            IR *ir = emit(IR_GVAR);
+            ir->d = new_reg();
+            ir->name = var->name;
+            return ir->d;
+        }
+        case ND_DEREF:
+            return gen_expr(node->lhs);
+        case ND_MEMBER: {
+            Reg *addr = gen_addr(node->lhs);
+            if(node->member->offset == 0) {
+                return addr;
+            }
+            return binop_imm(IR_ADD, addr, node->member->offset);
+        }
+    }
+
+    error_tok(node->tok, "not an lvalue");
+}
+
+static Reg *gen_lval(Node *node) {
+    if(node->ty->kind == TY_ARRAY) {
+        error_tok(node->tok, "not an lvalue");
+    }
+    return gen_addr(node);
+}
+
+static IROp binary_op(NodeKind kind) {
+    switch(kind) {
+        case ND_ADD:
+        case ND_ADD_EQ:
+            return IR_ADD;
+        case ND_SUB:
+        case ND_SUB_EQ:
+            return IR_SUB;
+        case ND_MUL:
+        case ND_MUL_EQ:
+            return IR_MUL;
+        case ND_DIV:
+        case ND_DIV_EQ:
+            return IR_DIV;
+        case ND_MOD:
+        case ND_MOD_EQ:
+            return IR_MOD;
+        case ND_BITAND:
+        case ND_BITAND_EQ:
+            return IR_AND;
+        case ND_BITOR:
+        case ND_BITOR_EQ:
+            return IR_OR;
+        case ND_BITXOR:
+        case ND_BITXOR_EQ:
+            return IR_XOR;
+        case ND_SHL:
+        case ND_SHL_EQ:
+            return IR_SHL;
+        case ND_SHR:
+        case ND_SHR_EQ:
+            return IR_SHR;
+        case ND_EQ:
+            return IR_EQ;
+        case ND_NE:
+            return IR_NE;
+        case ND_LT:
+            return IR_LT;
+        case ND_LE:
+            return IR_LE;
+    }
+    error("internal error: not a binary operator");
+}
+
+// Applies a binary operator (or the operator of a compound assignment)
+// to a left operand that is already in a register.
+static Reg *gen_binary(Node *node, Reg *lhs, Node *rhs) {
+    switch(node->kind) {
+        case ND_PTR_ADD:
+        case ND_PTR_ADD_EQ:
+        case ND_PTR_SUB:
+        case ND_PTR_SUB_EQ: {
+            bool is_add = node->kind == ND_PTR_ADD || node->kind == ND_PTR_ADD_EQ;
+            IROp op = is_add ? IR_ADD : IR_SUB;
+            int size = node->ty->base->size;
+            if(rhs->kind == ND_NUM) {
+                return binop_imm(op, lhs, rhs->val * size);
+            }
+            return binop(op, lhs, binop_imm(IR_MUL, gen_expr(rhs), size));
+        }
+        case ND_PTR_DIFF: {
+            Reg *diff = binop(IR_SUB, lhs, gen_expr(rhs));
+            int size = node->lhs->ty->base->size;
+
+            // The difference is a multiple of the size, so a shift needs
+            // no rounding.
+            int k = exact_log2(size);
+            if(k >= 0 && is_mode_enabled("strength-reduce")) {
+                return k ? binop_imm(IR_SHR, diff, k) : diff;
+            }
+            return binop_imm(IR_DIV, diff, size);
+        }
+    }
+
+    IROp op = binary_op(node->kind);
+    if(rhs->kind == ND_NUM) {
+        return binop_imm(op, lhs, rhs->val);
+    }
+    return binop(op, lhs, gen_expr(rhs));
+}
+
+static bool is_plain_binary(NodeKind kind) {
+    switch(kind) {
+        case ND_ADD:
+        case ND_PTR_ADD:
+        case ND_SUB:
+        case ND_PTR_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_MOD:
+        case ND_BITAND:
+        case ND_BITOR:
+        case ND_BITXOR:
+        case ND_SHL:
+        case ND_SHR:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+            return true;
+    }
+    return false;
+}
+
+// Lowers a left-associative chain such as `a + b - c` without recursing
+// into the left operands (see gen_binary_chain() in codegen.c).
+static Reg *gen_binary_chain(Node *node) {
+    int base = spine.len;
+    for(Node *n=node; is_plain_binary(n->kind); n=n->lhs) {
+        push_node(&spine, n);
+    }
+
+    Reg *r = gen_expr(spine.data[spine.len - 1]->lhs);
+    while(spine.len > base) {
+        Node *n = spine.data[--spine.len];
+        r = gen_binary(n, r, n->rhs);
+    }
+    return r;
+}
+
+// Branches to `then` if a condition is true and to `els` otherwise.
+// Comparisons become a single compare-and-branch, and `&&`, `||` and
+// `!` only branch, without materializing their 0 or 1.
+static void gen_cond(Node *node, BB *then, BB *els) {
+    switch(node->kind) {
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE: {
+            Reg *lhs = gen_expr(node->lhs);
+            if(node->rhs->kind == ND_NUM) {
+                br(binary_op(node->kind), lhs, NULL, node->rhs->val, then, els);
+            } else {
+                br(binary_op(node->kind), lhs, gen_expr(node->rhs), 0, then, els);
+            }
+            return;
+        }
+        case ND_NOT:
+            gen_cond(node->lhs, els, then);
+            return;
+        case ND_NUM:
+            jmp(node->val ? then : els);
+            return;
+        case ND_LOGAND:
+        case ND_LOGOR: {
+            bool is_and = node->kind == ND_LOGAND;
+            int base = spine.len;
+            for(Node *n=node; n->kind == node->kind; n=n->lhs) {
+                push_node(&spine, n);
+            }
+
+            Node *operand = spine.data[spine.len - 1]->lhs;
+            while(spine.len > base) {
+                BB *next = new_bb();
+                gen_cond(operand, is_and ? next : then, is_and ? els : next);
+                start_bb(next);
+                operand = spine.data[--spine.len]->rhs;
+            }
+            gen_cond(operand, then, els);
+            return;
+        }
+    }
+
+    br(IR_NE, gen_expr(node), NULL, 0, then, els);
+}
+
+// Lowers an expression whose value is selected by branching.
+static Reg *gen_cond_value(Node *node) {
+    Reg *r = new_reg();
+    BB *then = new_bb();
+    BB *els = new_bb();
+    BB *last = new_bb();
+
+    gen_cond(node, then, els);
+    start_bb(then);
+    mov(r, imm(1));
+    jmp(last);
+    start_bb(els);
+    mov(r, imm(0));
+    start_bb(last);
+    return r;
+}
+
+static Reg *gen_funcall(Node *node) {
+    if(!strcmp(node->funcname, "__builtin_va_start")) {
+        Reg *ap = gen_expr(node->args);
+        IR *ir = emit(IR_VA_START);
+        ir->a = ap;
+        return imm(0);
+    }
+
+    int nargs = 0;
+    for(Node *arg=node->args; arg; arg=arg->next) {
+        nargs++;
+    }
+    if(nargs > MAX_ARGS) error_tok(node->tok, "too many arguments");
+
+    Reg **args = calloc(nargs, sizeof(Reg *));
+    int i = 0;
+    for(Node *arg=node->args; arg; arg=arg->next) {
+        args[i++] = gen_expr(arg);
+    }
+
+    IR *ir = emit(IR_CALL);
+    ir->d = new_reg();
+    ir->name = node->funcname;
+    ir->args = args;
+    ir->nargs = nargs;
+
+    if(node->ty->kind == TY_BOOL) {
+        return binop_imm(IR_AND, ir->d, 255);
+    }
+    return ir->d;
+}
+
+// Lowers ++ and --. Postfix forms evaluate to the old value.
+static Reg *gen_inc_dec(Node *node) {
+    bool is_post = node->kind == ND_POST_INC || node->kind == ND_POST_DEC;
+    bool is_inc = node->kind == ND_PRE_INC || node->kind == ND_POST_INC;
+    long delta = node->ty->base ? node->ty->base->size : 1;
+    if(!is_inc) {
+        delta = -delta;
+    }
+
+    Reg *reg = var_reg(node->lhs);
+    if(reg) {
+        Reg *old = reg;
+        if(is_post) {
+            old = new_reg();
+            mov(old, reg);
+        }
+        Reg *val = assign_var(node->lhs->var, binop_imm(IR_ADD, reg, delta));
+        return is_post ? old : val;
+    }
+
+    Reg *addr = gen_lval(node->lhs);
+    Reg *old = load(addr, node->ty);
+    Reg *val = store(addr, binop_imm(IR_ADD, old, delta), node->ty);
+    return is_post ? old : val;
+}
+
+static Reg *gen_expr(Node *node) {
+    switch(node->kind) {
+        case ND_NUM:
+            return imm(node->val);
+        case ND_VAR:
+            if(node->var->reg) {
+                if(node->init) {
+                    gen_stmt(node->init);
+                }
+                return node->var->reg;
+            }
+            // fallthrough
+        case ND_MEMBER:
+        case ND_DEREF: {
+            Reg *addr = gen_addr(node);
+            if(node->ty->kind == TY_ARRAY) {
+                return addr;
+            }
+            return load(addr, node->ty);
+        }
+        case ND_ASSIGN: {
+            if(var_reg(node->lhs)) {
+                return assign_var(node->lhs->var, gen_expr(node->rhs));
+            }
+            Reg *addr = gen_lval(node->lhs);
+            return store(addr, gen_expr(node->rhs), node->ty);
+        }
+        case ND_TERNARY: {
+            Reg *r = new_reg();
+            BB *then = new_bb();
+            BB *els = new_bb();
+            BB *last = new_bb();
+
+            gen_cond(node->cond, then, els);
+            start_bb(then);
+            mov(r, gen_expr(node->then));
+            jmp(last);
+            start_bb(els);
+            mov(r, gen_expr(node->els));
+            start_bb(last);
+            return r;
+        }
+        case ND_PRE_INC:
+        case ND_PRE_DEC:
+        case ND_POST_INC:
+        case ND_POST_DEC:
+            return gen_inc_dec(node);
+        case ND_ADD_EQ:
+        case ND_PTR_ADD_EQ:
+        case ND_SUB_EQ:
+        case ND_PTR_SUB_EQ:
+        case ND_MUL_EQ:
+        case ND_DIV_EQ:
+        case ND_MOD_EQ:
+        case ND_SHL_EQ:
+        case ND_SHR_EQ:
+        case ND_BITAND_EQ:
+        case ND_BITOR_EQ:
+        case ND_BITXOR_EQ: {
+            Reg *reg = var_reg(node->lhs);
+            if(reg) {
+                return assign_var(node->lhs->var, gen_binary(node, reg, node->rhs));
+            }
+            Reg *addr = gen_lval(node->lhs);
+            Reg *val = gen_binary(node, load(addr, node->lhs->ty), node->rhs);
+            return store(addr, val, node->ty);
+        }
+        case ND_COMMA:
+            gen_stmt(node->lhs);
+            return gen_expr(node->rhs);
+        case ND_ADDR:
+            return gen_addr(node->lhs);
+        case ND_NOT:
+            return binop_imm(IR_EQ, gen_expr(node->lhs), 0);
+        case ND_BITNOT: {
+            Reg *val = gen_expr(node->lhs);
+            IR *ir = emit(IR_BITNOT);
+            ir->d = new_reg();
+            ir->a = val;
+            return ir->d;
+        }
+        case ND_LOGAND:
+        case ND_LOGOR:
+            return gen_cond_value(node);
+        case ND_FUNCALL:
+            return gen_funcall(node);
+        case ND_STMT_EXPR: {
+            Node *n = node->body;
+            for(; n->next; n=n->next) {
+                gen_stmt(n);
+            }
+            return gen_expr(n);
+        }
+        case ND_CAST:
+            return truncate(gen_expr(node->lhs), node->ty);
+    }
+
+    return gen_binary_chain(node);
+}
+
+static BB *find_target(char *name, Node *node) {
+    for(Target *t=targets; t; t=t->next) {
+        if(name ? (t->name && !strcmp(t->name, name)) : t->node == node) {
+            return t->bb;
+        }
+    }
+
+    Target *t = calloc(1, sizeof(Target));
+    t->name = name;
+    t->node = node;
+    t->bb = new_bb();
+    t->next = targets;
+    targets = t;
+    return t->bb;
+}
+
+// Dispatches by comparing with cases[lo..hi) one after another.
+static void gen_case_chain(Reg *val, Node **cases, int lo, int hi, BB *dflt) {
+    for(int i=lo; i<hi; i++) {
+        BB *next = new_bb();
+        br(IR_EQ, val, NULL, cases[i]->val, find_target(NULL, cases[i]), next);
+        start_bb(next);
+    }
+    jmp(dflt);
+}
+
+// Dispatches by binary search over the sorted cases[lo..hi).
+static void gen_case_bsearch(Reg *val, Node **cases, int lo, int hi, BB *dflt) {
+    if(hi - lo < SWITCH_MIN_CASES) {
+        gen_case_chain(val, cases, lo, hi, dflt);
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+    BB *ne = new_bb();
+    BB *lt = new_bb();
+    BB *gt = new_bb();
+    br(IR_EQ, val, NULL, cases[mid]->val, find_target(NULL, cases[mid]), ne);
+    start_bb(ne);
+    br(IR_LT, val, NULL, cases[mid]->val, lt, gt);
+    start_bb(lt);
+    gen_case_bsearch(val, cases, lo, mid, dflt);
+    start_bb(gt);
+    gen_case_bsearch(val, cases, mid + 1, hi, dflt);
+}
+
+// Dispatches through a jump table. Each distinct target is one
+// successor of the IR_SWITCH, after the default block.
+static void gen_case_table(Reg *val, SwitchPlan *plan, BB *dflt) {
+    IR *ir = emit(IR_SWITCH);
+    ir->a = val;
+    ir->imm = plan->cases[0]->val;
+    ir->succs = calloc(plan->ncases + 1, sizeof(BB *));
+    ir->succs[ir->nsuccs++] = dflt;
+    ir->table = calloc(plan->ntable, sizeof(int));
+    ir->ntable = plan->ntable;
+
+    // Cases are sorted, so each one gets the next successor.
+    for(int i=0; i<plan->ntable; i++) {
+        if(plan->table[i]) {
+            ir->table[i] = ir->nsuccs;
+            ir->succs[ir->nsuccs++] = find_target(NULL, plan->table[i]);
+        }
+    }
+}
+
+static void gen_switch(Node *node) {
+    Reg *val = gen_expr(node->cond);
+    BB *brk = new_bb();
+    BB *dflt = node->default_case ? find_target(NULL, node->default_case) : brk;
+
+    SwitchPlan *plan = plan_switch(node);
+    if(plan->kind == SW_TABLE) {
+        gen_case_table(val, plan, dflt);
+    } else if(plan->kind == SW_BSEARCH) {
+        gen_case_bsearch(val, plan->cases, 0, plan->ncases, dflt);
+    } else {
+        gen_case_chain(val, plan->cases, 0, plan->ncases, dflt);
+    }
+
+    BB *saved = brk_bb;
+    brk_bb = brk;
+    gen_stmt(node->then);
+    brk_bb = saved;
+    start_bb(brk);
+}
+
+static void gen_loop_body(Node *node, BB *brk, BB *cont) {
+    BB *saved_brk = brk_bb;
+    BB *saved_cont = cont_bb;
+    brk_bb = brk;
+    cont_bb = cont;
+    gen_stmt(node);
+    brk_bb = saved_brk;
+    cont_bb = saved_cont;
+}
+
+static void gen_stmt(Node *node) {
+    switch(node->kind) {
+        case ND_NULL:
+            return;
+        case ND_IF: {
+            BB *then = new_bb();
+            BB *els = new_bb();
+            BB *last = new_bb();
+
+            gen_cond(node->cond, then, node->els ? els : last);
+            start_bb(then);
+            gen_stmt(node->then);
+            if(node->els) {
+                jmp(last);
+                start_bb(els);
+                gen_stmt(node->els);
+            }
+            start_bb(last);
+            return;
+        }
+        case ND_WHILE: {
+            // Loops test their condition at the bottom, so that each
+            // iteration takes only one branch.
+            BB *body = new_bb();
+            BB *cond = new_bb();
+            BB *brk = new_bb();
+
+            jmp(cond);
+            start_bb(body);
+            gen_loop_body(node->then, brk, cond);
+            start_bb(cond);
+            gen_cond(node->cond, body, brk);
+            start_bb(brk);
+            return;
+        }
+        case ND_FOR: {
+            BB *body = new_bb();
+            BB *cont = new_bb();
+            BB *cond = new_bb();
+            BB *brk = new_bb();
+
+            if(node->init) {
+                gen_stmt(node->init);
+            }
+            jmp(cond);
+            start_bb(body);
+            gen_loop_body(node->then, brk, cont);
+            start_bb(cont);
+            if(node->inc) {
+                gen_stmt(node->inc);
+            }
+            start_bb(cond);
+            if(node->cond) {
+                gen_cond(node->cond, body, brk);
+            } else {
+                jmp(body);
+            }
+            start_bb(brk);
+            return;
+        }
+        case ND_DO: {
+            BB *body = new_bb();
+            BB *cont = new_bb();
+            BB *brk = new_bb();
+
+            start_bb(body);
+            gen_loop_body(node->then, brk, cont);
+            start_bb(cont);
+            gen_cond(node->cond, body, brk);
+            start_bb(brk);
+            return;
+        }
+        case ND_SWITCH:
+            gen_switch(node);
+            return;
+        case ND_CASE:
+            start_bb(find_target(NULL, node));
+            gen_stmt(node->lhs);
+            return;
+        case ND_BLOCK:
+            for(Node *n=node->body; n; n=n->next) {
+                gen_stmt(n);
+            }
+            return;
+        case ND_BREAK:
+            if(!brk_bb) {
+                error_tok(node->tok, "stray break");
+            }
+            jmp(brk_bb);
+            return;
+        case ND_CONTINUE:
+            if(!cont_bb) {
+                error_tok(node->tok, "stray continue");
+            }
+            jmp(cont_bb);
+            return;
+        case ND_GOTO:
+            jmp(find_target(node->label_name, NULL));
+            return;
+        case ND_LABEL:
+            start_bb(find_target(node->label_name, NULL));
+            gen_stmt(node->lhs);
+            return;
+        case ND_RETURN: {
+            Reg *val = node->lhs ? gen_expr(node->lhs) : NULL;
+            IR *ir = emit(IR_RET);
+            ir->a = val;
+            return;
+        }
+        case ND_EXPR_STMT:
+            gen_expr(node->lhs);
+            return;
+    }
+
+    gen_expr(node);
+}
+
+static bool is_scalar(Type *ty) {
+    return is_integer(ty) || ty->kind == TY_PTR;
+}
+
+static bool is_local_addr(Node *node) {
+    return node->kind == ND_ADDR && node->lhs->kind == ND_VAR && node->lhs->var->is_local;
+}
+
+// Gives every scalar local a virtual register, then takes it away again
+// from those whose address is taken. Pointer arithmetic on the address
+// of a local may reach its neighbours in the frame, so a function doing
+// that keeps all of its locals in memory.
+static void promote_vars() {
+    for(VarList *vl=fn->locals; vl; vl=vl->next) {
+        Var *var = vl->var;
+        var->reg = is_scalar(var->ty) ? new_reg() : NULL;
+    }
+
+    NodeStack st = {};
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&st, node);
+    }
+
+    bool escapes = false;
+    while(st.len) {
+        Node *node = st.data[--st.len];
+        if(is_local_addr(node)) {
+            node->lhs->var->reg = NULL;
+        }
+        if((node->kind == ND_PTR_ADD || node->kind == ND_PTR_SUB) && is_local_addr(node->lhs)) {
+            escapes = true;
+        }
+        push_children(&st, node);
+    }
+    free(st.data);
+
+    if(escapes) {
+        for(VarList *vl=fn->locals; vl; vl=vl->next) {
+            vl->var->reg = NULL;
+        }
+    }
+}
+
+// Copies the arguments out of the argument registers. All of them are
+// read before anything else runs, because instructions such as stores
+// of spilled values use RDI as a scratch register.
+static void gen_params() {
+    int nparams = 0;
+    for(VarList *vl=fn->params; vl; vl=vl->next) {
+        nparams++;
+    }
+    if(nparams > MAX_ARGS) error_tok(fn->tok, "too many parameters");
+
+    Reg **vals = calloc(nparams, sizeof(Reg *));
+    int i = 0;
+    for(VarList *vl=fn->params; vl; vl=vl->next) {
+        Var *var = vl->var;
+        IR *ir = emit(IR_PARAM);
+        ir->d = var->reg ? var->reg : new_reg();
+        ir->imm = i;
+        ir->size = mem_size(var->ty);
+        vals[i++] = ir->d;
+    }
+
+    i = 0;
+    for(VarList *vl=fn->params; vl; vl=vl->next) {
+        Var *var = vl->var;
+        Reg *val = vals[i++];
+        if(var->reg) continue;
+
+        Reg *addr = lvar_addr(var);
+        IR *ir = emit(IR_STORE);
+        ir->a = addr;
+        ir->b = val;
+        ir->size = mem_size(var->ty);
+    }
+}
+
+static void gen_fn(Function *f) {
+    fn = f;
+    targets = NULL;
+    promote_vars();
+
+    fn->bbs = new_bb();
+    last_bb = fn->bbs;
+    out = fn->bbs;
+
+    gen_params();
+    for(Node *node=fn->node; node; node=node->next) {
+        gen_stmt(node);
+    }
+
+    if(!is_terminated(out)) {
+        emit(IR_RET);
+    }
+}
+
+// Returns the number of instructions emitted.
+int gen_ir(Program *prog) {
+    ninsts = 0;
+    for(Function *f=prog->fns; f; f=f->next) {
+        gen_fn(f);
+    }
+    return ninsts;
+}
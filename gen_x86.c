@@ -0,0 +1,563 @@
+#include "chibicc.h"
+
+// Emits x86-64 assembly for functions lowered by gen_ir() and allocated
+// by alloc_regs().
+//
+// RAX, RCX, RDX and RDI never hold a virtual register. They are scratch
+// registers for spilled operands and the fixed operands of division,
+// shifts and calls.
+//
+// A leaf function whose frame fits in the 128-byte red zone below RSP,
+// which signal handlers leave alone, does not set up a frame: it never
+// pushes anything, so its locals and spill slots are addressed from RSP
+// at the same offsets they would have from RBP.
+
+// Allocatable registers, in the order of register numbers. The first
+// NUM_CALLER_SAVED ones are caller-saved.
+static char *regs[] = {"r10", "r11", "rbx", "r12", "r13", "r14", "r15"};
+static char *regs8[] = {"r10b", "r11b", "bl", "r12b", "r13b", "r14b", "r15b"};
+static char *regs16[] = {"r10w", "r11w", "bx", "r12w", "r13w", "r14w", "r15w"};
+static char *regs32[] = {"r10d", "r11d", "ebx", "r12d", "r13d", "r14d", "r15d"};
+
+static char *argreg1[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
+static char *argreg2[] = {"di", "si", "dx", "cx", "r8w", "r9w"};
+static char *argreg4[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+static char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+static Function *fn;
+static BB *next_bb; // block emitted after the current one
+static int ntables; // jump tables emitted
+static bool strength_reduce; // multiply and divide by constants cheaply
+static bool omit_frame_pointer; // in leaf functions
+static char *frame_reg; // "rbp", or "rsp" in a function without a frame
+static bool has_frame;
+static bool sibling_calls; // calls in tail position may reuse the frame
+
+enum { RED_ZONE = 128 };
+
+static char *format(char *fmt, long val) {
+    char *buf = calloc(1, 40);
+    sprintf(buf, fmt, val);
+    return buf;
+}
+
+// Returns a memory operand `offset` bytes below the frame base.
+static char *frame_slot(char *ptr, long offset) {
+    char *buf = calloc(1, 40);
+    sprintf(buf, "%s[%s-%ld]", ptr, frame_reg, offset);
+    return buf;
+}
+
+static bool is_imm_operand(long val) {
+    return val == (int)val;
+}
+
+static bool in_reg(Reg *r) {
+    return r->rn >= 0;
+}
+
+// Returns the operand of a virtual register: its machine register or its
+// spill slot.
+static char *loc(Reg *r) {
+    if(in_reg(r)) {
+        return regs[r->rn];
+    }
+    return frame_slot("qword ptr ", r->spill);
+}
+
+// Returns the low `size` bytes of a virtual register.
+static char *loc_sized(Reg *r, int size) {
+    if(!in_reg(r)) {
+        if(size == 1) return frame_slot("byte ptr ", r->spill);
+        if(size == 2) return frame_slot("word ptr ", r->spill);
+        if(size == 4) return frame_slot("dword ptr ", r->spill);
+        return loc(r);
+    }
+    if(size == 1) return regs8[r->rn];
+    if(size == 2) return regs16[r->rn];
+    if(size == 4) return regs32[r->rn];
+    return regs[r->rn];
+}
+
+// Returns the second operand: a register, a spill slot or an immediate.
+static char *src(IR *ir) {
+    if(ir->b) {
+        return loc(ir->b);
+    }
+    return format("%ld", ir->imm);
+}
+
+// Returns a machine register holding a virtual register, loading it into
+// the given scratch register if it is spilled.
+static char *use_reg(Reg *r, char *scratch) {
+    if(in_reg(r)) {
+        return regs[r->rn];
+    }
+    printf("  mov %s, %s\n", scratch, loc(r));
+    return scratch;
+}
+
+// Returns the register an instruction should compute its result in:
+// the destination itself, or RAX if the destination is spilled.
+static char *dest_reg(Reg *d) {
+    return in_reg(d) ? regs[d->rn] : "rax";
+}
+
+// Stores a result computed in dest_reg() to a spilled destination.
+static void finish(Reg *d) {
+    if(!in_reg(d)) {
+        printf("  mov %s, rax\n", loc(d));
+    }
+}
+
+static bool same_reg(Reg *x, Reg *y) {
+    return x && y && in_reg(x) && in_reg(y) && x->rn == y->rn;
+}
+
+static bool is_commutative(IROp op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR;
+}
+
+static char *binop_insn(IROp op) {
+    switch(op) {
+        case IR_ADD: return "add";
+        case IR_SUB: return "sub";
+        case IR_MUL: return "imul";
+        case IR_AND: return "and";
+        case IR_OR: return "or";
+        case IR_XOR: return "xor";
+    }
+    error("internal error: not a two-address instruction");
+}
+
+// d = a op b, computed in place in d.
+static void emit_binop(IR *ir) {
+    char *insn = binop_insn(ir->op);
+
+    if(same_reg(ir->d, ir->b) && !same_reg(ir->d, ir->a)) {
+        if(is_commutative(ir->op)) {
+            printf("  %s %s, %s\n", insn, loc(ir->d), loc(ir->a));
+            return;
+        }
+        printf("  mov rax, %s\n", loc(ir->a));
+        printf("  %s rax, %s\n", insn, src(ir));
+        printf("  mov %s, rax\n", loc(ir->d));
+        return;
+    }
+
+    char *d = dest_reg(ir->d);
+    if(!same_reg(ir->d, ir->a)) {
+        printf("  mov %s, %s\n", d, loc(ir->a));
+    }
+    if(ir->op == IR_MUL && !ir->b && strength_reduce && can_mul_imm(ir->imm)) {
+        emit_mul_imm(stdout, d, ir->imm);
+    } else {
+        printf("  %s %s, %s\n", insn, d, src(ir));
+    }
+    finish(ir->d);
+}
+
+// d = a / b or a % b. Division by a constant avoids idiv.
+static void emit_div(IR *ir) {
+    printf("  mov rax, %s\n", loc(ir->a));
+    if(!ir->b && strength_reduce && can_div_imm(ir->imm)) {
+        emit_div_imm(stdout, ir->imm, ir->op == IR_MOD);
+        printf("  mov %s, rax\n", loc(ir->d));
+        return;
+    }
+
+    printf("  cqo\n");
+    if(ir->b) {
+        printf("  idiv %s\n", loc(ir->b));
+    } else {
+        printf("  mov rdi, %ld\n", ir->imm);
+        printf("  idiv rdi\n");
+    }
+    if(ir->op == IR_MOD) {
+        printf("  mov rax, rdx\n");
+    }
+    printf("  mov %s, rax\n", loc(ir->d));
+}
+
+static void emit_shift(IR *ir) {
+    char *insn = ir->op == IR_SHL ? "shl" : "sar";
+    if(ir->b) {
+        printf("  mov rcx, %s\n", loc(ir->b));
+    }
+
+    char *d = same_reg(ir->d, ir->b) ? "rax" : dest_reg(ir->d);
+    if(!same_reg(ir->d, ir->a) || !strcmp(d, "rax")) {
+        printf("  mov %s, %s\n", d, loc(ir->a));
+    }
+    if(ir->b) {
+        printf("  %s %s, cl\n", insn, d);
+    } else {
+        printf("  %s %s, %ld\n", insn, d, ir->imm & 63);
+    }
+    if(strcmp(d, loc(ir->d))) {
+        printf("  mov %s, %s\n", loc(ir->d), d);
+    }
+}
+
+static char *cond_code(IROp op) {
+    switch(op) {
+        case IR_EQ: return "e";
+        case IR_NE: return "ne";
+        case IR_LT: return "l";
+        case IR_LE: return "le";
+    }
+    error("internal error: not a comparison");
+}
+
+static char *inverse_cond_code(IROp op) {
+    switch(op) {
+        case IR_EQ: return "ne";
+        case IR_NE: return "e";
+        case IR_LT: return "ge";
+        case IR_LE: return "g";
+    }
+    error("internal error: not a comparison");
+}
+
+// Compares a with b. Both may not be memory operands.
+static void emit_cmp(IR *ir) {
+    char *a = loc(ir->a);
+    if(!in_reg(ir->a) && ir->b && !in_reg(ir->b)) {
+        a = use_reg(ir->a, "rax");
+    }
+    printf("  cmp %s, %s\n", a, src(ir));
+}
+
+static void emit_setcc(IR *ir) {
+    emit_cmp(ir);
+    printf("  set%s al\n", cond_code(ir->op));
+    printf("  movzb %s, al\n", dest_reg(ir->d));
+    finish(ir->d);
+}
+
+static char *load_insn(int size) {
+    if(size == 1) return "movsx %s, byte ptr [%s%s]\n";
+    if(size == 2) return "movsx %s, word ptr [%s%s]\n";
+    if(size == 4) return "movsxd %s, dword ptr [%s%s]\n";
+    return "mov %s, [%s%s]\n";
+}
+
+static char *disp(long val) {
+    if(val == 0) return "";
+    return format("%+ld", val);
+}
+
+static void emit_load(IR *ir) {
+    char *addr = use_reg(ir->a, "rax");
+    printf("  ");
+    printf(load_insn(ir->size), dest_reg(ir->d), addr, disp(ir->imm));
+    finish(ir->d);
+}
+
+static void emit_store(IR *ir) {
+    char *addr = use_reg(ir->a, "rax");
+    char *val = "rdi";
+    if(in_reg(ir->b)) {
+        val = loc_sized(ir->b, ir->size);
+    } else {
+        printf("  mov rdi, %s\n", loc(ir->b));
+        if(ir->size == 1) val = argreg1[0];
+        if(ir->size == 2) val = argreg2[0];
+        if(ir->size == 4) val = argreg4[0];
+    }
+    printf("  mov [%s%s], %s\n", addr, disp(ir->imm), val);
+}
+
+static void emit_trunc(IR *ir) {
+    char *insn = ir->size == 4 ? "movsxd" : "movsx";
+    printf("  %s %s, %s\n", insn, dest_reg(ir->d), loc_sized(ir->a, ir->size));
+    finish(ir->d);
+}
+
+static void emit_param(IR *ir) {
+    int i = ir->imm;
+    char *d = dest_reg(ir->d);
+    if(ir->size == 1) {
+        printf("  movsx %s, %s\n", d, argreg1[i]);
+    } else if(ir->size == 2) {
+        printf("  movsx %s, %s\n", d, argreg2[i]);
+    } else if(ir->size == 4) {
+        printf("  movsxd %s, %s\n", d, argreg4[i]);
+    } else {
+        printf("  mov %s, %s\n", d, argreg8[i]);
+    }
+    finish(ir->d);
+}
+
+static void emit_call(IR *ir) {
+    for(int i=0; i<ir->nargs; i++) {
+        printf("  mov %s, %s\n", argreg8[i], loc(ir->args[i]));
+    }
+    // The frame keeps RSP 16-byte aligned, as the ABI requires at calls.
+    printf("  mov rax, 0\n");
+    printf("  call %s\n", ir->name);
+    printf("  mov %s, rax\n", loc(ir->d));
+}
+
+// Restores the callee-saved registers and RSP as they were at the entry
+// of the function.
+static void emit_epilogue() {
+    int offset = fn->stack_size;
+    for(int i=NUM_CALLER_SAVED; i<NUM_REGS; i++) {
+        if(fn->used_regs & (1 << i)) {
+            offset += 8;
+            printf("  mov %s, %s\n", regs[i], frame_slot("", offset));
+        }
+    }
+    if(has_frame) {
+        printf("  mov rsp, rbp\n");
+        printf("  pop rbp\n");
+    }
+}
+
+// Returns true if the result of a call is returned right away, so the
+// frame can be torn down before jumping to the callee, which then
+// returns to our caller.
+static bool is_sibling_call(IR *ir) {
+    if(!sibling_calls || ir->op != IR_CALL) return false;
+    return ir->next && ir->next->op == IR_RET && ir->next->a == ir->d;
+}
+
+static void emit_sibling_call(IR *ir) {
+    for(int i=0; i<ir->nargs; i++) {
+        printf("  mov %s, %s\n", argreg8[i], loc(ir->args[i]));
+    }
+    emit_epilogue();
+    printf("  mov rax, 0\n");
+    printf("  jmp %s\n", ir->name);
+    count_stat("sibling-calls");
+}
+
+static void emit_va_start(IR *ir) {
+    char *ap = use_reg(ir->a, "rax");
+    printf("  mov edi, dword ptr [rbp-8]\n");
+    printf("  mov dword ptr [%s], 0\n", ap);
+    printf("  mov dword ptr [%s+4], 0\n", ap);
+    printf("  mov qword ptr [%s+8], rdi\n", ap);
+    printf("  mov qword ptr [%s+16], 0\n", ap);
+}
+
+static void emit_jmp(BB *bb) {
+    if(bb != next_bb) {
+        printf("  jmp .L.bb.%d\n", bb->label);
+    }
+}
+
+static void emit_br(IR *ir) {
+    emit_cmp(ir);
+    if(ir->then == next_bb) {
+        printf("  j%s .L.bb.%d\n", inverse_cond_code(ir->cmp), ir->els->label);
+        return;
+    }
+    printf("  j%s .L.bb.%d\n", cond_code(ir->cmp), ir->then->label);
+    emit_jmp(ir->els);
+}
+
+// Bounds-checks the index into the jump table in rax, then jumps
+// through the table, which goes to .rodata.
+static void emit_switch(IR *ir) {
+    int id = ntables++;
+    printf("  mov rax, %s\n", loc(ir->a));
+    if(ir->imm) {
+        printf("  sub rax, %ld\n", ir->imm);
+    }
+    printf("  cmp rax, %d\n", ir->ntable - 1);
+    printf("  ja .L.bb.%d\n", ir->succs[0]->label);
+    printf("  jmp qword ptr [.L.table.%d+rax*8]\n", id);
+
+    printf(".section .rodata\n");
+    printf(".align 8\n");
+    printf(".L.table.%d:\n", id);
+    for(int i=0; i<ir->ntable; i++) {
+        printf("  .quad .L.bb.%d\n", ir->succs[ir->table[i]]->label);
+    }
+    printf(".text\n");
+}
+
+static void emit_ir(IR *ir) {
+    switch(ir->op) {
+        case IR_IMM:
+            if(is_imm_operand(ir->imm)) {
+                printf("  mov %s, %ld\n", loc(ir->d), ir->imm);
+            } else {
+                printf("  movabs %s, %ld\n", dest_reg(ir->d), ir->imm);
+                finish(ir->d);
+            }
+            return;
+        case IR_MOV:
+            if(same_reg(ir->d, ir->a)) return;
+            if(in_reg(ir->d) || in_reg(ir->a)) {
+                printf("  mov %s, %s\n", loc(ir->d), loc(ir->a));
+                return;
+            }
+            printf("  mov rax, %s\n", loc(ir->a));
+            printf("  mov %s, rax\n", loc(ir->d));
+            return;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+            emit_binop(ir);
+            return;
+        case IR_DIV:
+        case IR_MOD:
+            emit_div(ir);
+            return;
+        case IR_SHL:
+        case IR_SHR:
+            emit_shift(ir);
+            return;
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+            emit_setcc(ir);
+            return;
+        case IR_BITNOT: {
+            char *d = dest_reg(ir->d);
+            if(!same_reg(ir->d, ir->a)) {
+                printf("  mov %s, %s\n", d, loc(ir->a));
+            }
+            printf("  not %s\n", d);
+            finish(ir->d);
+            return;
+        }
+        case IR_TRUNC:
+            emit_trunc(ir);
+            return;
+        case IR_LVAR:
+            printf("  lea %s, %s\n", dest_reg(ir->d), frame_slot("", ir->var->offset));
+            finish(ir->d);
+            return;
+        case IR_GVAR:
+            printf("  mov %s, offset %s\n", dest_reg(ir->d), ir->name);
+            finish(ir->d);
+            return;
+        case IR_LOAD:
+            emit_load(ir);
+            return;
+        case IR_STORE:
+            emit_store(ir);
+            return;
+        case IR_PARAM:
+            emit_param(ir);
+            return;
+        case IR_CALL:
+            emit_call(ir);
+            return;
+        case IR_VA_START:
+            emit_va_start(ir);
+            return;
+        case IR_JMP:
+            emit_jmp(ir->then);
+            return;
+        case IR_BR:
+            emit_br(ir);
+            return;
+        case IR_SWITCH:
+            emit_switch(ir);
+            return;
+        case IR_RET:
+            if(ir->a) {
+                printf("  mov rax, %s\n", loc(ir->a));
+            }
+            printf("  jmp .L.return.%s\n", fn->name);
+            return;
+    }
+}
+
+static bool is_leaf(Function *fn) {
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->op == IR_CALL) return false;
+        }
+    }
+    return true;
+}
+
+static void emit_fn(Function *f) {
+    fn = f;
+    sibling_calls = is_mode_enabled("sibling-calls") && !check_frame_reuse(fn);
+    if(!fn->is_static) {
+        printf(".global %s\n", fn->name);
+    }
+    printf("%s:\n", fn->name);
+
+    // Callee-saved registers are saved below the locals and spill slots.
+    int nsaved = 0;
+    for(int i=NUM_CALLER_SAVED; i<NUM_REGS; i++) {
+        if(fn->used_regs & (1 << i)) nsaved++;
+    }
+    int frame = align_to(fn->stack_size + nsaved * 8, 16);
+
+    has_frame = !omit_frame_pointer || fn->has_varargs ||
+        fn->stack_size + nsaved * 8 > RED_ZONE || !is_leaf(fn);
+    frame_reg = has_frame ? "rbp" : "rsp";
+    if(has_frame) {
+        printf("  push rbp\n");
+        printf("  mov rbp, rsp\n");
+        printf("  sub rsp, %d\n", frame);
+    } else {
+        count_stat("frame-omitted");
+    }
+
+    if(fn->has_varargs) {
+        int n = 0;
+        for(VarList *vl=fn->params; vl; vl=vl->next) {
+            n++;
+        }
+
+        printf("  mov dword ptr [rbp-8], %d\n", n * 8);
+        printf("  mov [rbp-16], r9\n");
+        printf("  mov [rbp-24], r8\n");
+        printf("  mov [rbp-32], rcx\n");
+        printf("  mov [rbp-40], rdx\n");
+        printf("  mov [rbp-48], rsi\n");
+        printf("  mov [rbp-56], rdi\n");
+    }
+
+    int offset = fn->stack_size;
+    for(int i=NUM_CALLER_SAVED; i<NUM_REGS; i++) {
+        if(fn->used_regs & (1 << i)) {
+            offset += 8;
+            printf("  mov %s, %s\n", frame_slot("", offset), regs[i]);
+        }
+    }
+
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        next_bb = bb->next;
+        printf(".L.bb.%d:\n", bb->label);
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            // The return after a sibling call is never reached.
+            if(is_sibling_call(ir)) {
+                emit_sibling_call(ir);
+                break;
+            }
+            emit_ir(ir);
+        }
+    }
+
+    printf(".L.return.%s:\n", fn->name);
+    emit_epilogue();
+    printf("  ret\n");
+}
+
+void gen_x86(Program *prog) {
+    printf(".intel_syntax noprefix\n");
+    emit_data(prog);
+    strength_reduce = is_mode_enabled("strength-reduce");
+    omit_frame_pointer = is_mode_enabled("omit-frame-pointer");
+
+    printf(".text\n");
+    for(Function *f=prog->fns; f; f=f->next) {
+        emit_fn(f);
+    }
+    emit_vector_kernels();
+}
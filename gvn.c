@@ -0,0 +1,222 @@
+#include "chibicc.h"
+
+// Global value numbering on the IR in SSA form.
+//
+// Blocks are visited in preorder of the dominator tree, so every block
+// comes after the blocks dominating it. An instruction computing the
+// same operator on the same operands as an earlier one in a dominating
+// block is redundant: its result is replaced with the earlier one and
+// it is removed. Operands are replaced before an instruction is looked
+// up, so whole chains such as the address of `board[i][col]` are shared,
+// and copies are propagated the same way.
+//
+// Constants and addresses of variables are cheaper to recompute than to
+// keep in a register across blocks, so they are only shared within a
+// block. So are loads, which are also forgotten at a store that may
+// write the memory they read, or at a call.
+
+enum { NUM_BUCKETS = 256 };
+
+typedef struct Value Value;
+struct Value {
+    Value *next;
+    IR *ir;
+    BB *bb;
+    bool killed; // a load that may be stale
+};
+
+static Function *fn;
+static Value *buckets[NUM_BUCKETS];
+static Reg **repl; // by register number, the register replacing it
+static IR **def; // by register number
+static int nchanges;
+
+static bool is_numbered(IROp op) {
+    switch(op) {
+        case IR_IMM:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_MOD:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_SHL:
+        case IR_SHR:
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+        case IR_BITNOT:
+        case IR_TRUNC:
+        case IR_LVAR:
+        case IR_GVAR:
+        case IR_LOAD:
+            return true;
+    }
+    return false;
+}
+
+static bool is_local_only(IROp op) {
+    return op == IR_IMM || op == IR_LVAR || op == IR_GVAR || op == IR_LOAD;
+}
+
+static bool is_commutative(IROp op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR ||
+        op == IR_EQ || op == IR_NE;
+}
+
+static int vn_of(Reg *r) {
+    return r ? r->vn : -1;
+}
+
+static int hash(IR *ir) {
+    long h = ir->op * 31 + ir->imm;
+    h = h * 31 + vn_of(ir->a) + vn_of(ir->b);
+    h = h * 31 + ir->size;
+    if(ir->var) h = h * 31 + ir->var->offset;
+    if(h < 0) h = -h;
+    return h % NUM_BUCKETS;
+}
+
+static bool is_same(IR *x, IR *y) {
+    if(x->op != y->op || x->imm != y->imm || x->size != y->size || x->var != y->var) return false;
+    if(x->name && strcmp(x->name, y->name)) return false;
+    if(x->a == y->a && x->b == y->b) return true;
+    return is_commutative(x->op) && x->a == y->b && x->b == y->a;
+}
+
+// Returns the instruction computing the address of the variable an
+// address points into, or NULL if it is not known.
+static IR *base_of(Reg *addr) {
+    IR *ir = def[addr->vn];
+    while(ir && (ir->op == IR_ADD || ir->op == IR_SUB) && !ir->b) {
+        ir = def[ir->a->vn];
+    }
+    if(ir && (ir->op == IR_LVAR || ir->op == IR_GVAR)) return ir;
+    return NULL;
+}
+
+static bool may_alias(IR *load, IR *store) {
+    IR *x = base_of(load->a);
+    IR *y = base_of(store->a);
+    if(!x || !y || x->op != y->op) return !x || !y;
+    if(x->op == IR_LVAR) return x->var == y->var;
+    return !strcmp(x->name, y->name);
+}
+
+// Forgets the loads a store may overwrite, or all of them if store is
+// NULL.
+static void kill_loads(IR *store) {
+    for(int i=0; i<NUM_BUCKETS; i++) {
+        for(Value *v=buckets[i]; v; v=v->next) {
+            if(v->ir->op == IR_LOAD && (!store || may_alias(v->ir, store))) v->killed = true;
+        }
+    }
+}
+
+static Value *find_value(IR *ir, BB *bb) {
+    for(Value *v=buckets[hash(ir)]; v; v=v->next) {
+        if(v->killed || !is_same(v->ir, ir)) continue;
+        if(is_local_only(ir->op) ? v->bb == bb : dominates(v->bb, bb)) return v;
+    }
+    return NULL;
+}
+
+static void add_value(IR *ir, BB *bb) {
+    Value *v = calloc(1, sizeof(Value));
+    v->ir = ir;
+    v->bb = bb;
+    int h = hash(ir);
+    v->next = buckets[h];
+    buckets[h] = v;
+}
+
+static void replace_uses(IR *ir) {
+    for(int i=0; i<ir_num_uses(ir); i++) {
+        Reg *r = ir_use(ir, i);
+        if(r && repl[r->vn]) set_ir_use(ir, i, repl[r->vn]);
+    }
+}
+
+static void number_block(BB *bb) {
+    IR *ir = bb->first;
+    while(ir) {
+        IR *next = ir->next;
+        replace_uses(ir);
+
+        if(ir->op == IR_STORE) {
+            kill_loads(ir);
+        } else if(ir->op == IR_CALL || ir->op == IR_VA_START) {
+            kill_loads(NULL);
+        }
+
+        if(ir->op == IR_MOV) {
+            repl[ir->d->vn] = ir->a;
+            remove_ir(bb, ir);
+            nchanges++;
+        } else if(is_numbered(ir->op)) {
+            Value *v = find_value(ir, bb);
+            if(v) {
+                repl[ir->d->vn] = v->ir->d;
+                remove_ir(bb, ir);
+                nchanges++;
+            } else {
+                add_value(ir, bb);
+            }
+        }
+        ir = next;
+    }
+}
+
+// Removes redundant computations from a function. Returns the number of
+// instructions removed.
+int gvn(Function *f) {
+    fn = f;
+    nchanges = 0;
+    compute_dominators(fn);
+    for(int i=0; i<NUM_BUCKETS; i++) {
+        buckets[i] = NULL;
+    }
+    repl = calloc(fn->nregs, sizeof(Reg *));
+    def = calloc(fn->nregs, sizeof(IR *));
+
+    int nblocks = 0;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        nblocks++;
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->d) def[ir->d->vn] = ir;
+        }
+    }
+
+    // Blocks in preorder of the dominator tree
+    BB **order = calloc(nblocks, sizeof(BB *));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        order[bb->dom_pre] = bb;
+    }
+    for(int i=0; i<nblocks; i++) {
+        number_block(order[i]);
+    }
+
+    // Phis may use values from blocks visited after them.
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            replace_uses(ir);
+        }
+    }
+
+    for(int i=0; i<NUM_BUCKETS; i++) {
+        Value *v = buckets[i];
+        while(v) {
+            Value *next = v->next;
+            free(v);
+            v = next;
+        }
+    }
+    free(order);
+    free(repl);
+    free(def);
+    verify_ir(fn, true);
+    return nchanges;
+}
@@ -0,0 +1,387 @@
+#include "chibicc.h"
+
+// Inlining of small static functions on the AST, so that both code
+// generators see the callee's body in place of the call.
+//
+// A call is replaced with a statement expression that assigns the
+// arguments to copies of the parameters and runs a copy of the body:
+//
+//   f(x, y)  =>  ({ a = x; b = y; <body>; <result>; })
+//
+// The parameters and locals of the callee become locals of the caller.
+// If the only return statement ends the body, its value is the result.
+// Otherwise every return stores its value to a result variable and
+// jumps to a label at the end of the copy. The label names contain a
+// dot, so they cannot clash with those of the program.
+//
+// A function is inlined if it is static and its body has at most
+// INLINE_SIZE nodes. Calls in an inlined body are inlined in turn, up to
+// MAX_DEPTH levels, which stops the unrolling of recursion. A function
+// is never inlined into itself.
+
+enum {
+    INLINE_SIZE = 40,
+    MAX_DEPTH = 3,
+};
+
+static Program *prog;
+static Function *caller;
+static int ncopies;
+static NodeStack walk;
+
+// Slots of the caller that are still to be visited, with the number of
+// inlined calls each one is nested in
+static SlotStack slots;
+static int *depths;
+static int depths_cap;
+
+// The locals of the callee and their copies in the caller
+static Var **from;
+static Var **to;
+static int nvars;
+static int vars_cap;
+
+// Gives the slots pushed since `from` a depth.
+static void set_depths(int from, int depth) {
+    if(depths_cap < slots.cap) {
+        depths_cap = slots.cap;
+        depths = realloc(depths, sizeof(int) * depths_cap);
+    }
+    for(int i=from; i<slots.len; i++) {
+        depths[i] = depth;
+    }
+}
+
+static void push_depth_slot(Node **slot, int depth) {
+    int len = slots.len;
+    push_slot(&slots, slot);
+    set_depths(len, depth);
+}
+
+static void push_depth_child_slots(Node *node, int depth) {
+    int len = slots.len;
+    push_child_slots(&slots, node);
+    set_depths(len, depth);
+}
+
+// Returns the statement `var = expr;`.
+static Node *new_store(Var *var, Node *expr) {
+    Node *node = new_binary(ND_ASSIGN, new_var_node(var, expr->tok), expr, expr->tok);
+    return new_unary(ND_EXPR_STMT, node, expr->tok);
+}
+
+static Function *find_fn(char *name) {
+    for(Function *fn=prog->fns; fn; fn=fn->next) {
+        if(!strcmp(fn->name, name)) return fn;
+    }
+    return NULL;
+}
+
+static bool is_local_addr(Node *node) {
+    return node->kind == ND_ADDR && node->lhs->kind == ND_VAR && node->lhs->var->is_local;
+}
+
+// Returns the number of return statements in a list of statements that
+// are not nested in an expression.
+static int count_returns(Node *node) {
+    int n = 0;
+    for(; node; node=node->next) {
+        switch(node->kind) {
+            case ND_RETURN:
+                n++;
+                break;
+            case ND_BLOCK:
+                n += count_returns(node->body);
+                break;
+            case ND_IF:
+                n += count_returns(node->then) + count_returns(node->els);
+                break;
+            case ND_WHILE:
+            case ND_FOR:
+            case ND_DO:
+                n += count_returns(node->then);
+                break;
+            case ND_LABEL:
+                n += count_returns(node->lhs);
+                break;
+        }
+    }
+    return n;
+}
+
+// Returns why a call may not be inlined, or NULL if it may. The size of
+// the callee is stored to *size.
+static char *check_call(Node *call, Function *fn, int depth, int *size) {
+    if(!fn->is_static) return "not static";
+    if(fn == caller) return "recursive";
+    if(depth >= MAX_DEPTH) return "nested too deeply";
+    if(fn->has_varargs) return "variadic";
+    if(call->ty->kind == TY_STRUCT) return "returns a struct";
+
+    Node *arg = call->args;
+    for(VarList *vl=fn->params; vl; vl=vl->next) {
+        if(!arg) return "too few arguments";
+        if(vl->var->ty->kind == TY_STRUCT) return "takes a struct";
+        arg = arg->next;
+    }
+    if(arg) return "too many arguments";
+
+    char *reason = NULL;
+    int nodes = 0;
+    int nreturns = 0;
+    int base = walk.len;
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&walk, node);
+    }
+    while(walk.len > base && !reason) {
+        Node *node = walk.data[--walk.len];
+        if(++nodes > INLINE_SIZE) {
+            reason = "too large";
+            break;
+        }
+        switch(node->kind) {
+            case ND_RETURN:
+                nreturns++;
+                break;
+            case ND_SWITCH:
+                reason = "has a switch statement";
+                break;
+            case ND_GOTO:
+            case ND_LABEL:
+                if(!strchr(node->label_name, '.')) reason = "has a label";
+                break;
+            case ND_PTR_ADD:
+            case ND_PTR_SUB:
+                // This would keep all locals of the caller in memory at
+                // -O2, see promote_vars().
+                if(is_local_addr(node->lhs)) reason = "does arithmetic on the address of a local";
+                break;
+        }
+        push_children(&walk, node);
+    }
+    walk.len = base;
+
+    if(!reason && count_returns(fn->node) != nreturns) {
+        reason = "returns from inside an expression";
+    }
+    *size = nodes;
+    return reason;
+}
+
+// Gives the caller a copy of each local of the callee.
+static void copy_locals(Function *fn) {
+    nvars = 0;
+    for(VarList *vl=fn->locals; vl; vl=vl->next) {
+        if(nvars == vars_cap) {
+            vars_cap = vars_cap ? vars_cap * 2 : 16;
+            from = realloc(from, sizeof(Var *) * vars_cap);
+            to = realloc(to, sizeof(Var *) * vars_cap);
+        }
+        Var *var = vl->var;
+        from[nvars] = var;
+        to[nvars] = new_local(caller, var->name, var->ty);
+        nvars++;
+    }
+}
+
+static Var *map_var(Var *var) {
+    for(int i=0; i<nvars; i++) {
+        if(from[i] == var) return to[i];
+    }
+    return var;
+}
+
+static char *copy_label(char *name, int id) {
+    char *buf = calloc(1, strlen(name) + 20);
+    sprintf(buf, "%s.%d", name, id);
+    return buf;
+}
+
+// Returns a copy of a statement of the callee that uses the copies of
+// its locals and labels.
+static Node *copy_stmt(Node *stmt, int id) {
+    Node *copy = clone_node(stmt);
+    int base = walk.len;
+    push_node(&walk, copy);
+    while(walk.len > base) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_VAR) {
+            node->var = map_var(node->var);
+        }
+        if(node->kind == ND_GOTO || node->kind == ND_LABEL) {
+            node->label_name = copy_label(node->label_name, id);
+        }
+        push_children(&walk, node);
+    }
+    return copy;
+}
+
+// Replaces the return statements in a list of statements with a store
+// of the value to ret, if any, and a jump to label.
+static void rewrite_returns(Node **slot, Var *ret, char *label) {
+    for(; *slot; slot=&(*slot)->next) {
+        Node *node = *slot;
+        switch(node->kind) {
+            case ND_RETURN: {
+                Node *jmp = new_node(ND_GOTO, node->tok);
+                jmp->label_name = label;
+                Node *block = new_node(ND_BLOCK, node->tok);
+                block->body = jmp;
+                if(node->lhs) {
+                    block->body = ret ? new_store(ret, node->lhs) : new_unary(ND_EXPR_STMT, node->lhs, node->tok);
+                    block->body->next = jmp;
+                }
+                block->next = node->next;
+                *slot = block;
+                break;
+            }
+            case ND_BLOCK:
+                rewrite_returns(&node->body, ret, label);
+                break;
+            case ND_IF:
+                rewrite_returns(&node->then, ret, label);
+                rewrite_returns(&node->els, ret, label);
+                break;
+            case ND_WHILE:
+            case ND_FOR:
+            case ND_DO:
+                rewrite_returns(&node->then, ret, label);
+                break;
+            case ND_LABEL:
+                rewrite_returns(&node->lhs, ret, label);
+                break;
+        }
+    }
+}
+
+// Replaces a call with a copy of the callee. The slots of the arguments
+// are visited at the depth of the call, those of the body one deeper.
+static void inline_call(Node **slot, Function *fn, int depth) {
+    Node *call = *slot;
+    Token *tok = call->tok;
+    int id = ncopies++;
+    copy_locals(fn);
+
+    Node *node = new_node(ND_STMT_EXPR, tok);
+    Node **last = &node->body;
+
+    Node *arg = call->args;
+    for(VarList *vl=fn->params; vl; vl=vl->next) {
+        Node *next = arg->next;
+        arg->next = NULL;
+        Node *store = new_store(map_var(vl->var), arg);
+        push_depth_slot(&store->lhs->rhs, depth);
+        *last = store;
+        last = &store->next;
+        arg = next;
+    }
+
+    Node **body = last;
+    for(Node *stmt=fn->node; stmt; stmt=stmt->next) {
+        *last = copy_stmt(stmt, id);
+        last = &(*last)->next;
+    }
+
+    // Find the value of the call.
+    Node *result = NULL;
+    int nreturns = count_returns(*body);
+    Node **end = body;
+    while(*end && (*end)->next) {
+        end = &(*end)->next;
+    }
+    if(nreturns == 1 && *end && (*end)->kind == ND_RETURN) {
+        result = (*end)->lhs;
+        *end = NULL;
+        last = end;
+        if(result && call->ty->kind != TY_VOID) {
+            Node *cast = new_node(ND_CAST, tok);
+            cast->lhs = result;
+            cast->ty = call->ty;
+            result = cast;
+        }
+    } else if(nreturns) {
+        Var *ret = NULL;
+        if(call->ty->kind != TY_VOID) {
+            ret = new_local(caller, "ret", call->ty);
+            result = new_var_node(ret, tok);
+        }
+        char *label = copy_label("inline", id);
+        rewrite_returns(body, ret, label);
+        last = body;
+        while(*last) {
+            last = &(*last)->next;
+        }
+        Node *target = new_node(ND_LABEL, tok);
+        target->label_name = label;
+        target->lhs = new_node(ND_NULL, tok);
+        *last = target;
+        last = &target->next;
+    }
+
+    if(result && call->ty->kind == TY_VOID) {
+        *last = new_unary(ND_EXPR_STMT, result, tok);
+        last = &(*last)->next;
+        result = NULL;
+    }
+    if(!result) result = new_num(0, tok);
+    *last = result;
+
+    push_depth_slot(body, depth + 1);
+    node->next = call->next;
+    *slot = node;
+    push_depth_slot(&node->next, depth);
+    add_type(node);
+}
+
+static int inline_calls(Function *fn) {
+    caller = fn;
+    int n = 0;
+    push_depth_slot(&fn->node, 0);
+
+    while(slots.len) {
+        slots.len--;
+        Node **slot = slots.data[slots.len];
+        int depth = depths[slots.len];
+        Node *node = *slot;
+
+        Function *callee = NULL;
+        if(node->kind == ND_FUNCALL) {
+            callee = find_fn(node->funcname);
+        }
+        if(!callee) {
+            push_depth_child_slots(node, depth);
+            continue;
+        }
+
+        int size;
+        char *reason = check_call(node, callee, depth, &size);
+        if(reason) {
+            if(is_remark_enabled("inline", true)) {
+                warn_tok(node->tok, "%s not inlined into %s: %s", callee->name, fn->name, reason);
+            }
+            push_depth_child_slots(node, depth);
+            continue;
+        }
+
+        if(is_remark_enabled("inline", false)) {
+            warn_tok(node->tok, "%s inlined into %s (size %d)", callee->name, fn->name, size);
+        }
+        count_stat("inlined");
+        inline_call(slot, callee, depth);
+        n++;
+    }
+
+    if(n) assign_offsets(fn);
+    return n;
+}
+
+// Inlines calls to small static functions. Returns the number of calls
+// inlined.
+int inline_fns(Program *p) {
+    prog = p;
+    int n = 0;
+    for(Function *fn=prog->fns; fn; fn=fn->next) {
+        n += inline_calls(fn);
+    }
+    return n;
+}
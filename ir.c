@@ -0,0 +1,400 @@
+#include "chibicc.h"
+
+// Data structures of the optimizing backend's IR, shared by the passes:
+// construction and editing helpers, the control-flow graph, a textual
+// dump and a verifier.
+
+static int nlabel = 1;
+
+BB *new_bb() {
+    BB *bb = calloc(1, sizeof(BB));
+    bb->label = nlabel++;
+    return bb;
+}
+
+Reg *new_vreg(Function *fn) {
+    Reg *r = calloc(1, sizeof(Reg));
+    r->vn = fn->nregs++;
+    r->rn = -1;
+    return r;
+}
+
+IR *new_ir(IROp op) {
+    IR *ir = calloc(1, sizeof(IR));
+    ir->op = op;
+    return ir;
+}
+
+// Inserts an instruction before `pos`, or at the end of the block if
+// `pos` is NULL.
+void insert_ir(BB *bb, IR *pos, IR *ir) {
+    ir->next = pos;
+    ir->prev = pos ? pos->prev : bb->last;
+    if(ir->prev) {
+        ir->prev->next = ir;
+    } else {
+        bb->first = ir;
+    }
+    if(pos) {
+        pos->prev = ir;
+    } else {
+        bb->last = ir;
+    }
+}
+
+void remove_ir(BB *bb, IR *ir) {
+    if(ir->prev) {
+        ir->prev->next = ir->next;
+    } else {
+        bb->first = ir->next;
+    }
+    if(ir->next) {
+        ir->next->prev = ir->prev;
+    } else {
+        bb->last = ir->prev;
+    }
+}
+
+bool is_terminator(IR *ir) {
+    return ir->op == IR_JMP || ir->op == IR_BR || ir->op == IR_SWITCH || ir->op == IR_RET;
+}
+
+// Registers read by an instruction are ir_use(ir, 0) to
+// ir_use(ir, ir_num_uses(ir) - 1); some of them may be NULL.
+int ir_num_uses(IR *ir) {
+    return 2 + ir->nargs;
+}
+
+Reg *ir_use(IR *ir, int i) {
+    if(i == 0) return ir->a;
+    if(i == 1) return ir->b;
+    return ir->args[i - 2];
+}
+
+void set_ir_use(IR *ir, int i, Reg *r) {
+    if(i == 0) {
+        ir->a = r;
+    } else if(i == 1) {
+        ir->b = r;
+    } else {
+        ir->args[i - 2] = r;
+    }
+}
+
+int num_succs(BB *bb) {
+    if(bb->last->op == IR_JMP) return 1;
+    if(bb->last->op == IR_BR) return 2;
+    if(bb->last->op == IR_SWITCH) return bb->last->nsuccs;
+    return 0;
+}
+
+BB *succ(BB *bb, int i) {
+    if(bb->last->op == IR_SWITCH) return bb->last->succs[i];
+    return i == 0 ? bb->last->then : bb->last->els;
+}
+
+// Redirects the i-th edge out of a block to another block.
+void set_succ(BB *bb, int i, BB *s) {
+    if(bb->last->op == IR_SWITCH) {
+        bb->last->succs[i] = s;
+    } else if(i == 0) {
+        bb->last->then = s;
+    } else {
+        bb->last->els = s;
+    }
+}
+
+static void add_pred(BB *bb, BB *pred) {
+    bb->preds = realloc(bb->preds, sizeof(BB *) * (bb->npreds + 1));
+    bb->preds[bb->npreds++] = pred;
+}
+
+// Removes blocks that cannot be reached from the entry block, numbers
+// the rest and computes their predecessors. Returns the number of
+// blocks.
+int compute_cfg(Function *fn) {
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        bb->id = -1;
+        bb->npreds = 0;
+    }
+
+    // Mark reachable blocks with id 0.
+    BB **stack = calloc(1, sizeof(BB *));
+    int cap = 1;
+    int len = 0;
+    stack[len++] = fn->bbs;
+    fn->bbs->id = 0;
+    while(len) {
+        BB *bb = stack[--len];
+        for(int i=0; i<num_succs(bb); i++) {
+            BB *s = succ(bb, i);
+            if(s->id == 0) continue;
+            s->id = 0;
+            if(len == cap) {
+                cap *= 2;
+                stack = realloc(stack, sizeof(BB *) * cap);
+            }
+            stack[len++] = s;
+        }
+    }
+    free(stack);
+
+    int n = 0;
+    BB *prev = NULL;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        if(bb->id == -1) {
+            prev->next = bb->next;
+            continue;
+        }
+        bb->id = n++;
+        prev = bb;
+    }
+
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(int i=0; i<num_succs(bb); i++) {
+            add_pred(succ(bb, i), bb);
+        }
+    }
+    return n;
+}
+
+bool dominates(BB *x, BB *y) {
+    return x->dom_pre <= y->dom_pre && y->dom_post <= x->dom_post;
+}
+
+//
+// Dump
+//
+
+static char *op_name(IROp op) {
+    switch(op) {
+        case IR_IMM: return "imm";
+        case IR_MOV: return "mov";
+        case IR_ADD: return "add";
+        case IR_SUB: return "sub";
+        case IR_MUL: return "mul";
+        case IR_DIV: return "div";
+        case IR_MOD: return "mod";
+        case IR_AND: return "and";
+        case IR_OR: return "or";
+        case IR_XOR: return "xor";
+        case IR_SHL: return "shl";
+        case IR_SHR: return "shr";
+        case IR_EQ: return "eq";
+        case IR_NE: return "ne";
+        case IR_LT: return "lt";
+        case IR_LE: return "le";
+        case IR_BITNOT: return "bitnot";
+        case IR_TRUNC: return "trunc";
+        case IR_LVAR: return "lvar";
+        case IR_GVAR: return "gvar";
+        case IR_LOAD: return "load";
+        case IR_STORE: return "store";
+        case IR_PARAM: return "param";
+        case IR_CALL: return "call";
+        case IR_VA_START: return "va_start";
+        case IR_JMP: return "jmp";
+        case IR_BR: return "br";
+        case IR_SWITCH: return "switch";
+        case IR_RET: return "ret";
+        case IR_PHI: return "phi";
+    }
+    return "?";
+}
+
+static void dump_reg(Reg *r) {
+    fprintf(stderr, "v%d", r->vn);
+}
+
+// Prints the b operand: a register or the immediate value.
+static void dump_b(IR *ir) {
+    if(ir->b) {
+        dump_reg(ir->b);
+    } else {
+        fprintf(stderr, "%ld", ir->imm);
+    }
+}
+
+static void dump_inst(IR *ir) {
+    fprintf(stderr, "  ");
+    if(ir->d) {
+        dump_reg(ir->d);
+        fprintf(stderr, " = ");
+    }
+    fprintf(stderr, "%s", op_name(ir->op));
+
+    switch(ir->op) {
+        case IR_IMM:
+            fprintf(stderr, " %ld", ir->imm);
+            break;
+        case IR_MOV:
+        case IR_BITNOT:
+        case IR_VA_START:
+            fprintf(stderr, " ");
+            dump_reg(ir->a);
+            break;
+        case IR_TRUNC:
+            fprintf(stderr, "%d ", ir->size);
+            dump_reg(ir->a);
+            break;
+        case IR_LVAR:
+            fprintf(stderr, " %s", ir->var->name);
+            break;
+        case IR_GVAR:
+            fprintf(stderr, " %s", ir->name);
+            break;
+        case IR_LOAD:
+            fprintf(stderr, "%d [", ir->size);
+            dump_reg(ir->a);
+            fprintf(stderr, "%+ld]", ir->imm);
+            break;
+        case IR_STORE:
+            fprintf(stderr, "%d [", ir->size);
+            dump_reg(ir->a);
+            fprintf(stderr, "%+ld], ", ir->imm);
+            dump_reg(ir->b);
+            break;
+        case IR_PARAM:
+            fprintf(stderr, "%d %ld", ir->size, ir->imm);
+            break;
+        case IR_CALL:
+            fprintf(stderr, " %s(", ir->name);
+            for(int i=0; i<ir->nargs; i++) {
+                if(i) fprintf(stderr, ", ");
+                dump_reg(ir->args[i]);
+            }
+            fprintf(stderr, ")");
+            break;
+        case IR_PHI:
+            for(int i=0; i<ir->nargs; i++) {
+                fprintf(stderr, i ? ", " : " ");
+                if(ir->args[i]) {
+                    dump_reg(ir->args[i]);
+                } else {
+                    fprintf(stderr, "undef");
+                }
+            }
+            break;
+        case IR_JMP:
+            fprintf(stderr, " bb%d", ir->then->label);
+            break;
+        case IR_BR:
+            fprintf(stderr, " %s ", op_name(ir->cmp));
+            dump_reg(ir->a);
+            fprintf(stderr, ", ");
+            dump_b(ir);
+            fprintf(stderr, ", bb%d, bb%d", ir->then->label, ir->els->label);
+            break;
+        case IR_SWITCH:
+            fprintf(stderr, " ");
+            dump_reg(ir->a);
+            fprintf(stderr, "%+ld, [", -ir->imm);
+            for(int i=0; i<ir->ntable; i++) {
+                fprintf(stderr, i ? ", bb%d" : "bb%d", ir->succs[ir->table[i]]->label);
+            }
+            fprintf(stderr, "], bb%d", ir->succs[0]->label);
+            break;
+        case IR_RET:
+            if(ir->a) {
+                fprintf(stderr, " ");
+                dump_reg(ir->a);
+            }
+            break;
+        default:
+            fprintf(stderr, " ");
+            dump_reg(ir->a);
+            fprintf(stderr, ", ");
+            dump_b(ir);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Prints the IR of a function to stderr.
+void dump_ir(Function *fn) {
+    fprintf(stderr, "function %s\n", fn->name);
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        fprintf(stderr, "bb%d:", bb->label);
+        if(bb->npreds) {
+            fprintf(stderr, " ; preds");
+            for(int i=0; i<bb->npreds; i++) {
+                fprintf(stderr, " bb%d", bb->preds[i]->label);
+            }
+        }
+        fprintf(stderr, "\n");
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            dump_inst(ir);
+        }
+    }
+}
+
+//
+// Verifier
+//
+
+static Function *verify_fn;
+
+static void verify_error(BB *bb, char *msg) {
+    error("%s: bb%d: IR verification failed: %s", verify_fn->name, bb->label, msg);
+}
+
+// Checks the structural invariants of the IR of a function. In SSA form
+// it also checks that every register is defined exactly once and that
+// every definition dominates its uses. compute_cfg() and, for SSA,
+// compute_dominators() must have been run.
+void verify_ir(Function *fn, bool is_ssa) {
+    verify_fn = fn;
+    BB **def_bb = calloc(fn->nregs, sizeof(BB *));
+    int *def_pos = calloc(fn->nregs, sizeof(int));
+
+    int pos = 0;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        if(!bb->last || !is_terminator(bb->last)) {
+            verify_error(bb, "block does not end with a jump");
+        }
+
+        bool in_phis = true;
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            ir->pos = pos++;
+            if(ir != bb->last && is_terminator(ir)) {
+                verify_error(bb, "jump in the middle of a block");
+            }
+            if(ir->op == IR_PHI) {
+                if(!in_phis) verify_error(bb, "phi after a non-phi instruction");
+                if(ir->nargs != bb->npreds) verify_error(bb, "phi does not match predecessors");
+            } else {
+                in_phis = false;
+            }
+
+            if(!ir->d) continue;
+            if(ir->d->vn >= fn->nregs) verify_error(bb, "bad register number");
+            if(is_ssa && def_bb[ir->d->vn]) verify_error(bb, "register defined twice");
+            def_bb[ir->d->vn] = bb;
+            def_pos[ir->d->vn] = ir->pos;
+        }
+    }
+
+    if(is_ssa) {
+        for(BB *bb=fn->bbs; bb; bb=bb->next) {
+            for(IR *ir=bb->first; ir; ir=ir->next) {
+                for(int i=0; i<ir_num_uses(ir); i++) {
+                    Reg *r = ir_use(ir, i);
+                    if(!r) continue;
+
+                    BB *d = def_bb[r->vn];
+                    if(!d) verify_error(bb, "use of an undefined register");
+
+                    if(ir->op == IR_PHI) {
+                        if(!dominates(d, bb->preds[i - 2])) {
+                            verify_error(bb, "phi operand not available in predecessor");
+                        }
+                    } else if(d == bb ? def_pos[r->vn] >= ir->pos : !dominates(d, bb)) {
+                        verify_error(bb, "definition does not dominate use");
+                    }
+                }
+            }
+        }
+    }
+
+    free(def_bb);
+    free(def_pos);
+}
@@ -0,0 +1,316 @@
+#include "chibicc.h"
+
+// Loop-invariant code motion on the IR in SSA form.
+//
+// A loop is found from its back edges: the edges into a block, the
+// header, from blocks it dominates. Its body is every block that reaches
+// such a latch without passing the header. Loops are visited inner ones
+// first, so an instruction hoisted out of an inner loop may be hoisted
+// out of the outer one next.
+//
+// An instruction is invariant if it has no side effects and all of its
+// operands are defined outside the loop or by invariant instructions.
+// Invariant instructions move to the end of the preheader, the block
+// that enters the loop. A load is invariant only if the loop calls no
+// function and stores to no memory the load may read, and it may only
+// be moved if it cannot fault: it reads a variable, or it runs on every
+// iteration anyway.
+//
+// Constants and addresses of variables are cheaper to recompute than to
+// keep in a register through the loop, so they are only moved along with
+// an instruction using them.
+
+static Function *fn;
+static int nblocks;
+static BB *header;
+static bool *in_loop; // by block id
+static IR **def; // defining instruction by register number
+static BB **def_bb; // block of def[]
+static bool *invariant; // by register number
+static int nchanges;
+
+// Blocks of the loop that leave it or jump back to the header
+static BB **exits;
+static int nexits;
+
+static bool loop_calls;
+static IR **stores;
+static int nstores;
+
+static void find_loop() {
+    // There is room for a preheader made by find_preheader().
+    in_loop = calloc(nblocks + 1, sizeof(bool));
+    BB **stack = calloc(nblocks, sizeof(BB *));
+    int len = 0;
+
+    in_loop[header->id] = true;
+    for(int i=0; i<header->npreds; i++) {
+        BB *p = header->preds[i];
+        if(dominates(header, p)) stack[len++] = p;
+    }
+    while(len) {
+        BB *bb = stack[--len];
+        if(in_loop[bb->id]) continue;
+        in_loop[bb->id] = true;
+        for(int i=0; i<bb->npreds; i++) {
+            if(!in_loop[bb->preds[i]->id]) stack[len++] = bb->preds[i];
+        }
+    }
+    free(stack);
+}
+
+// Returns the block through which the loop is entered. If the only
+// block jumping into the loop from outside also jumps elsewhere, the
+// edge gets a block of its own. Returns NULL if the loop is entered
+// from several places.
+static BB *find_preheader() {
+    BB *pred = NULL;
+    for(int i=0; i<header->npreds; i++) {
+        BB *p = header->preds[i];
+        if(in_loop[p->id]) continue;
+        if(pred) return NULL;
+        pred = p;
+    }
+    if(!pred) return NULL;
+    if(num_succs(pred) == 1) return pred;
+
+    // The new block takes the place of pred in the layout, so the
+    // order of the header's predecessors and its phis stays the same.
+    BB *bb = new_bb();
+    bb->id = nblocks;
+    IR *jmp = new_ir(IR_JMP);
+    jmp->then = header;
+    insert_ir(bb, NULL, jmp);
+    for(int i=0; i<num_succs(pred); i++) {
+        if(succ(pred, i) == header) set_succ(pred, i, bb);
+    }
+    bb->next = pred->next;
+    pred->next = bb;
+    return bb;
+}
+
+static void scan_loop() {
+    nexits = 0;
+    nstores = 0;
+    loop_calls = false;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        if(!in_loop[bb->id]) continue;
+
+        bool exits_loop = num_succs(bb) == 0;
+        for(int i=0; i<num_succs(bb); i++) {
+            BB *s = succ(bb, i);
+            if(s == header || !in_loop[s->id]) exits_loop = true;
+        }
+        if(exits_loop) exits[nexits++] = bb;
+
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->op == IR_CALL || ir->op == IR_VA_START) loop_calls = true;
+            if(ir->op == IR_STORE) {
+                stores = realloc(stores, sizeof(IR *) * (nstores + 1));
+                stores[nstores++] = ir;
+            }
+        }
+    }
+}
+
+// Returns the instruction computing the address of the variable an
+// address register points into, or NULL if it is not known.
+static IR *base_of(Reg *addr) {
+    IR *ir = def[addr->vn];
+    if(ir && (ir->op == IR_LVAR || ir->op == IR_GVAR)) return ir;
+    return NULL;
+}
+
+static bool is_same_var(IR *x, IR *y) {
+    if(x->op != y->op) return false;
+    if(x->op == IR_LVAR) return x->var == y->var;
+    return !strcmp(x->name, y->name);
+}
+
+// Returns true if a block runs whenever the loop is entered.
+static bool always_runs(BB *bb) {
+    for(int i=0; i<nexits; i++) {
+        if(!dominates(bb, exits[i])) return false;
+    }
+    return true;
+}
+
+static bool can_hoist_load(BB *bb, IR *ir) {
+    if(loop_calls) return false;
+    IR *base = base_of(ir->a);
+    for(int i=0; i<nstores; i++) {
+        IR *other = base_of(stores[i]->a);
+        if(!base || !other || is_same_var(base, other)) return false;
+    }
+    return base || always_runs(bb);
+}
+
+static bool is_pure(IROp op) {
+    switch(op) {
+        case IR_IMM:
+        case IR_MOV:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_SHL:
+        case IR_SHR:
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+        case IR_BITNOT:
+        case IR_TRUNC:
+        case IR_LVAR:
+        case IR_GVAR:
+            return true;
+    }
+    return false;
+}
+
+static bool is_cheap(IROp op) {
+    return op == IR_IMM || op == IR_LVAR || op == IR_GVAR;
+}
+
+static bool is_invariant_operand(Reg *r) {
+    if(!r) return true;
+    return invariant[r->vn] || !def_bb[r->vn] || !in_loop[def_bb[r->vn]->id];
+}
+
+static void hoist(BB *preheader) {
+    // Instructions in the order they became invariant, which puts every
+    // one after those computing its operands.
+    IR **order = NULL;
+    BB **order_bb = NULL;
+    int len = 0;
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(BB *bb=fn->bbs; bb; bb=bb->next) {
+            if(!in_loop[bb->id]) continue;
+            for(IR *ir=bb->first; ir; ir=ir->next) {
+                if(!ir->d || invariant[ir->d->vn]) continue;
+                if(!is_pure(ir->op) && !(ir->op == IR_LOAD && can_hoist_load(bb, ir))) continue;
+
+                bool ok = true;
+                for(int i=0; i<ir_num_uses(ir); i++) {
+                    if(!is_invariant_operand(ir_use(ir, i))) ok = false;
+                }
+                if(!ok) continue;
+
+                invariant[ir->d->vn] = true;
+                order = realloc(order, sizeof(IR *) * (len + 1));
+                order_bb = realloc(order_bb, sizeof(BB *) * (len + 1));
+                order[len] = ir;
+                order_bb[len] = bb;
+                len++;
+                changed = true;
+            }
+        }
+    }
+
+    // Cheap instructions move only if a moving instruction uses them.
+    bool *moves = calloc(fn->nregs, sizeof(bool));
+    for(int i=len-1; i>=0; i--) {
+        IR *ir = order[i];
+        if(!is_cheap(ir->op)) moves[ir->d->vn] = true;
+        if(!moves[ir->d->vn]) continue;
+        for(int j=0; j<ir_num_uses(ir); j++) {
+            Reg *r = ir_use(ir, j);
+            if(r) moves[r->vn] = true;
+        }
+    }
+
+    for(int i=0; i<len; i++) {
+        IR *ir = order[i];
+        if(!moves[ir->d->vn]) continue;
+        remove_ir(order_bb[i], ir);
+        insert_ir(preheader, preheader->last, ir);
+        nchanges++;
+    }
+    free(moves);
+    free(order);
+    free(order_bb);
+}
+
+static void optimize_loop() {
+    find_loop();
+    BB *preheader = find_preheader();
+    if(!preheader) {
+        free(in_loop);
+        return;
+    }
+
+    def = calloc(fn->nregs, sizeof(IR *));
+    def_bb = calloc(fn->nregs, sizeof(BB *));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(!ir->d) continue;
+            def[ir->d->vn] = ir;
+            def_bb[ir->d->vn] = bb;
+        }
+    }
+
+    exits = calloc(nblocks, sizeof(BB *));
+    stores = NULL;
+    scan_loop();
+
+    invariant = calloc(fn->nregs, sizeof(bool));
+    hoist(preheader);
+
+    free(invariant);
+    free(stores);
+    free(exits);
+    free(def);
+    free(def_bb);
+    free(in_loop);
+}
+
+// Returns the number of instructions hoisted.
+int licm(Function *f) {
+    fn = f;
+    nchanges = 0;
+    compute_dominators(fn);
+
+    // Loop headers, the blocks with a back edge into them
+    BB **headers = NULL;
+    int nheaders = 0;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(int i=0; i<bb->npreds; i++) {
+            if(dominates(bb, bb->preds[i])) {
+                headers = realloc(headers, sizeof(BB *) * (nheaders + 1));
+                headers[nheaders++] = bb;
+                break;
+            }
+        }
+    }
+
+    // An inner loop's header is deeper in the dominator tree than that of
+    // the loop around it, so it comes later in preorder.
+    for(int i=1; i<nheaders; i++) {
+        for(int j=i; j>0 && headers[j - 1]->dom_pre < headers[j]->dom_pre; j--) {
+            BB *tmp = headers[j];
+            headers[j] = headers[j - 1];
+            headers[j - 1] = tmp;
+        }
+    }
+
+    for(int i=0; i<nheaders; i++) {
+        // A new preheader changes the control-flow graph.
+        compute_dominators(fn);
+        nblocks = 0;
+        for(BB *bb=fn->bbs; bb; bb=bb->next) {
+            nblocks++;
+        }
+        header = headers[i];
+        optimize_loop();
+    }
+    free(headers);
+
+    compute_dominators(fn);
+    verify_ir(fn, true);
+    return nchanges;
+}
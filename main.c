@@ -26,32 +26,39 @@ static char *read_file(char *path) {
 
 
 int main(int argc, char**argv) {
-	if(argc != 2) {
+    // Arguments other than the input file are optimization options.
+    for(int i=1; i<argc; i++) {
+        if(parse_pass_option(argv[i])) {
+            continue;
+        }
+        if(!filename) {
+            filename = argv[i];
+        } else {
+            error("%s: invalid number of arguments", argv[0]);
+        }
+    }
+
+	if(!filename) {
         error("%s: invalid number of arguments", argv[0]);
 		return 1;
 	}
 
 	// tokenizer
-	filename = argv[1];
-	user_input = read_file(argv[1]);
+	user_input = read_file(filename);
 	token = tokenize();
     Program *prog = program();
 
-    // prog->stack_size = offset;
     for(Function *fn=prog->fns; fn; fn=fn->next) {
-        // Assign offsets to function variables.
-        int offset = fn->has_varargs ? 56 : 0;
-        for(VarList *vl=fn->locals; vl; vl=vl->next) {
-            Var *var = vl->var;
-            offset = align_to(offset, var->ty->align);
-            offset += var->ty->size;
-            var->offset = offset;
-        }
-        fn->stack_size = align_to(offset, 8);
+        assign_offsets(fn);
     }
 
-    // Traverse the AST to emit assembly.
-    codegen(prog);
+    // Optimize, then emit assembly from either the IR or the AST.
+    if(run_passes(prog)) {
+        gen_x86(prog);
+    } else {
+        codegen(prog);
+    }
+    print_pass_stats();
 
 	return 0;
 }
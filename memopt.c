@@ -0,0 +1,319 @@
+#include "chibicc.h"
+
+// Redundant load and dead store elimination on the IR in SSA form.
+//
+// Locals that are not promoted to registers, such as arrays and structs,
+// are accessed with loads and stores. Both passes look at one block at a
+// time and identify each access by the variable it falls in and its
+// offset from the start of it, so `a[1]` is the same memory however its
+// address was computed.
+//
+// forward_stores() replaces a load by the value last stored to or loaded
+// from the same place, truncated to the size of the load if needed:
+//
+//   store4 [v1+4], v2; v3 = load4 [v1+4]  =>  v3 = trunc4 v2
+//
+// eliminate_dead_stores() removes a store that a later store in the
+// same block overwrites before anything may read it, such as the zeros
+// an initializer writes to excess elements, and stores to locals that
+// are not read again before the function returns.
+//
+// As in gen_ir.c, a local whose address is used for anything but an
+// access at a constant offset within it may reach its neighbours in the
+// frame, so in a function doing that, calls and accesses through other
+// pointers may read and write all of its locals.
+
+// Where an access goes
+typedef struct Addr Addr;
+struct Addr {
+    Var *var; // a local
+    char *name; // or a global
+    Reg *base; // or an unknown pointer
+    long offset;
+    int size;
+};
+
+typedef struct Access Access;
+struct Access {
+    Addr addr;
+    IR *ir;
+    Reg *val; // the value in memory after the access
+};
+
+static Function *fn;
+static IR **def; // by register number
+static Reg **repl; // by register number, the register replacing it
+static bool locals_escape;
+static int nchanges;
+
+// Accesses of the current block that are still of interest
+static Access **accesses;
+static int naccesses;
+
+static Access *new_access(IR *ir, Reg *val) {
+    Access *a = calloc(1, sizeof(Access));
+    a->ir = ir;
+    a->val = val;
+
+    // Follow additions of constants back to the variable.
+    Reg *base = ir->a;
+    long offset = ir->imm;
+    IR *d = def[base->vn];
+    while(d && (d->op == IR_ADD || d->op == IR_SUB) && !d->b) {
+        offset += d->op == IR_ADD ? d->imm : -d->imm;
+        base = d->a;
+        d = def[base->vn];
+    }
+
+    // An access outside of its local may be to any local.
+    a->addr.var = d && d->op == IR_LVAR ? d->var : NULL;
+    if(a->addr.var && (offset < 0 || offset + ir->size > a->addr.var->ty->size)) {
+        a->addr.var = NULL;
+        d = NULL;
+    }
+    a->addr.name = d && d->op == IR_GVAR ? d->name : NULL;
+    a->addr.base = !a->addr.var && !a->addr.name ? base : NULL;
+    a->addr.offset = offset;
+    a->addr.size = ir->size;
+    return a;
+}
+
+static void add_access(Access *a) {
+    accesses = realloc(accesses, sizeof(Access *) * (naccesses + 1));
+    accesses[naccesses++] = a;
+}
+
+// Removes an access from the list, moving the last one into its place.
+static void remove_access(int i) {
+    free(accesses[i]);
+    accesses[i] = accesses[--naccesses];
+}
+
+static void clear_accesses() {
+    while(naccesses) {
+        remove_access(naccesses - 1);
+    }
+}
+
+static bool same_object(Addr *x, Addr *y) {
+    if(x->var || y->var) return x->var == y->var;
+    if(x->name || y->name) return x->name && y->name && !strcmp(x->name, y->name);
+    return x->base == y->base;
+}
+
+// Returns true if calls and accesses through unknown pointers may
+// touch memory.
+static bool is_visible(Addr *addr) {
+    return !addr->var || locals_escape;
+}
+
+static bool may_overlap(Addr *x, Addr *y) {
+    if(same_object(x, y)) {
+        return x->offset < y->offset + y->size && y->offset < x->offset + x->size;
+    }
+    if(x->base) return is_visible(y);
+    if(y->base) return is_visible(x);
+    return false;
+}
+
+// Forgets the accesses that an access may overlap, or all visible ones
+// if addr is NULL.
+static void kill_accesses(Addr *addr) {
+    for(int i=naccesses-1; i>=0; i--) {
+        if(addr ? may_overlap(addr, &accesses[i]->addr) : is_visible(&accesses[i]->addr)) {
+            remove_access(i);
+        }
+    }
+}
+
+// Returns true if the address of a local is used other than to access
+// it at a constant offset within its bounds.
+static bool find_escapes() {
+    // A register is local if it holds an address into a local, var[vn]
+    // being the local and offset[vn] the offset into it.
+    Var **var = calloc(fn->nregs, sizeof(Var *));
+    long *offset = calloc(fn->nregs, sizeof(long));
+    bool escapes = false;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            for(int i=0; i<ir_num_uses(ir); i++) {
+                Reg *r = ir_use(ir, i);
+                if(!r || !var[r->vn]) continue;
+                if(i == 0 && (ir->op == IR_LOAD || ir->op == IR_STORE)) {
+                    long start = offset[r->vn] + ir->imm;
+                    if(0 <= start && start + ir->size <= var[r->vn]->ty->size) continue;
+                } else if(i == 0 && (ir->op == IR_ADD || ir->op == IR_SUB) && !ir->b) {
+                    var[ir->d->vn] = var[r->vn];
+                    offset[ir->d->vn] = offset[r->vn] + (ir->op == IR_ADD ? ir->imm : -ir->imm);
+                    continue;
+                }
+                escapes = true;
+            }
+            if(ir->op == IR_LVAR) var[ir->d->vn] = ir->var;
+        }
+    }
+    free(var);
+    free(offset);
+    return escapes;
+}
+
+static void init(Function *f) {
+    fn = f;
+    nchanges = 0;
+    def = calloc(fn->nregs, sizeof(IR *));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->d) def[ir->d->vn] = ir;
+        }
+    }
+    locals_escape = find_escapes();
+}
+
+// Returns true if a register already holds a value as it would be
+// loaded with the given size.
+static bool fits(Reg *r, int size) {
+    if(size == 8) return true;
+    IR *d = def[r->vn];
+    if(!d) return false;
+    switch(d->op) {
+        case IR_LOAD:
+        case IR_TRUNC:
+        case IR_PARAM:
+            return d->size <= size;
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+            return true;
+        case IR_IMM: {
+            long max = (long)1 << (size * 8 - 1);
+            return -max <= d->imm && d->imm < max;
+        }
+    }
+    return false;
+}
+
+static void replace_uses(IR *ir) {
+    for(int i=0; i<ir_num_uses(ir); i++) {
+        Reg *r = ir_use(ir, i);
+        if(r && repl[r->vn]) set_ir_use(ir, i, repl[r->vn]);
+    }
+}
+
+static void forward_block(BB *bb) {
+    IR *ir = bb->first;
+    while(ir) {
+        IR *next = ir->next;
+        replace_uses(ir);
+
+        if(ir->op == IR_LOAD) {
+            Access *load = new_access(ir, ir->d);
+            Access *a = NULL;
+            for(int i=0; i<naccesses; i++) {
+                Addr *x = &accesses[i]->addr;
+                if(same_object(x, &load->addr) && x->offset == load->addr.offset && x->size == load->addr.size) {
+                    a = accesses[i];
+                    break;
+                }
+            }
+
+            if(!a) {
+                add_access(load);
+            } else if(fits(a->val, ir->size)) {
+                free(load);
+                repl[ir->d->vn] = a->val;
+                remove_ir(bb, ir);
+                nchanges++;
+            } else {
+                // The load becomes the truncation, which later loads may
+                // reuse in turn.
+                free(load);
+                ir->op = IR_TRUNC;
+                ir->a = a->val;
+                ir->imm = 0;
+                a->val = ir->d;
+                nchanges++;
+            }
+        } else if(ir->op == IR_STORE) {
+            Access *store = new_access(ir, ir->b);
+            kill_accesses(&store->addr);
+            add_access(store);
+        } else if(ir->op == IR_CALL || ir->op == IR_VA_START) {
+            kill_accesses(NULL);
+        }
+        ir = next;
+    }
+    clear_accesses();
+}
+
+// Replaces loads of values that are already in registers. Returns the
+// number of loads replaced.
+int forward_stores(Function *f) {
+    init(f);
+    repl = calloc(fn->nregs, sizeof(Reg *));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        forward_block(bb);
+    }
+
+    // Loads may be used in blocks visited before them.
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            replace_uses(ir);
+        }
+    }
+    free(repl);
+    free(def);
+    verify_ir(fn, true);
+    return nchanges;
+}
+
+static void remove_store(BB *bb, int i) {
+    remove_ir(bb, accesses[i]->ir);
+    remove_access(i);
+    nchanges++;
+}
+
+// The accesses of a block here are the stores nothing has read yet.
+static void eliminate_block(BB *bb) {
+    IR *ir = bb->first;
+    while(ir) {
+        IR *next = ir->next;
+        if(ir->op == IR_LOAD) {
+            Access *load = new_access(ir, NULL);
+            kill_accesses(&load->addr);
+            free(load);
+        } else if(ir->op == IR_STORE) {
+            Access *store = new_access(ir, NULL);
+            Addr *addr = &store->addr;
+            for(int i=naccesses-1; i>=0; i--) {
+                Addr *prev = &accesses[i]->addr;
+                if(same_object(prev, addr) && addr->offset <= prev->offset &&
+                   prev->offset + prev->size <= addr->offset + addr->size) {
+                    remove_store(bb, i);
+                }
+            }
+            add_access(store);
+        } else if(ir->op == IR_CALL || ir->op == IR_VA_START) {
+            kill_accesses(NULL);
+        } else if(ir->op == IR_RET) {
+            // The frame goes away.
+            for(int i=naccesses-1; i>=0; i--) {
+                if(accesses[i]->addr.var) remove_store(bb, i);
+            }
+        }
+        ir = next;
+    }
+    clear_accesses();
+}
+
+// Removes stores whose values are never read. Returns the number of
+// stores removed.
+int eliminate_dead_stores(Function *f) {
+    init(f);
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        eliminate_block(bb);
+    }
+    free(def);
+    verify_ir(fn, true);
+    return nchanges;
+}
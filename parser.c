@@ -140,35 +140,136 @@ static bool at_eof() {
     return token->kind == TK_EOF;
 }
 
+// Returns the number of bytes of struct Node that a node of a given
+// kind uses. Expression nodes, the most common ones, take only a third
+// of the full struct.
+static int node_size(NodeKind kind) {
+    static Node layout;
+    char *end;
+
+    switch(kind) {
+        case ND_VAR:
+            end = (char *)&layout.member;
+            break;
+        case ND_MEMBER:
+            end = (char *)&layout.funcname;
+            break;
+        case ND_FUNCALL:
+            end = (char *)&layout.label_name;
+            break;
+        case ND_GOTO:
+        case ND_LABEL:
+            end = (char *)&layout.body;
+            break;
+        case ND_BLOCK:
+        case ND_STMT_EXPR:
+            end = (char *)&layout.cond;
+            break;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+        case ND_DO:
+        case ND_TERNARY:
+            end = (char *)&layout.case_next;
+            break;
+        case ND_SWITCH:
+        case ND_CASE:
+            return sizeof(Node);
+        default:
+            end = (char *)&layout.var;
+    }
+    return end - (char *)&layout;
+}
+
 // generate new template node
-static Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+Node *new_node(NodeKind kind, Token *tok) {
+    Node *node = calloc(1, node_size(kind));
     node->kind = kind;
     node->tok = tok;
     return node;
 }
 
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
+static Node *clone_list(Node *node);
+
+// Returns a deep copy of a node. The copy shares variables, types and
+// members with the original, and its `next` is NULL.
+Node *clone_node(Node *node) {
+    if(!node) return NULL;
+    int size = node_size(node->kind);
+    Node *copy = calloc(1, size);
+    memcpy(copy, node, size);
+    copy->next = NULL;
+
+    switch(node->kind) {
+        case ND_VAR:
+            copy->init = clone_node(node->init);
+            return copy;
+        case ND_MEMBER:
+        case ND_LABEL:
+            copy->lhs = clone_node(node->lhs);
+            return copy;
+        case ND_FUNCALL:
+            copy->args = clone_list(node->args);
+            return copy;
+        case ND_GOTO:
+            return copy;
+        case ND_BLOCK:
+        case ND_STMT_EXPR:
+            copy->body = clone_list(node->body);
+            return copy;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+        case ND_DO:
+        case ND_TERNARY:
+            copy->cond = clone_node(node->cond);
+            copy->then = clone_node(node->then);
+            copy->els = clone_node(node->els);
+            copy->init = clone_node(node->init);
+            copy->inc = clone_node(node->inc);
+            return copy;
+        case ND_SWITCH:
+        case ND_CASE:
+            // The cases are linked to their switch, which a copy would
+            // have to follow.
+            error_tok(node->tok, "cannot copy a switch statement");
+    }
+    copy->lhs = clone_node(node->lhs);
+    copy->rhs = clone_node(node->rhs);
+    return copy;
+}
+
+static Node *clone_list(Node *node) {
+    Node head = {};
+    Node *cur = &head;
+    for(Node *n=node; n; n=n->next) {
+        cur->next = clone_node(n);
+        cur = cur->next;
+    }
+    return head.next;
+}
+
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
     Node *node = new_node(kind, tok);
 	node->lhs = lhs;
 	node->rhs = rhs;
 	return node;
 }
 
-static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
+Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
     Node *node = new_node(kind, tok);
     node->lhs = expr;
     return node;
 }
 
-static Node *new_num(int val, Token *tok) {
+Node *new_num(long val, Token *tok) {
     Node *node = new_node(ND_NUM, tok);
 	node->val = val;
-    node->ty = int_type;
+    node->ty = val == (int)val ? int_type : long_type;
 	return node;
 }
 
-static Node *new_var_node(Var *var, Token * tok) {
+Node *new_var_node(Var *var, Token *tok) {
     Node *node = new_node(ND_VAR, tok);
     node->var = var;
     return node;
@@ -204,6 +305,17 @@ static Var *new_lvar(char *name, Type *ty) {
     return var;
 }
 
+// Adds a local variable to a function after parsing, for the passes
+// that introduce temporaries.
+Var *new_local(Function *fn, char *name, Type *ty) {
+    Var *var = new_var(name, ty, true);
+    VarList *vl = calloc(1, sizeof(VarList));
+    vl->var = var;
+    vl->next = fn->locals;
+    fn->locals = vl;
+    return var;
+}
+
 static Var *new_gvar(char *name, Type *ty, bool is_static, bool emit) {
     Var *var = new_var(name, ty, false);
     var->is_static = is_static;
@@ -261,17 +373,9 @@ static long eval2(Node *node, Var **var);
 static long const_expr();
 static Node *assign();
 static Node *conditional();
-static Node *logor();
-static Node *logand();
-static Node *bitand();
-static Node *bitor();
-static Node *bitxor();
-static Node *equality();
-static Node *relational();
-static Node *shift();
+static Node *binary(int min_prec);
 static Node *new_add(Node *lhs, Node *rhs, Token *tok);
-static Node *add();
-static Node *mul();
+static Node *new_sub(Node *lhs, Node *rhs, Token *tok);
 static Node *cast();
 static Node *primary();
 static Node *unary();
@@ -320,6 +424,18 @@ Program *program() {
     return prog;
 }
 
+// Assigns offsets from RBP to the local variables of a function.
+void assign_offsets(Function *fn) {
+    int offset = fn->has_varargs ? 56 : 0;
+    for(VarList *vl=fn->locals; vl; vl=vl->next) {
+        Var *var = vl->var;
+        offset = align_to(offset, var->ty->align);
+        offset += var->ty->size;
+        var->offset = offset;
+    }
+    fn->stack_size = align_to(offset, 8);
+}
+
 // basetype = builtin-type | struct-decl | typedef-name | enum-specifier
 // builtin-type = "void" | "bool" | "char" | "short" | "int" 
 //                       | "long" | "long long"
@@ -449,18 +565,43 @@ static Type *basetype(StorageClass *sclass) {
     return ty;
 }
 
+// Skips the tokens up to and including the ")" matching a "(" that was
+// just consumed.
+static void skip_parens() {
+    int depth = 1;
+    while(depth > 0) {
+        if(at_eof()) error_tok(token, "expected ')'");
+        if(consume("(")) {
+            depth++;
+        } else if(consume(")")) {
+            depth--;
+        } else {
+            token = token->next;
+        }
+    }
+}
+
 // declarator = "*"* ("(" declarator ")" | ident) type-suffix
 static Type *declarator(Type *ty, char **name) {
     while(consume("*")) {
         ty = pointer_to(ty);
     }
 
+    // The inner declarator applies to the type after the parentheses,
+    // e.g. `int (*x)[3]` is a pointer to int[3]. Skip its tokens to read
+    // the suffix, then parse it once with the complete type. Parsing it
+    // for the skip too would double the work at every nesting level.
     if(consume("(")) {
-        Type *placeholder = calloc(1, sizeof(Type));
-        Type *new_ty = declarator(placeholder, name);
+        Token *start = token;
+        skip_parens();
+        ty = type_suffix(ty);
+
+        Token *end = token;
+        token = start;
+        ty = declarator(ty, name);
         expect(")");
-        memcpy(placeholder, type_suffix(ty), sizeof(Type));
-        return new_ty;
+        token = end;
+        return ty;
     }
 
     *name = expect_ident();
@@ -474,11 +615,16 @@ static Type *abstract_declarator(Type *ty) {
     }
 
     if(consume("(")) {
-        Type *placeholder = calloc(1, sizeof(Type));
-        Type *new_ty = abstract_declarator(placeholder);
+        Token *start = token;
+        skip_parens();
+        ty = type_suffix(ty);
+
+        Token *end = token;
+        token = start;
+        ty = abstract_declarator(ty);
         expect(")");
-        memcpy(placeholder, type_suffix(ty), sizeof(Type));
-        return new_ty;
+        token = end;
+        return ty;
     }
     return type_suffix(ty);
 }
@@ -503,9 +649,10 @@ static Type *type_suffix(Type *ty) {
         error_tok(tok, "incomplete element type");
     }
 
-    ty = array_of(ty, sz);
-    ty->is_incomplete = is_incomplete;
-    return ty;
+    if(is_incomplete) {
+        return incomplete_array_of(ty);
+    }
+    return array_of(ty, sz);
 }
 
 // type-name = basetype abstract-declarator type-suffix
@@ -745,6 +892,7 @@ static void read_func_params(Function *fn) {
 static Function *function() {
     locals = NULL;
 
+    Token *tok = token;
     StorageClass sclass;
     Type *ty = basetype(&sclass);
     char *name = NULL;
@@ -756,6 +904,7 @@ static Function *function() {
     // Construct a function object
     Function *fn = calloc(1, sizeof(Function));
     fn->name = name;
+    fn->tok = tok;
     fn->is_static = (sclass == STATIC);
     expect("(");
 
@@ -782,43 +931,31 @@ static Function *function() {
     return fn;
 }
 
-// global-var = basetype declarator type-suffix";"
-static Initializer *new_init_val(Initializer *cur, int sz, int val) {
-    Initializer *init = calloc(1, sizeof(Initializer));
-    init->sz = sz;
-    init->val = val;
-    cur->next = init;
-    return init;
-}
+// The contents of the global variable being initialized. The buffer
+// grows as the initializer is read because the size of an incomplete
+// array is not known in advance.
+static char *gvar_buf;
+static int gvar_cap;
+static Relocation *gvar_rel;
 
-static Initializer *new_init_label(Initializer *cur, char *label, long addend) {
-    Initializer *init = calloc(1, sizeof(Initializer));
-    init->label = label;
-    init->addend = addend;
-    cur->next = init;
-    return init;
-}
+static void reserve_gvar_buf(int size) {
+    if(size <= gvar_cap) return;
 
-static Initializer *new_init_zero(Initializer *cur, int nbytes) {
-    for(int i=0; i<nbytes; i++) {
-        cur = new_init_val(cur, 1, 0);
+    int cap = gvar_cap ? gvar_cap : 64;
+    while(cap < size) {
+        cap *= 2;
     }
-    return cur;
+    gvar_buf = realloc(gvar_buf, cap);
+    memset(gvar_buf + gvar_cap, 0, cap - gvar_cap);
+    gvar_cap = cap;
 }
 
-static Initializer *gvar_init_string(char *p, int len) {
-    Initializer head = {};
-    Initializer *cur = &head;
-    for(int i=0; i<len; i++) {
-        cur = new_init_val(cur, 1, p[i]);
+// Writes a little-endian integer of sz bytes.
+static void write_gvar_buf(int offset, long val, int sz) {
+    reserve_gvar_buf(offset + sz);
+    for(int i=0; i<sz; i++) {
+        gvar_buf[offset + i] = val >> (i * 8);
     }
-    return head.next;
-}
-
-static Initializer *emit_struct_padding(Initializer *cur, Type *parent, Member *mem) {
-    int start = mem->offset + mem->ty->size;
-    int end = mem->next ? mem->next->offset : parent->size;
-    return new_init_zero(cur, end - start);
 }
 
 static void skip_excess_elements2() {
@@ -865,7 +1002,7 @@ static void skip_excess_elements() {
 // (2) may not be obvious why that can result in static data, but
 // the linker supports an expression consisting of a label address
 // plus/minus an addend, so (2) is allowed.
-static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
+static void gvar_initializer2(Type *ty, int offset) {
     Token *tok = token;
 
     if(ty->kind == TY_ARRAY && ty->base->kind == TY_CHAR &&
@@ -881,10 +1018,9 @@ static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
         int len = (ty->array_len < tok->cont_len)
                   ? ty->array_len : tok->cont_len;
 
-        for(int i=0; i<len; i++) {
-            cur = new_init_val(cur, 1, tok->contents[i]);
-        }
-        return new_init_zero(cur, ty->array_len - len);
+        reserve_gvar_buf(offset + len);
+        memcpy(gvar_buf + offset, tok->contents, len);
+        return;
     }
     
     if(ty->kind == TY_ARRAY) {
@@ -894,7 +1030,7 @@ static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
 
         if(!peek("}")) {
             do { 
-                cur = gvar_initializer2(cur, ty->base);
+                gvar_initializer2(ty->base, offset + ty->base->size * i);
                 i++;
             } while(i < limit && !peek_end() && consume(","));
         }
@@ -903,15 +1039,13 @@ static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
             skip_excess_elements();
         }
 
-        // Set excess array elements to zero.
-        cur = new_init_zero(cur, ty->base->size * (ty->array_len - i));
-
+        // Excess array elements are left zero.
         if(ty->is_incomplete) {
             ty->size = ty->base->size * i;
             ty->array_len = i;
             ty->is_incomplete = false;
         }
-        return cur;
+        return;
     }
 
     if(ty->kind == TY_STRUCT) {
@@ -920,8 +1054,7 @@ static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
 
         if(!peek("}")) {
             do {
-                cur = gvar_initializer2(cur, mem->ty);
-                cur = emit_struct_padding(cur, ty, mem);
+                gvar_initializer2(mem->ty, offset + mem->offset);
                 mem = mem->next;
             } while(mem && !peek_end() && consume(","));
         }
@@ -929,11 +1062,8 @@ static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
             skip_excess_elements();
         }
 
-        // Set excess struct elements to zero.
-        if(mem) {
-            cur = new_init_zero(cur, ty->size - mem->offset);
-        }
-        return cur;
+        // Padding and excess struct members are left zero.
+        return;
     }
 
     bool open = consume("{");
@@ -948,15 +1078,41 @@ static Initializer *gvar_initializer2(Initializer *cur, Type *ty) {
     if(var) {
         int scale = (var->ty->kind == TY_ARRAY)
                     ? var->ty->base->size : var->ty->size;
-        return new_init_label(cur, var->name, addend * scale);
+        Relocation *rel = calloc(1, sizeof(Relocation));
+        rel->offset = offset;
+        rel->label = var->name;
+        rel->addend = addend * scale;
+        gvar_rel->next = rel;
+        gvar_rel = rel;
+        return;
     }
-    return new_init_val(cur, ty->size, addend);
+    write_gvar_buf(offset, addend, ty->size);
 }
 
-static Initializer *gvar_initializer(Type *ty) {
-    Initializer head = {};
-    gvar_initializer2(&head, ty);
-    return head.next;
+// Reads an initializer of a global variable into var->init_data and
+// var->rel. Bytes that are not explicitly initialized are zero.
+//
+// An initializer may contain a compound literal, which is another
+// global variable, so the state of the outer variable is saved.
+static void gvar_initializer(Var *var) {
+    char *buf = gvar_buf;
+    int cap = gvar_cap;
+    Relocation *cur = gvar_rel;
+
+    Relocation head = {};
+    gvar_buf = NULL;
+    gvar_cap = 0;
+    gvar_rel = &head;
+
+    gvar_initializer2(var->ty, 0);
+    reserve_gvar_buf(var->ty->size);
+
+    var->init_data = gvar_buf;
+    var->rel = head.next;
+
+    gvar_buf = buf;
+    gvar_cap = cap;
+    gvar_rel = cur;
 }
 
 // global-var = basetype declarator type-suffix ("=" gvar-initializer)? ";"
@@ -987,7 +1143,7 @@ static void global_var() {
     }
 
     if(consume("=")) {
-        var->initializer = gvar_initializer(ty);
+        gvar_initializer(var);
         expect(";");
         return;
     }
@@ -1208,7 +1364,7 @@ static Node *declaration() {
         push_scope(name)->var = var;
 
         if(consume("=")) {
-            var->initializer = gvar_initializer(ty);
+            gvar_initializer(var);
         } else if(ty->is_incomplete) {
             error_tok(tok, "incomplete type");
         }
@@ -1265,6 +1421,7 @@ static Node *stmt() {
 //      | "while" "(" expr ")" stmt
 //      | "for" "(" (expr? ";" | declaration) expr? ";" expr? ")" stmt
 //      | "do" stmt "while" "(" expr ")" ";"
+//      | "#pragma GCC unroll" num stmt
 //      | "{"  stmt "}"
 //      | "break" ";"
 //      | "continue" ";"
@@ -1333,6 +1490,18 @@ static Node *stmt2() {
         return node;
     }
 
+    if(token->kind == TK_PRAGMA) {
+        // A factor of 0 or 1 means the loop is not to be unrolled.
+        tok = token;
+        token = token->next;
+        Node *node = stmt2();
+        if(node->kind != ND_WHILE && node->kind != ND_FOR && node->kind != ND_DO) {
+            error_tok(tok, "#pragma GCC unroll must be followed by a loop");
+        }
+        node->unroll = tok->val > 1 ? tok->val : 1;
+        return node;
+    }
+
     if(tok = consume("while")) {
         Node *node = new_node(ND_WHILE, tok);
         expect("(");
@@ -1452,41 +1621,80 @@ static long eval(Node *node) {
     return eval2(node, NULL);
 }
 
-// Evaluate a given node as a constant expression.
-static long eval2(Node *node, Var **var) {
-    switch(node->kind) {
+// Returns true if a node is an integer binary operator that can be
+// folded by eval_binary().
+static bool is_const_binary(NodeKind kind) {
+    switch(kind) {
         case ND_ADD:
-            return eval(node->lhs) + eval(node->rhs);
-        case ND_PTR_ADD:
-            return eval2(node->lhs, var) + eval(node->rhs);
         case ND_SUB:
-            return eval(node->lhs) - eval(node->rhs);
-        case ND_PTR_SUB:
-            return eval2(node->lhs, var) - eval(node->rhs);
-        case ND_PTR_DIFF:
-            return eval2(node->lhs, var) - eval2(node->rhs, var);
         case ND_MUL:
-            return eval(node->lhs) * eval(node->rhs);
         case ND_DIV:
-            return eval(node->lhs) / eval(node->rhs);
+        case ND_MOD:
         case ND_BITAND:
-            return eval(node->lhs) & eval(node->rhs);
         case ND_BITOR:
-            return eval(node->lhs) | eval(node->rhs);
         case ND_BITXOR:
-            return eval(node->lhs) ^ eval(node->rhs);
         case ND_SHL:
-            return eval(node->lhs) << eval(node->rhs);
         case ND_SHR:
-            return eval(node->lhs) >> eval(node->rhs);
         case ND_EQ:
-            return eval(node->lhs) == eval(node->rhs);
         case ND_NE:
-            return eval(node->lhs) != eval(node->rhs);
         case ND_LT:
-            return eval(node->lhs) < eval(node->rhs);
         case ND_LE:
-            return eval(node->lhs) <= eval(node->rhs);
+        case ND_LOGAND:
+        case ND_LOGOR:
+            return true;
+    }
+    return false;
+}
+
+static NodeStack eval_stack;
+
+// Evaluate a left-associative chain of integer operators such as
+// `1 + 2 + 3 + ...` without recursing into the left operands.
+static long eval_binary(Node *node) {
+    int base = eval_stack.len;
+    Node *n = node;
+    for(; is_const_binary(n->kind); n=n->lhs) {
+        push_node(&eval_stack, n);
+    }
+
+    long val = eval(n);
+    while(eval_stack.len > base) {
+        n = eval_stack.data[--eval_stack.len];
+        switch(n->kind) {
+            case ND_ADD: val = val + eval(n->rhs); break;
+            case ND_SUB: val = val - eval(n->rhs); break;
+            case ND_MUL: val = val * eval(n->rhs); break;
+            case ND_DIV: val = val / eval(n->rhs); break;
+            case ND_MOD: val = val % eval(n->rhs); break;
+            case ND_BITAND: val = val & eval(n->rhs); break;
+            case ND_BITOR: val = val | eval(n->rhs); break;
+            case ND_BITXOR: val = val ^ eval(n->rhs); break;
+            case ND_SHL: val = val << eval(n->rhs); break;
+            case ND_SHR: val = val >> eval(n->rhs); break;
+            case ND_EQ: val = val == eval(n->rhs); break;
+            case ND_NE: val = val != eval(n->rhs); break;
+            case ND_LT: val = val < eval(n->rhs); break;
+            case ND_LE: val = val <= eval(n->rhs); break;
+            case ND_LOGAND: val = val && eval(n->rhs); break;
+            case ND_LOGOR: val = val || eval(n->rhs); break;
+        }
+    }
+    return val;
+}
+
+// Evaluate a given node as a constant expression.
+static long eval2(Node *node, Var **var) {
+    if(is_const_binary(node->kind)) {
+        return eval_binary(node);
+    }
+
+    switch(node->kind) {
+        case ND_PTR_ADD:
+            return eval2(node->lhs, var) + eval(node->rhs);
+        case ND_PTR_SUB:
+            return eval2(node->lhs, var) - eval(node->rhs);
+        case ND_PTR_DIFF:
+            return eval2(node->lhs, var) - eval2(node->rhs, var);
         case ND_TERNARY:
             return eval(node->cond) ? eval(node->then) : eval(node->els);
         case ND_COMMA:
@@ -1495,10 +1703,6 @@ static long eval2(Node *node, Var **var) {
             return !eval(node->lhs);
         case ND_BITNOT:
             return ~eval(node->lhs);
-        case ND_LOGAND:
-            return eval(node->lhs) && eval(node->rhs);
-        case ND_LOGOR:
-            return eval(node->lhs) || eval(node->rhs);
         case ND_NUM:
             return node->val;
         case ND_ADDR:
@@ -1523,60 +1727,110 @@ static long const_expr() {
     return eval(conditional());
 }
 
+// Assignment operators. `+=` and `-=` on a pointer become ptr_kind.
+typedef struct {
+    char *op;
+    NodeKind kind;
+    NodeKind ptr_kind;
+} AssignOp;
+
+static AssignOp assign_ops[] = {
+    {"=", ND_ASSIGN, ND_ASSIGN},
+    {"*=", ND_MUL_EQ, ND_MUL_EQ},
+    {"/=", ND_DIV_EQ, ND_DIV_EQ},
+    {"%=", ND_MOD_EQ, ND_MOD_EQ},
+    {"<<=", ND_SHL_EQ, ND_SHL_EQ},
+    {">>=", ND_SHR_EQ, ND_SHR_EQ},
+    {"&=", ND_BITAND_EQ, ND_BITAND_EQ},
+    {"|=", ND_BITOR_EQ, ND_BITOR_EQ},
+    {"^=", ND_BITXOR_EQ, ND_BITXOR_EQ},
+    {"+=", ND_ADD_EQ, ND_PTR_ADD_EQ},
+    {"-=", ND_SUB_EQ, ND_PTR_SUB_EQ},
+};
+
+// Left-associative binary operators parsed by binary(). An operator
+// with a larger prec binds tighter. If swap is set, the operands are
+// exchanged, so that `a > b` is represented as `b < a`.
+typedef struct {
+    char *op;
+    int prec;
+    NodeKind kind;
+    bool swap;
+} BinaryOp;
+
+static BinaryOp binary_ops[] = {
+    {"||", 1, ND_LOGOR, false},
+    {"&&", 2, ND_LOGAND, false},
+    {"|", 3, ND_BITOR, false},
+    {"^", 4, ND_BITXOR, false},
+    {"&", 5, ND_BITAND, false},
+    {"==", 6, ND_EQ, false},
+    {"!=", 6, ND_NE, false},
+    {"<", 7, ND_LT, false},
+    {"<=", 7, ND_LE, false},
+    {">", 7, ND_LT, true},
+    {">=", 7, ND_LE, true},
+    {"<<", 8, ND_SHL, false},
+    {">>", 8, ND_SHR, false},
+    {"+", 9, ND_ADD, false},
+    {"-", 9, ND_SUB, false},
+    {"*", 10, ND_MUL, false},
+    {"/", 10, ND_DIV, false},
+    {"%", 10, ND_MOD, false},
+};
+
+// Returns true if the current token is the punctuator op. Unlike
+// peek(), this does not call strlen() on the token.
+static bool at_op(char *op, int len) {
+    return token->len == len && !memcmp(token->str, op, len);
+}
+
+static AssignOp *find_assign_op() {
+    if(token->kind != TK_RESERVED || token->len > 3) return NULL;
+    for(int i=0; i<sizeof(assign_ops) / sizeof(*assign_ops); i++) {
+        AssignOp *op = &assign_ops[i];
+        if(op->op[0] == token->str[0] && at_op(op->op, strlen(op->op))) {
+            return op;
+        }
+    }
+    return NULL;
+}
+
+static BinaryOp *find_binary_op() {
+    if(token->kind != TK_RESERVED || token->len > 2) return NULL;
+    for(int i=0; i<sizeof(binary_ops) / sizeof(*binary_ops); i++) {
+        BinaryOp *op = &binary_ops[i];
+        if(op->op[0] == token->str[0] && at_op(op->op, strlen(op->op))) {
+            return op;
+        }
+    }
+    return NULL;
+}
+
 // assign = conditional (assign-op assign)?
-// assign-op = "=" | "+=" | "-=" | "*=" | "/=" | "<<=" | ">>="
+// assign-op = "=" | "+=" | "-=" | "*=" | "/=" | "%=" | "<<=" | ">>="
 //           | "&=" | "|=" | "^="
 static Node *assign() {
     Node *node = conditional();
-    Token *tok;
+    AssignOp *op = find_assign_op();
+    if(!op) return node;
 
-    if(tok=consume("=")) {
-        return new_binary(ND_ASSIGN, node, assign(), tok);
-    }
-    if(tok = consume("*=")) {
-        return new_binary(ND_MUL_EQ, node, assign(), tok);
-    }
-    if(tok = consume("/=")) {
-        return new_binary(ND_DIV_EQ, node, assign(), tok);
-    }
-    if(tok = consume("<<=")) {
-        return new_binary(ND_SHL_EQ, node, assign(), tok);
-    }
-    if(tok = consume(">>=")) {
-        return new_binary(ND_SHR_EQ, node, assign(), tok);
-    }
-    if(tok = consume("&=")) {
-        return new_binary(ND_BITAND_EQ, node, assign(), tok);
-    }
-    if(tok = consume("|=")) {
-        return new_binary(ND_BITOR_EQ, node, assign(), tok);
-    }
-    if(tok = consume("^=")) {
-        return new_binary(ND_BITXOR_EQ, node, assign(), tok);
-    }
-    if(tok = consume("+=")) {
-        add_type(node);
-        if(node->ty->base) {
-            return new_binary(ND_PTR_ADD_EQ, node, assign(), tok);
-        } else {
-            return new_binary(ND_ADD_EQ, node, assign(), tok);
-        }
-    }
+    Token *tok = token;
+    token = token->next;
 
-    if(tok = consume("-=")) {
+    NodeKind kind = op->kind;
+    if(op->ptr_kind != kind) {
         add_type(node);
         if(node->ty->base) {
-            return new_binary(ND_PTR_SUB_EQ, node, assign(), tok);
-        } else {
-            return new_binary(ND_SUB_EQ, node, assign(), tok);
+            kind = op->ptr_kind;
         }
     }
-    return node;
+    return new_binary(kind, node, assign(), tok);
 }
 
-// conditional = logor ("?" expr ":" conditional)?
+// conditional = binary ("?" expr ":" conditional)?
 static Node *conditional() {
-    Node *node = logor();
+    Node *node = binary(1);
     Token *tok = consume("?");
     if(!tok) return node;
 
@@ -1588,105 +1842,36 @@ static Node *conditional() {
     return ternary;
 }
 
-// logor = logand ("||" logand)*
-static Node *logor() {
-    Node *node = logand();
-    Token *tok;
-    while(tok = consume("||")) {
-        node = new_binary(ND_LOGOR, node, logand(), tok);
-    }
-    return node;
-}
-
-// logand = bitor ("&&" bitor)*
-static Node *logand() {
-    Node *node = bitor();
-    Token *tok;
-    while(tok = consume("&&")) {
-        node = new_binary(ND_LOGAND, node, bitor(), tok);
-    }
-    return node;
-}
-
-// bitor = bitxor("|" bitxor)*
-static Node *bitor() {
-    Node *node = bitxor();
-    Token *tok;
-    while(tok = consume("|")) {
-        node = new_binary(ND_BITOR, node, bitxor(), tok);
-    }
-    return node;
-}
-
-// bit xor = bitand("^ bitand")*
-static Node *bitxor() {
-    Node *node = bitand();
-    Token *tok;
-    while(tok = consume("^")) {
-        node = new_binary(ND_BITXOR, node, bitand(), tok);
-    }
-    return node;
-}
-
-// bitand = equality ("&" equality)*
-static Node *bitand() {
-    Node *node = equality();
-    Token *tok;
-    while(tok = consume("&")) {
-        node = new_binary(ND_BITAND, node, equality(), tok);
-    }
-    return node;
-}
-
-// equality = relational ("==" relational | "!=" relational)*
-static Node *equality() {
-	Node *node = relational();
-
-    Token *tok;
-	while(true) {
-		if(tok=consume("==")) {
-			node = new_binary(ND_EQ, node, relational(), tok);
-		} else if(consume("!=")) {
-			node = new_binary(ND_NE, node, relational(), tok);
-		} else {
-			return node;
-		}
-	}
-}
-
-// relational = shift ("<" shift | "<=" shift | ">" shift | ">=" shift)*
-static Node *relational() {
-	Node *node = shift();
-
-    Token *tok;
-	while(true) {
-		if(tok = consume("<")) {
-			node = new_binary(ND_LT, node, shift(), tok);
-		} else if(tok = consume("<=")) {
-			node = new_binary(ND_LE, node, shift(), tok);
-		} else if(tok = consume(">")) {
-			node = new_binary(ND_LT, shift(), node, tok);
-		} else if(tok = consume(">=")) {
-			node = new_binary(ND_LE, shift(), node, tok);
-		} else {
-			return node;
-		}
-	}
-}
+// binary = cast (binary-op cast)*
+// binary-op = "||" | "&&" | "|" | "^" | "&" | "==" | "!=" | "<" | "<="
+//           | ">" | ">=" | "<<" | ">>" | "+" | "-" | "*" | "/" | "%"
+//
+// All binary operators are parsed by precedence climbing. The right
+// operand of an operator only takes operators that bind tighter, so a
+// run of operators with the same precedence, such as `a - b + c`, is
+// built left-associatively by the loop rather than by recursion.
+static Node *binary(int min_prec) {
+    Node *node = cast();
 
-// shift = add("<<" add | ">>" add)
-static Node *shift() {
-    Node *node = add();
-    Token *tok;
-    
     while(true) {
-        if(tok = consume("<<")) {
-            node = new_binary(ND_SHL, node, add(), tok);
-        } else if(tok = consume(">>")) {
-            node = new_binary(ND_SHR, node, add(), tok);
-        } else {
+        BinaryOp *op = find_binary_op();
+        if(!op || op->prec < min_prec) {
             return node;
         }
+
+        Token *tok = token;
+        token = token->next;
+        Node *rhs = binary(op->prec + 1);
+
+        if(op->kind == ND_ADD) {
+            node = new_add(node, rhs, tok);
+        } else if(op->kind == ND_SUB) {
+            node = new_sub(node, rhs, tok);
+        } else if(op->swap) {
+            node = new_binary(op->kind, rhs, node, tok);
+        } else {
+            node = new_binary(op->kind, node, rhs, tok);
+        }
     }
 }
 
@@ -1722,38 +1907,6 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
     error_tok(tok, "invalid operands");
 }
 
-// add = mul ("+" mul | "-" mul)*
-static Node *add() {
-	Node *node = mul();
-    Token *tok;
-
-	while(true) {
-		if(tok = consume("+")) {
-            node = new_add(node, mul(), tok);
-		} else if(tok = consume("-")) {
-            node = new_sub(node, mul(), tok);
-		} else {
-			return node;
-		}
-	}
-}
-
-// mul = cast ("*" cast | "/" cast)*
-static Node *mul() {
-	Node *node = cast();
-    Token *tok;
-
-	while(true) {
-		if(tok = consume("*")) {
-			node = new_binary(ND_MUL, node, cast(), tok);
-		} else if(tok = consume("/")) {
-			node = new_binary(ND_DIV, node, cast(), tok);
-		} else {
-			return node;
-		}
-	}
-}
-
 // cast = "(" type-name ")" cast | unary
 static Node *cast() {
     Token *tok = token;
@@ -1897,7 +2050,7 @@ static Node *compound_literal() {
     // scopeに入っていない -> top level variable
     if(scope_depth == 0) {
         Var *var = new_gvar(new_label(), ty, true, true);
-        var->initializer = gvar_initializer(ty);
+        gvar_initializer(var);
         return new_var_node(var, tok);
     }
 
@@ -1914,10 +2067,12 @@ static Node *stmt_expr(Token *tok) {
     Scope *sc = enter_scope();
     Node *node = new_node(ND_STMT_EXPR, tok);
     node->body = stmt();
+    Node *prev = NULL;
     Node *cur = node->body;
 
     while(!consume("}")) {
         cur->next = stmt();
+        prev = cur;
         cur = cur->next;
     }
     expect(")");
@@ -1928,7 +2083,11 @@ static Node *stmt_expr(Token *tok) {
         error_tok(cur->tok, "stmt expr returning void is not supported");
     }
     // 最終的に評価されるだろう式の結果をtopノードにして返す
-    memcpy(cur, cur->lhs, sizeof(Node));
+    if(prev) {
+        prev->next = cur->lhs;
+    } else {
+        node->body = cur->lhs;
+    }
     return node;
 }
 
@@ -2040,7 +2199,7 @@ static Node *primary() {
 
         Type *ty = array_of(char_type, tok->cont_len);
         Var *var = new_gvar(new_label(), ty, true, true);
-        var->initializer = gvar_init_string(tok->contents, tok->cont_len);
+        var->init_data = tok->contents;
         return new_var_node(var, tok);
     }
 
@@ -0,0 +1,366 @@
+#include "chibicc.h"
+
+// The optimization pipeline. Passes are registered in the order they
+// run, each with the lowest -O level that enables it. A function pass
+// runs once per function and a module pass once per program; both
+// return the number of changes they made, which -stats reports next to
+// the time they took.
+//
+// AST passes come first. At -O2 the program is then lowered into the IR
+// of the optimizing backend and the IR passes run on it; otherwise the
+// stack-machine code generator works on the AST directly, and its
+// output for each function goes through the assembly passes. Modes of
+// the code generators are registered like passes, so that they are
+// enabled by the -O level and may be turned off with -fno-<name>.
+//
+// -f<name> runs a pass even below its -O level. A pass may also do more
+// when asked for this way, as the loop unroller does.
+//
+// -Rpass=<name> asks a pass to report what it did at each place in the
+// source, and -Rpass-missed=<name> what it did not do and why.
+
+enum {
+    PASS_INLINE,
+    PASS_TAILREC,
+    PASS_FOLD,
+    PASS_VECTORIZE,
+    PASS_UNROLL,
+    PASS_DCE,
+    PASS_LOWER,
+    PASS_SSA,
+    PASS_GVN,
+    PASS_RLE,
+    PASS_DSE,
+    PASS_LICM,
+    PASS_IR_DCE,
+    PASS_OUT_OF_SSA,
+    PASS_REGALLOC,
+    PASS_TOS_CACHE,
+    PASS_SWITCH,
+    PASS_STRENGTH,
+    PASS_OMIT_FP,
+    PASS_MEM2REG,
+    PASS_SIBCALL,
+    PASS_AVX2,
+    PASS_PEEPHOLE,
+    NUM_PASSES,
+};
+
+// What a pass works on
+enum {
+    STAGE_AST,
+    STAGE_IR,
+    STAGE_CODEGEN, // a mode of codegen() or gen_ir()
+    STAGE_ASM, // codegen() output
+};
+
+typedef struct Pass Pass;
+struct Pass {
+    char *name;
+    int stage;
+    bool is_module; // runs once on the whole program
+    int level; // lowest -O level that runs the pass
+    int requires; // pass that must have run first, or -1
+    bool required; // may not be disabled by -fno-<name>
+
+    bool disabled; // by -fno-<name>
+    bool forced; // by -f<name>
+    bool print_after; // by -print-after=<name>
+    bool remark; // by -Rpass=<name>
+    bool remark_missed; // by -Rpass-missed=<name>
+    bool ran;
+
+    // Statistics
+    int runs;
+    int changes;
+    long time; // microseconds
+};
+
+static Pass passes[NUM_PASSES];
+
+// Other events counted for -stats, such as how switch statements were
+// lowered
+typedef struct Counter Counter;
+struct Counter {
+    Counter *next;
+    char *name;
+    int count;
+};
+
+static Counter *counters;
+static bool initialized;
+static int opt_level;
+static bool print_stats;
+
+static void add_pass(int id, char *name, int stage, bool is_module, int level, int requires) {
+    Pass *p = &passes[id];
+    p->name = name;
+    p->stage = stage;
+    p->is_module = is_module;
+    p->level = level;
+    p->requires = requires;
+}
+
+static void init_passes() {
+    if(initialized) return;
+    initialized = true;
+    add_pass(PASS_INLINE, "inline", STAGE_AST, true, 1, -1);
+    add_pass(PASS_TAILREC, "tail-recursion", STAGE_AST, false, 1, -1);
+    add_pass(PASS_FOLD, "fold", STAGE_AST, false, 1, -1);
+    add_pass(PASS_VECTORIZE, "vectorize", STAGE_AST, false, 2, -1);
+    add_pass(PASS_UNROLL, "unroll-loops", STAGE_AST, false, 1, -1);
+    add_pass(PASS_DCE, "dce", STAGE_AST, false, 1, -1);
+    add_pass(PASS_LOWER, "lower", STAGE_IR, true, 2, -1);
+    add_pass(PASS_SSA, "ssa", STAGE_IR, false, 2, PASS_LOWER);
+    add_pass(PASS_GVN, "gvn", STAGE_IR, false, 2, PASS_SSA);
+    add_pass(PASS_RLE, "rle", STAGE_IR, false, 2, PASS_SSA);
+    add_pass(PASS_DSE, "dse", STAGE_IR, false, 2, PASS_SSA);
+    add_pass(PASS_LICM, "licm", STAGE_IR, false, 2, PASS_SSA);
+    add_pass(PASS_IR_DCE, "ir-dce", STAGE_IR, false, 2, PASS_SSA);
+    add_pass(PASS_OUT_OF_SSA, "out-of-ssa", STAGE_IR, false, 2, PASS_SSA);
+    add_pass(PASS_REGALLOC, "regalloc", STAGE_IR, true, 2, PASS_LOWER);
+    passes[PASS_REGALLOC].required = true;
+    add_pass(PASS_TOS_CACHE, "tos-cache", STAGE_CODEGEN, false, 1, -1);
+    add_pass(PASS_SWITCH, "switch-lowering", STAGE_CODEGEN, false, 1, -1);
+    add_pass(PASS_STRENGTH, "strength-reduce", STAGE_CODEGEN, false, 1, -1);
+    add_pass(PASS_OMIT_FP, "omit-frame-pointer", STAGE_CODEGEN, false, 1, -1);
+    add_pass(PASS_MEM2REG, "mem2reg", STAGE_CODEGEN, false, 1, -1);
+    add_pass(PASS_SIBCALL, "sibling-calls", STAGE_CODEGEN, false, 1, -1);
+    // Not every CPU has AVX2, so no -O level enables it.
+    add_pass(PASS_AVX2, "avx2", STAGE_CODEGEN, false, 3, -1);
+    add_pass(PASS_PEEPHOLE, "peephole", STAGE_ASM, false, 1, -1);
+}
+
+static Pass *find_pass(char *name) {
+    for(int i=0; i<NUM_PASSES; i++) {
+        if(!strcmp(passes[i].name, name)) return &passes[i];
+    }
+    error("unknown pass: %s", name);
+    return NULL;
+}
+
+// Handles an optimization option. Returns false if the argument is not
+// one.
+bool parse_pass_option(char *arg) {
+    init_passes();
+
+    if(!strcmp(arg, "-O") || !strcmp(arg, "-O1")) {
+        opt_level = 1;
+        return true;
+    }
+    if(!strcmp(arg, "-O0")) {
+        opt_level = 0;
+        return true;
+    }
+    if(!strcmp(arg, "-O2")) {
+        opt_level = 2;
+        return true;
+    }
+    if(!strcmp(arg, "-mavx2")) {
+        passes[PASS_AVX2].forced = true;
+        return true;
+    }
+    if(!strcmp(arg, "-stats")) {
+        print_stats = true;
+        return true;
+    }
+    if(!strncmp(arg, "-fno-", 5)) {
+        Pass *p = find_pass(arg + 5);
+        if(p->required) error("pass %s cannot be disabled", p->name);
+        p->disabled = true;
+        return true;
+    }
+    if(!strncmp(arg, "-f", 2)) {
+        find_pass(arg + 2)->forced = true;
+        return true;
+    }
+    if(!strncmp(arg, "-print-after=", 13)) {
+        Pass *p = find_pass(arg + 13);
+        if(p->stage != STAGE_IR) error("pass %s does not work on the IR", p->name);
+        p->print_after = true;
+        return true;
+    }
+    if(!strncmp(arg, "-Rpass=", 7)) {
+        find_pass(arg + 7)->remark = true;
+        return true;
+    }
+    if(!strncmp(arg, "-Rpass-missed=", 14)) {
+        find_pass(arg + 14)->remark_missed = true;
+        return true;
+    }
+    return false;
+}
+
+static bool is_enabled(Pass *p) {
+    if(p->disabled || (opt_level < p->level && !p->forced)) return false;
+    return p->requires == -1 || passes[p->requires].ran;
+}
+
+static int run_function_pass(int id, Function *fn) {
+    switch(id) {
+        case PASS_TAILREC:
+            return eliminate_tail_calls(fn);
+        case PASS_FOLD:
+            return fold_fn(fn);
+        case PASS_VECTORIZE:
+            return vectorize_loops(fn);
+        case PASS_UNROLL:
+            return unroll_loops(fn);
+        case PASS_DCE:
+            return eliminate_dead_code(fn);
+        case PASS_SSA:
+            return build_ssa(fn);
+        case PASS_GVN:
+            return gvn(fn);
+        case PASS_RLE:
+            return forward_stores(fn);
+        case PASS_DSE:
+            return eliminate_dead_stores(fn);
+        case PASS_LICM:
+            return licm(fn);
+        case PASS_IR_DCE:
+            return eliminate_dead_insns(fn);
+        case PASS_OUT_OF_SSA:
+            return out_of_ssa(fn);
+    }
+    error("not a function pass: %s", passes[id].name);
+    return 0;
+}
+
+static int run_module_pass(int id, Program *prog) {
+    switch(id) {
+        case PASS_INLINE:
+            return inline_fns(prog);
+        case PASS_LOWER:
+            return gen_ir(prog);
+        case PASS_REGALLOC:
+            return alloc_regs(prog);
+    }
+    error("not a module pass: %s", passes[id].name);
+    return 0;
+}
+
+static int run_asm_pass(int id, InsnList *insns) {
+    switch(id) {
+        case PASS_PEEPHOLE:
+            return peephole(insns);
+    }
+    error("not an assembly pass: %s", passes[id].name);
+    return 0;
+}
+
+static long elapsed(long start) {
+    return (clock() - start) * 1000000 / CLOCKS_PER_SEC;
+}
+
+static void run_pass(int id, Program *prog) {
+    Pass *p = &passes[id];
+    long start = clock();
+
+    if(p->is_module) {
+        p->changes += run_module_pass(id, prog);
+        p->runs++;
+    } else {
+        for(Function *fn=prog->fns; fn; fn=fn->next) {
+            p->changes += run_function_pass(id, fn);
+            p->runs++;
+        }
+    }
+
+    p->time += elapsed(start);
+    p->ran = true;
+
+    if(p->print_after) {
+        fprintf(stderr, "*** IR after %s ***\n", p->name);
+        for(Function *fn=prog->fns; fn; fn=fn->next) {
+            dump_ir(fn);
+        }
+    }
+}
+
+void count_stat(char *name) {
+    Counter *last = NULL;
+    for(Counter *c=counters; c; c=c->next) {
+        if(!strcmp(c->name, name)) {
+            c->count++;
+            return;
+        }
+        last = c;
+    }
+
+    Counter *c = calloc(1, sizeof(Counter));
+    c->name = name;
+    c->count = 1;
+    if(last) {
+        last->next = c;
+    } else {
+        counters = c;
+    }
+}
+
+// Prints the statistics of the passes if -stats is given.
+void print_pass_stats() {
+    if(!print_stats) return;
+    fprintf(stderr, "%-12s %6s %8s %10s\n", "pass", "runs", "changes", "time(us)");
+    for(int i=0; i<NUM_PASSES; i++) {
+        Pass *p = &passes[i];
+        if(!p->ran) continue;
+        fprintf(stderr, "%-12s %6d %8d %10ld\n", p->name, p->runs, p->changes, p->time);
+    }
+    for(Counter *c=counters; c; c=c->next) {
+        fprintf(stderr, "%-19s %8d\n", c->name, c->count);
+    }
+}
+
+// Runs the AST and IR passes enabled at the current -O level. Returns
+// true if the program was lowered into the IR, so that it has to be
+// emitted by gen_x86() rather than codegen().
+bool run_passes(Program *prog) {
+    init_passes();
+    for(int i=0; i<NUM_PASSES; i++) {
+        int stage = passes[i].stage;
+        if((stage == STAGE_AST || stage == STAGE_IR) && is_enabled(&passes[i])) {
+            run_pass(i, prog);
+        }
+    }
+    return passes[PASS_LOWER].ran;
+}
+
+// Returns true if a mode of codegen() is enabled.
+bool is_mode_enabled(char *name) {
+    init_passes();
+    Pass *p = find_pass(name);
+    assert(p->stage == STAGE_CODEGEN);
+    return is_enabled(p);
+}
+
+// Returns true if a pass was asked for with -f<name> rather than only
+// enabled by the -O level.
+bool is_pass_forced(char *name) {
+    init_passes();
+    return find_pass(name)->forced;
+}
+
+// Returns true if remarks of a pass were asked for, about what it did
+// or, if missed, about what it did not do.
+bool is_remark_enabled(char *name, bool missed) {
+    init_passes();
+    Pass *p = find_pass(name);
+    return missed ? p->remark_missed : p->remark;
+}
+
+// Runs the assembly passes on the code of a function emitted by
+// codegen().
+void run_asm_passes(InsnList *insns) {
+    init_passes();
+    for(int i=0; i<NUM_PASSES; i++) {
+        Pass *p = &passes[i];
+        if(p->stage != STAGE_ASM || !is_enabled(p)) continue;
+
+        long start = clock();
+        p->changes += run_asm_pass(i, insns);
+        p->runs++;
+        p->time += elapsed(start);
+        p->ran = true;
+    }
+}
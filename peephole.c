@@ -0,0 +1,264 @@
+#include "chibicc.h"
+
+// Peephole optimization of the code emitted by codegen().
+//
+// The stack machine passes every value through the stack, so most of
+// what it emits is a push followed shortly by a pop. The rules below
+// look at a small window of instructions:
+//
+//   push X; ...; pop Y     =>  mov Y, X; ...   (or nothing if X is Y)
+//   push X; add rsp, 8     =>  (nothing)
+//   mov R, A; imul R, B    =>  mov R, A*B
+//   mov R, imm; op D, R    =>  op D, imm       if R is dead afterwards
+//                                              and imm fits in 32 bits
+//
+// where "..." is up to WINDOW instructions that neither touch the stack
+// nor mention Y. After a rewrite the scan resumes far enough before the
+// rewritten instructions for any window that now matches.
+
+enum { WINDOW = 3 };
+
+// General-purpose registers by family and width
+static char *regs64[] = {"rax", "rcx", "rdx", "rbx", "rsi", "rdi", "r8", "r9", "r10", "r11"};
+static char *regs32[] = {"eax", "ecx", "edx", "ebx", "esi", "edi", "r8d", "r9d", "r10d", "r11d"};
+static char *regs16[] = {"ax", "cx", "dx", "bx", "si", "di", "r8w", "r9w", "r10w", "r11w"};
+static char *regs8[] = {"al", "cl", "dl", "bl", "sil", "dil", "r8b", "r9b", "r10b", "r11b"};
+
+enum { NUM_FAMILIES = 10 };
+
+static InsnList *list;
+static int nremoved;
+
+static bool is_op(Insn *insn, char *op) {
+    return insn->op && !strcmp(insn->op, op);
+}
+
+static bool is_reg64(char *s) {
+    for(int i=0; i<NUM_FAMILIES; i++) {
+        if(!strcmp(s, regs64[i])) return true;
+    }
+    return false;
+}
+
+// Returns the family of a register name, or -1.
+static int family_of(char *name, int len) {
+    for(int i=0; i<NUM_FAMILIES; i++) {
+        if(strlen(regs64[i]) == len && !strncmp(name, regs64[i], len)) return i;
+        if(strlen(regs32[i]) == len && !strncmp(name, regs32[i], len)) return i;
+        if(strlen(regs16[i]) == len && !strncmp(name, regs16[i], len)) return i;
+        if(strlen(regs8[i]) == len && !strncmp(name, regs8[i], len)) return i;
+    }
+    return -1;
+}
+
+static bool is_word_char(char c) {
+    return ('a' <= c && c <= 'z') || ('0' <= c && c <= '9');
+}
+
+static bool operand_mentions(char *s, int family) {
+    if(!s) return false;
+    while(*s) {
+        if(!is_word_char(*s)) {
+            s++;
+            continue;
+        }
+        char *start = s;
+        while(is_word_char(*s)) s++;
+        if(family_of(start, s - start) == family) return true;
+    }
+    return false;
+}
+
+static bool mentions(Insn *insn, int family) {
+    return operand_mentions(insn->dst, family) || operand_mentions(insn->src, family);
+}
+
+// cqo, idiv and one-operand imul read rax and rdx implicitly.
+static bool uses_rax_rdx(Insn *insn) {
+    return is_op(insn, "cqo") || is_op(insn, "idiv") || (is_op(insn, "imul") && !insn->src);
+}
+
+static bool mentions_rsp(Insn *insn) {
+    return (insn->dst && strstr(insn->dst, "rsp")) || (insn->src && strstr(insn->src, "rsp"));
+}
+
+// Returns true if an instruction may be moved across a push or pop:
+// it does not use the stack, change the control flow or read registers
+// implicitly.
+static bool is_plain(Insn *insn) {
+    if(!insn->op) return false;
+    if(insn->op[0] == 'j') return false;
+    if(is_op(insn, "push") || is_op(insn, "pop") || is_op(insn, "call") || is_op(insn, "ret")) return false;
+    if(uses_rax_rdx(insn)) return false;
+    return !mentions_rsp(insn);
+}
+
+static bool is_imm(char *s) {
+    if(!s) return false;
+    if(*s == '-') s++;
+    if(!*s) return false;
+    for(; *s; s++) {
+        if(*s < '0' || '9' < *s) return false;
+    }
+    return true;
+}
+
+static Insn *new_insn(char *op, char *dst, char *src) {
+    Insn *insn = calloc(1, sizeof(Insn));
+    insn->op = op;
+    insn->dst = dst;
+    insn->src = src;
+    return insn;
+}
+
+static void remove_insn(Insn *insn) {
+    if(insn->prev) {
+        insn->prev->next = insn->next;
+    } else {
+        list->first = insn->next;
+    }
+    if(insn->next) {
+        insn->next->prev = insn->prev;
+    } else {
+        list->last = insn->prev;
+    }
+    nremoved++;
+}
+
+// Replaces an instruction with another one.
+static void replace_insn(Insn *old, Insn *insn) {
+    insn->prev = old->prev;
+    insn->next = old->next;
+    if(old->prev) {
+        old->prev->next = insn;
+    } else {
+        list->first = insn;
+    }
+    if(old->next) {
+        old->next->prev = insn;
+    } else {
+        list->last = insn;
+    }
+}
+
+// Returns true if the value of a register family is overwritten before
+// being read after `insn`. Control flow ends the search pessimistically.
+static bool is_dead_after(Insn *insn, int family) {
+    for(Insn *p=insn->next; p; p=p->next) {
+        if(!p->op || p->op[0] == 'j' || is_op(p, "call") || is_op(p, "ret")) return false;
+        if(uses_rax_rdx(p)) return false;
+        if(!mentions(p, family)) continue;
+
+        if(is_op(p, "pop")) return true;
+
+        // A 32-bit write clears the upper half, so it is a full write too.
+        bool full = !strcmp(p->dst, regs64[family]) || !strcmp(p->dst, regs32[family]);
+        return is_op(p, "mov") && full && !operand_mentions(p->src, family);
+    }
+    return false;
+}
+
+// push X; ...; pop Y
+static bool push_pop(Insn *push) {
+    Insn *pop = push->next;
+    for(int i=0; i<=WINDOW && pop; i++) {
+        if(is_op(pop, "pop")) break;
+        if(!is_plain(pop)) return false;
+        pop = pop->next;
+    }
+    if(!pop || !is_op(pop, "pop") || !is_reg64(pop->dst)) return false;
+
+    // Nothing in between may see Y change early.
+    int y = family_of(pop->dst, strlen(pop->dst));
+    for(Insn *p=push->next; p != pop; p=p->next) {
+        if(mentions(p, y)) return false;
+    }
+
+    if(!strcmp(push->dst, pop->dst)) {
+        remove_insn(push);
+    } else {
+        replace_insn(push, new_insn("mov", pop->dst, push->dst));
+    }
+    remove_insn(pop);
+    return true;
+}
+
+// push X; add rsp, 8
+static bool dead_push(Insn *push) {
+    Insn *add = push->next;
+    if(!add || !is_op(add, "add") || strcmp(add->dst, "rsp") || strcmp(add->src, "8")) return false;
+    remove_insn(push);
+    remove_insn(add);
+    return true;
+}
+
+// mov R, A; imul R, B
+static bool fold_imul(Insn *mov) {
+    Insn *mul = mov->next;
+    if(!mul || !is_op(mul, "imul") || !mul->src || strcmp(mul->dst, mov->dst) || !is_imm(mul->src)) return false;
+
+    long val = strtol(mov->src, NULL, 10) * strtol(mul->src, NULL, 10);
+    if(val != (int)val) return false;
+
+    char *buf = calloc(1, 24);
+    sprintf(buf, "%ld", val);
+    mov->src = buf;
+    remove_insn(mul);
+    return true;
+}
+
+// mov R, imm; op D, R
+static bool fold_imm(Insn *mov) {
+    Insn *use = mov->next;
+    if(!use || !use->src || strcmp(use->src, mov->dst)) return false;
+    if(!is_op(use, "add") && !is_op(use, "sub") && !is_op(use, "imul") && !is_op(use, "and") &&
+       !is_op(use, "or") && !is_op(use, "xor") && !is_op(use, "cmp")) {
+        return false;
+    }
+
+    // Only mov takes a 64-bit immediate.
+    long val = strtol(mov->src, NULL, 10);
+    if(val != (int)val) return false;
+
+    int r = family_of(mov->dst, strlen(mov->dst));
+    if(operand_mentions(use->dst, r) || !is_dead_after(use, r)) return false;
+
+    use->src = mov->src;
+    remove_insn(mov);
+    return true;
+}
+
+// Applies the first rule that matches at an instruction. Rules only
+// change instructions from `insn` onward.
+static bool rewrite(Insn *insn) {
+    if(is_op(insn, "push")) {
+        return push_pop(insn) || dead_push(insn);
+    }
+    if(is_op(insn, "mov") && is_reg64(insn->dst) && is_imm(insn->src)) {
+        return fold_imul(insn) || fold_imm(insn);
+    }
+    return false;
+}
+
+// Optimizes the code of a function. Returns the number of instructions
+// removed.
+int peephole(InsnList *insns) {
+    list = insns;
+    nremoved = 0;
+
+    Insn *insn = list->first;
+    while(insn) {
+        Insn *prev = insn->prev;
+        if(!rewrite(insn)) {
+            insn = insn->next;
+            continue;
+        }
+
+        // A window ending at the rewritten instructions may match now.
+        for(int i=0; i<WINDOW && prev && prev->prev; i++) {
+            prev = prev->prev;
+        }
+        insn = prev ? prev : list->first;
+    }
+    return nremoved;
+}
@@ -0,0 +1,299 @@
+#include "chibicc.h"
+
+// Linear-scan register allocation.
+//
+// Liveness is solved over the control-flow graph, and each virtual
+// register gets one live interval from the first to the last instruction
+// at which it is live. Most registers are temporaries used only in the
+// block that defines them, so the bitsets of the dataflow problem only
+// cover the "global" registers that are read before being written in
+// some block. Intervals are visited in order of their start
+// and handed a free register. When none is free, whichever of the
+// current interval and the active ones ends last is spilled to a stack
+// slot. An interval that spans a call may only use a callee-saved
+// register.
+
+static Function *fn;
+static Reg **vregs; // virtual registers by number
+static int *global_index; // index of a global register, or -1
+static Reg **globals; // global registers by index
+static int nglobals;
+static int nwords; // number of words in a bitset
+static int nspills;
+
+static unsigned long *new_bitset() {
+    return calloc(nwords, sizeof(unsigned long));
+}
+
+static bool test_bit(unsigned long *set, int i) {
+    return (set[i >> 6] >> (i & 63)) & 1;
+}
+
+static void set_bit(unsigned long *set, int i) {
+    set[i >> 6] |= (unsigned long)1 << (i & 63);
+}
+
+static void record(Reg *r) {
+    if(r) {
+        vregs[r->vn] = r;
+    }
+}
+
+// Numbers the instructions and collects the virtual registers. Each
+// block has a position before its first instruction, at which the
+// registers live into it start. Returns the number of positions.
+static int number_ir() {
+    vregs = calloc(fn->nregs, sizeof(Reg *));
+    int pos = 0;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        pos++;
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            ir->pos = pos++;
+            record(ir->d);
+            for(int i=0; i<ir_num_uses(ir); i++) {
+                record(ir_use(ir, i));
+            }
+        }
+    }
+    return pos;
+}
+
+// Finds the registers that may be live across blocks. defined[vn] is
+// the last block in which a register was written.
+static void find_globals() {
+    global_index = calloc(fn->nregs, sizeof(int));
+    globals = calloc(fn->nregs, sizeof(Reg *));
+    int *defined = calloc(fn->nregs, sizeof(int));
+    nglobals = 0;
+    for(int i=0; i<fn->nregs; i++) {
+        global_index[i] = -1;
+        defined[i] = -1;
+    }
+
+    int n = 0;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            for(int i=0; i<ir_num_uses(ir); i++) {
+                Reg *r = ir_use(ir, i);
+                if(r && defined[r->vn] != n && global_index[r->vn] == -1) {
+                    global_index[r->vn] = nglobals;
+                    globals[nglobals++] = r;
+                }
+            }
+            if(ir->d) {
+                defined[ir->d->vn] = n;
+            }
+        }
+        n++;
+    }
+    free(defined);
+}
+
+// Merges the live-in set of a successor into a live-out set. Returns
+// true if the live-out set changed.
+static bool merge_live(unsigned long *live_out, BB *succ) {
+    if(!succ) return false;
+    bool changed = false;
+    for(int i=0; i<nwords; i++) {
+        unsigned long w = live_out[i] | succ->live_in[i];
+        if(w != live_out[i]) {
+            live_out[i] = w;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Computes live_in and live_out of every block by iterating
+//   live_out = union of live_in of the successors
+//   live_in = use | (live_out - def)
+// to a fixed point. The sets are indexed by global_index[].
+static void compute_liveness() {
+    int nblocks = 0;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        nblocks++;
+    }
+
+    // Walking the blocks backward converges faster.
+    BB **order = calloc(nblocks, sizeof(BB *));
+    unsigned long **use = calloc(nblocks, sizeof(unsigned long *));
+    unsigned long **def = calloc(nblocks, sizeof(unsigned long *));
+    int n = 0;
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        bb->live_in = new_bitset();
+        bb->live_out = new_bitset();
+        use[n] = new_bitset();
+        def[n] = new_bitset();
+
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            for(int i=0; i<ir_num_uses(ir); i++) {
+                Reg *r = ir_use(ir, i);
+                if(r && global_index[r->vn] != -1 && !test_bit(def[n], global_index[r->vn])) {
+                    set_bit(use[n], global_index[r->vn]);
+                }
+            }
+            if(ir->d && global_index[ir->d->vn] != -1) {
+                set_bit(def[n], global_index[ir->d->vn]);
+            }
+        }
+        order[n++] = bb;
+    }
+
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int i=nblocks-1; i>=0; i--) {
+            BB *bb = order[i];
+            for(int j=0; j<num_succs(bb); j++) {
+                if(merge_live(bb->live_out, succ(bb, j))) changed = true;
+            }
+
+            for(int j=0; j<nwords; j++) {
+                bb->live_in[j] = use[i][j] | (bb->live_out[j] & ~def[i][j]);
+            }
+        }
+    }
+
+    for(int i=0; i<nblocks; i++) {
+        free(use[i]);
+        free(def[i]);
+    }
+    free(use);
+    free(def);
+    free(order);
+}
+
+static void extend(Reg *r, int pos) {
+    if(pos < r->start) r->start = pos;
+    if(pos > r->end) r->end = pos;
+}
+
+static void build_intervals() {
+    for(int i=0; i<fn->nregs; i++) {
+        if(vregs[i]) {
+            vregs[i]->start = INT_MAX;
+            vregs[i]->end = -1;
+        }
+    }
+
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(int i=0; i<nglobals; i++) {
+            if(test_bit(bb->live_in, i)) extend(globals[i], bb->first->pos - 1);
+            if(test_bit(bb->live_out, i)) extend(globals[i], bb->last->pos);
+        }
+
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->d) {
+                extend(ir->d, ir->pos);
+            }
+            for(int i=0; i<ir_num_uses(ir); i++) {
+                Reg *r = ir_use(ir, i);
+                if(r) extend(r, ir->pos);
+            }
+        }
+    }
+}
+
+static void spill(Reg *r) {
+    r->rn = -1;
+    fn->stack_size += 8;
+    r->spill = fn->stack_size;
+    nspills++;
+}
+
+static void scan(int npos) {
+    // ncalls[p] is the number of calls before position p.
+    int *ncalls = calloc(npos + 1, sizeof(int));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->op == IR_CALL) ncalls[ir->pos + 1]++;
+        }
+    }
+    for(int i=0; i<npos; i++) {
+        ncalls[i + 1] += ncalls[i];
+    }
+
+    // Sort the intervals by start.
+    int *count = calloc(npos + 1, sizeof(int));
+    int nlive = 0;
+    for(int i=0; i<fn->nregs; i++) {
+        if(vregs[i]) {
+            count[vregs[i]->start + 1]++;
+            nlive++;
+        }
+    }
+    for(int i=0; i<npos; i++) {
+        count[i + 1] += count[i];
+    }
+    Reg **sorted = calloc(nlive, sizeof(Reg *));
+    for(int i=0; i<fn->nregs; i++) {
+        if(vregs[i]) {
+            sorted[count[vregs[i]->start]++] = vregs[i];
+        }
+    }
+
+    Reg *active[NUM_REGS];
+    for(int i=0; i<NUM_REGS; i++) {
+        active[i] = NULL;
+    }
+
+    for(int i=0; i<nlive; i++) {
+        Reg *r = sorted[i];
+
+        // Expire intervals that ended before this one starts. An interval
+        // that ends where this one starts still holds its register, so a
+        // result is never allocated on top of its own operands.
+        for(int j=0; j<NUM_REGS; j++) {
+            if(active[j] && active[j]->end < r->start) {
+                active[j] = NULL;
+            }
+        }
+
+        bool crosses_call = r->start < r->end && ncalls[r->end] - ncalls[r->start + 1] > 0;
+        int first = crosses_call ? NUM_CALLER_SAVED : 0;
+
+        int rn = -1;
+        for(int j=first; j<NUM_REGS; j++) {
+            if(!active[j]) {
+                rn = j;
+                break;
+            }
+        }
+
+        if(rn == -1) {
+            // Take the register of the active interval that ends last,
+            // if it ends after this one.
+            int victim = -1;
+            for(int j=first; j<NUM_REGS; j++) {
+                if(active[j]->end > r->end && (victim == -1 || active[j]->end > active[victim]->end)) {
+                    victim = j;
+                }
+            }
+            if(victim == -1) {
+                spill(r);
+                continue;
+            }
+            spill(active[victim]);
+            rn = victim;
+        }
+
+        r->rn = rn;
+        active[rn] = r;
+        fn->used_regs |= 1 << rn;
+    }
+}
+
+// Returns the number of registers spilled.
+int alloc_regs(Program *prog) {
+    nspills = 0;
+    for(Function *f=prog->fns; f; f=f->next) {
+        fn = f;
+        int npos = number_ir();
+        find_globals();
+        nwords = (nglobals + 63) / 64;
+        compute_liveness();
+        build_intervals();
+        scan(npos);
+    }
+    return nspills;
+}
@@ -12,6 +12,7 @@ extern FILE *stderr;
 
 void *malloc(long size);
 void *calloc(long nmemb, long size);
+void *realloc(void *ptr, long size);
 int *__errno_location();
 char *strerror(int errnum);
 FILE *fopen(char *pathname, char *mode);
@@ -27,7 +28,10 @@ void *memcpy(char *dst, char *src, long n);
 char *strndup(char *p, long n);
 int isspace(int c);
 char *strstr(char *haystack, char *needle);
+char *strchr(char *s, int c);
+FILE *open_memstream(char **ptr, long *sizeloc);
 long strtol(char *nptr, char **endptr, int base);
+long clock();
 
 typedef struct {
     int gp_offset;
@@ -51,7 +55,9 @@ EOF
     sed -i 's/\berrno\b/*__errno_location()/g' $TMP/$1
     sed -i 's/\btrue\b/1/g; s/\bfalse\b/0/g;' $TMP/$1
     sed -i 's/\bNULL\b/0/g' $TMP/$1
+    sed -i 's/\bunsigned long\b/long/g' $TMP/$1
     sed -i 's/INT_MAX/2147483647/g' $TMP/$1
+    sed -i 's/CLOCKS_PER_SEC/1000000/g' $TMP/$1
 
 	./chibicc $TMP/$1 > $TMP/${1%.c}.s
     gcc -c -o $TMP/${1%.c}.o $TMP/${1%.c}.s
@@ -67,6 +73,24 @@ expand main.c
 expand type.c
 expand parser.c
 expand codegen.c
+expand peephole.c
+expand switch.c
+expand strength.c
+expand fold.c
+expand unroll.c
+expand vector.c
+expand dce.c
+expand inline.c
+expand tailcall.c
+expand gen_ir.c
+expand ir.c
+expand ssa.c
+expand gvn.c
+expand memopt.c
+expand licm.c
+expand pass.c
+expand regalloc.c
+expand gen_x86.c
 expand tokenize.c
 
 gcc -static -o chibicc-gen2 $TMP/*.o
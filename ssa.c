@@ -0,0 +1,502 @@
+#include "chibicc.h"
+
+// Conversion of the IR into and out of static single assignment form.
+//
+// build_ssa() follows Cytron et al.: phis for a register are placed at
+// the iterated dominance frontier of the blocks defining it, and then
+// every definition is renamed to a fresh register in a walk over the
+// dominator tree. Only promoted variables and registers with several
+// definitions are renamed, and of those only the ones read before being
+// written in some block get phis ("semi-pruned" SSA).
+//
+// out_of_ssa() replaces each phi by copies at the end of its
+// predecessors, splitting critical edges so that the copies only run on
+// their own edge.
+
+static Function *fn;
+static int nblocks;
+static BB **blocks; // blocks by id
+static BB **rpo; // blocks in reverse postorder
+static int *rpo_num; // reverse postorder numbers by block id
+
+// Dominator tree children by block id
+static BB ***children;
+static int *nchildren;
+
+static void add_block(BB ***list, int *len, BB *bb) {
+    *list = realloc(*list, sizeof(BB *) * (*len + 1));
+    (*list)[(*len)++] = bb;
+}
+
+static void compute_rpo() {
+    // Iterative depth-first search. next[id] is the next successor of a
+    // block on the stack to visit.
+    BB **stack = calloc(nblocks, sizeof(BB *));
+    int *next = calloc(nblocks, sizeof(int));
+    bool *visited = calloc(nblocks, sizeof(bool));
+    int len = 0;
+    int n = nblocks;
+
+    stack[len++] = fn->bbs;
+    visited[fn->bbs->id] = true;
+    while(len) {
+        BB *bb = stack[len - 1];
+        if(next[bb->id] < num_succs(bb)) {
+            BB *s = succ(bb, next[bb->id]++);
+            if(!visited[s->id]) {
+                visited[s->id] = true;
+                stack[len++] = s;
+            }
+            continue;
+        }
+        len--;
+        rpo[--n] = bb;
+    }
+
+    for(int i=0; i<nblocks; i++) {
+        rpo_num[rpo[i]->id] = i;
+    }
+    free(stack);
+    free(next);
+    free(visited);
+}
+
+static BB *intersect(BB *x, BB *y) {
+    while(x != y) {
+        while(rpo_num[x->id] > rpo_num[y->id]) x = x->idom;
+        while(rpo_num[y->id] > rpo_num[x->id]) y = y->idom;
+    }
+    return x;
+}
+
+// Numbers the dominator tree in preorder and postorder, so that
+// dominates() is a constant-time check.
+static void number_dom_tree() {
+    BB **stack = calloc(nblocks, sizeof(BB *));
+    int *next = calloc(nblocks, sizeof(int));
+    int len = 0;
+    int pre = 0;
+    int post = 0;
+
+    stack[len++] = fn->bbs;
+    fn->bbs->dom_pre = pre++;
+    while(len) {
+        BB *bb = stack[len - 1];
+        if(next[bb->id] < nchildren[bb->id]) {
+            BB *c = children[bb->id][next[bb->id]++];
+            c->dom_pre = pre++;
+            stack[len++] = c;
+            continue;
+        }
+        bb->dom_post = post++;
+        len--;
+    }
+    free(stack);
+    free(next);
+}
+
+// Computes the control-flow graph and the dominator tree with the
+// algorithm of Cooper, Harvey and Kennedy.
+void compute_dominators(Function *f) {
+    fn = f;
+    nblocks = compute_cfg(fn);
+    blocks = calloc(nblocks, sizeof(BB *));
+    rpo = calloc(nblocks, sizeof(BB *));
+    rpo_num = calloc(nblocks, sizeof(int));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        blocks[bb->id] = bb;
+        bb->idom = NULL;
+    }
+    compute_rpo();
+
+    BB *entry = fn->bbs;
+    entry->idom = entry;
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int i=1; i<nblocks; i++) {
+            BB *bb = rpo[i];
+            // Predecessors are in layout order, so visiting them backward
+            // keeps a long chain of jumps to one block linear.
+            BB *idom = NULL;
+            for(int j=bb->npreds-1; j>=0; j--) {
+                BB *p = bb->preds[j];
+                if(!p->idom) continue;
+                idom = idom ? intersect(p, idom) : p;
+            }
+            if(bb->idom != idom) {
+                bb->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    entry->idom = NULL;
+
+    children = calloc(nblocks, sizeof(BB **));
+    nchildren = calloc(nblocks, sizeof(int));
+    for(int i=1; i<nblocks; i++) {
+        BB *bb = rpo[i];
+        add_block(&children[bb->idom->id], &nchildren[bb->idom->id], bb);
+    }
+    number_dom_tree();
+}
+
+//
+// Construction
+//
+
+// Blocks defining a register
+typedef struct DefSite DefSite;
+struct DefSite {
+    DefSite *next;
+    BB *bb;
+};
+
+static int norig; // number of registers before renaming
+static bool *is_cand; // registers to rename, by number
+static bool *needs_phi; // registers to rename that may be live across blocks
+static Reg **cur; // current definition of a register being renamed
+static Reg *undef; // value of a register read before any definition
+static int nchanges; // phis inserted or copies emitted
+
+// Dominance frontiers by block id
+static BB ***df;
+static int *ndf;
+
+static void compute_df() {
+    df = calloc(nblocks, sizeof(BB **));
+    ndf = calloc(nblocks, sizeof(int));
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        if(bb->npreds < 2) continue;
+        for(int i=0; i<bb->npreds; i++) {
+            for(BB *r=bb->preds[i]; r != bb->idom; r=r->idom) {
+                int n = ndf[r->id];
+                if(n && df[r->id][n - 1] == bb) break;
+                add_block(&df[r->id], &ndf[r->id], bb);
+            }
+        }
+    }
+}
+
+// Finds the registers to rename and the blocks defining them.
+static DefSite **find_candidates() {
+    int *ndefs = calloc(norig, sizeof(int));
+    bool *is_global = calloc(norig, sizeof(bool));
+    int *defined = calloc(norig, sizeof(int));
+    DefSite **sites = calloc(norig, sizeof(DefSite *));
+    for(int i=0; i<norig; i++) {
+        defined[i] = -1;
+    }
+
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            for(int i=0; i<ir_num_uses(ir); i++) {
+                Reg *r = ir_use(ir, i);
+                if(r && defined[r->vn] != bb->id) {
+                    is_global[r->vn] = true;
+                }
+            }
+
+            Reg *d = ir->d;
+            if(!d) continue;
+            ndefs[d->vn]++;
+            if(defined[d->vn] != bb->id) {
+                DefSite *s = calloc(1, sizeof(DefSite));
+                s->bb = bb;
+                s->next = sites[d->vn];
+                sites[d->vn] = s;
+            }
+            defined[d->vn] = bb->id;
+        }
+    }
+
+    bool *is_var = calloc(norig, sizeof(bool));
+    for(VarList *vl=fn->locals; vl; vl=vl->next) {
+        Reg *r = vl->var->reg;
+        if(r && r->vn < norig) is_var[r->vn] = true;
+    }
+
+    is_cand = calloc(norig, sizeof(bool));
+    for(int i=0; i<norig; i++) {
+        is_cand[i] = ndefs[i] > 1 || is_var[i];
+    }
+
+    free(ndefs);
+    needs_phi = is_global;
+    free(defined);
+    free(is_var);
+    return sites;
+}
+
+static void insert_phis(DefSite **sites) {
+    // has_phi[id] and queued[id] hold the number plus one of the last
+    // register that got a phi in or was queued for a block.
+    int *has_phi = calloc(nblocks, sizeof(int));
+    int *queued = calloc(nblocks, sizeof(int));
+    BB **work = calloc(nblocks, sizeof(BB *));
+    Reg **regs = calloc(norig, sizeof(Reg *));
+
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        for(IR *ir=bb->first; ir; ir=ir->next) {
+            if(ir->d) regs[ir->d->vn] = ir->d;
+        }
+    }
+
+    for(int vn=0; vn<norig; vn++) {
+        if(!is_cand[vn] || !needs_phi[vn]) continue;
+
+        int len = 0;
+        for(DefSite *s=sites[vn]; s; s=s->next) {
+            queued[s->bb->id] = vn + 1;
+            work[len++] = s->bb;
+        }
+
+        while(len) {
+            BB *x = work[--len];
+            for(int i=0; i<ndf[x->id]; i++) {
+                BB *y = df[x->id][i];
+                if(has_phi[y->id] == vn + 1) continue;
+                has_phi[y->id] = vn + 1;
+
+                IR *phi = new_ir(IR_PHI);
+                phi->d = regs[vn];
+                phi->imm = vn;
+                phi->nargs = y->npreds;
+                phi->args = calloc(y->npreds, sizeof(Reg *));
+                insert_ir(y, y->first, phi);
+                nchanges++;
+
+                if(queued[y->id] != vn + 1) {
+                    queued[y->id] = vn + 1;
+                    work[len++] = y;
+                }
+            }
+        }
+    }
+
+    free(has_phi);
+    free(queued);
+    free(work);
+    free(regs);
+}
+
+// Returns the current definition of a register read before any
+// definition on some path. Such reads are undefined behavior in C, so
+// any value will do.
+static Reg *get_undef() {
+    if(!undef) {
+        IR *ir = new_ir(IR_IMM);
+        ir->d = new_vreg(fn);
+        insert_ir(fn->bbs, fn->bbs->first, ir);
+        undef = ir->d;
+    }
+    return undef;
+}
+
+static Reg *current(int vn) {
+    return cur[vn] ? cur[vn] : get_undef();
+}
+
+// Undo log of the renaming walk
+static int *log_vn;
+static Reg **log_reg;
+static int log_len;
+static int log_cap;
+
+static Reg *define(int vn) {
+    if(log_len == log_cap) {
+        log_cap = log_cap ? log_cap * 2 : 64;
+        log_vn = realloc(log_vn, sizeof(int) * log_cap);
+        log_reg = realloc(log_reg, sizeof(Reg *) * log_cap);
+    }
+    log_vn[log_len] = vn;
+    log_reg[log_len] = cur[vn];
+    log_len++;
+
+    cur[vn] = new_vreg(fn);
+    return cur[vn];
+}
+
+static bool renames(Reg *r) {
+    return r && r->vn < norig && is_cand[r->vn];
+}
+
+static void rename_block(BB *bb) {
+    for(IR *ir=bb->first; ir; ir=ir->next) {
+        if(ir->op == IR_PHI) {
+            ir->d = define(ir->imm);
+            continue;
+        }
+
+        for(int i=0; i<ir_num_uses(ir); i++) {
+            Reg *r = ir_use(ir, i);
+            if(renames(r)) {
+                set_ir_use(ir, i, current(r->vn));
+            }
+        }
+        if(renames(ir->d)) {
+            ir->d = define(ir->d->vn);
+        }
+    }
+
+    for(int i=0; i<num_succs(bb); i++) {
+        BB *s = succ(bb, i);
+        for(IR *phi=s->first; phi && phi->op == IR_PHI; phi=phi->next) {
+            for(int j=0; j<s->npreds; j++) {
+                if(s->preds[j] == bb) {
+                    phi->args[j] = current(phi->imm);
+                }
+            }
+        }
+    }
+}
+
+// Renames definitions in a preorder walk of the dominator tree, undoing
+// a block's definitions once its subtree is done.
+static void rename_regs() {
+    cur = calloc(norig, sizeof(Reg *));
+    log_len = 0;
+
+    BB **stack = calloc(nblocks, sizeof(BB *));
+    int *next = calloc(nblocks, sizeof(int));
+    int *mark = calloc(nblocks, sizeof(int));
+    int len = 0;
+
+    stack[len++] = fn->bbs;
+    mark[fn->bbs->id] = log_len;
+    rename_block(fn->bbs);
+    while(len) {
+        BB *bb = stack[len - 1];
+        if(next[bb->id] < nchildren[bb->id]) {
+            BB *c = children[bb->id][next[bb->id]++];
+            mark[c->id] = log_len;
+            rename_block(c);
+            stack[len++] = c;
+            continue;
+        }
+
+        while(log_len > mark[bb->id]) {
+            log_len--;
+            cur[log_vn[log_len]] = log_reg[log_len];
+        }
+        len--;
+    }
+
+    free(stack);
+    free(next);
+    free(mark);
+    free(cur);
+}
+
+// Returns the number of phis inserted.
+int build_ssa(Function *f) {
+    compute_dominators(f);
+    compute_df();
+
+    norig = fn->nregs;
+    undef = NULL;
+    nchanges = 0;
+    DefSite **sites = find_candidates();
+    insert_phis(sites);
+    rename_regs();
+    free(sites);
+    free(is_cand);
+    free(needs_phi);
+
+    verify_ir(fn, true);
+    return nchanges;
+}
+
+//
+// Destruction
+//
+
+// Returns the block where copies for the edge from pred to bb go. A
+// critical edge, from a block with several successors to one with
+// several predecessors, gets a new block of its own.
+static BB *edge_block(BB *pred, BB *bb) {
+    if(num_succs(pred) < 2) {
+        return pred;
+    }
+
+    BB *e = new_bb();
+    IR *jmp = new_ir(IR_JMP);
+    jmp->then = bb;
+    insert_ir(e, NULL, jmp);
+
+    for(int i=0; i<num_succs(pred); i++) {
+        if(succ(pred, i) == bb) {
+            set_succ(pred, i, e);
+            break;
+        }
+    }
+
+    e->next = pred->next;
+    pred->next = e;
+    return e;
+}
+
+static void copy(BB *bb, Reg *d, Reg *a) {
+    if(d == a) return;
+    IR *ir = new_ir(IR_MOV);
+    ir->d = d;
+    ir->a = a;
+    insert_ir(bb, bb->last, ir);
+    nchanges++;
+}
+
+// Emits the copies of the phis of bb for its i-th predecessor. The
+// copies are parallel, so if a phi reads the result of another phi of
+// the same block, all values are first copied to temporaries.
+static void lower_phis(BB *bb, int i) {
+    BB *at = edge_block(bb->preds[i], bb);
+
+    bool conflict = false;
+    for(IR *phi=bb->first; phi && phi->op == IR_PHI; phi=phi->next) {
+        for(IR *p=bb->first; p && p->op == IR_PHI; p=p->next) {
+            if(p != phi && p->d == phi->args[i]) conflict = true;
+        }
+    }
+
+    if(!conflict) {
+        for(IR *phi=bb->first; phi && phi->op == IR_PHI; phi=phi->next) {
+            copy(at, phi->d, phi->args[i]);
+        }
+        return;
+    }
+
+    int n = 0;
+    for(IR *phi=bb->first; phi && phi->op == IR_PHI; phi=phi->next) {
+        n++;
+    }
+    Reg **tmp = calloc(n, sizeof(Reg *));
+    int j = 0;
+    for(IR *phi=bb->first; phi && phi->op == IR_PHI; phi=phi->next) {
+        tmp[j] = new_vreg(fn);
+        copy(at, tmp[j++], phi->args[i]);
+    }
+    j = 0;
+    for(IR *phi=bb->first; phi && phi->op == IR_PHI; phi=phi->next) {
+        copy(at, phi->d, tmp[j++]);
+    }
+    free(tmp);
+}
+
+// Returns the number of copies emitted.
+int out_of_ssa(Function *f) {
+    fn = f;
+    nchanges = 0;
+    compute_cfg(fn);
+
+    for(BB *bb=fn->bbs; bb; bb=bb->next) {
+        if(!bb->first || bb->first->op != IR_PHI) continue;
+
+        for(int i=0; i<bb->npreds; i++) {
+            lower_phis(bb, i);
+        }
+        while(bb->first->op == IR_PHI) {
+            remove_ir(bb, bb->first);
+        }
+    }
+    return nchanges;
+}
@@ -0,0 +1,163 @@
+#include "chibicc.h"
+
+// Strength reduction of multiplication and division by constants, for
+// both code generators.
+//
+// A multiplication becomes a shift, an lea or both when the constant is
+// a power of two, or 3, 5 or 9 times one. Signed division by 2^k adds a
+// bias of 2^k-1 to negative dividends and shifts; division by any other
+// constant multiplies by a fixed-point reciprocal ("magic number") and
+// keeps the high half of the product, following Granlund and
+// Montgomery. A remainder is computed from the quotient.
+
+// Divisors must fit in 31 bits, so that the remainder can be computed
+// with an immediate operand and the magic number without overflow.
+enum { MAX_DIVISOR = 2147483647 };
+
+// Returns k if val is 2^k, or -1.
+int exact_log2(long val) {
+    if(val <= 0) return -1;
+    int k = 0;
+    while(val % 2 == 0) {
+        val = val / 2;
+        k++;
+    }
+    return val == 1 ? k : -1;
+}
+
+// Returns the smallest l such that 2^l >= val.
+static int ceil_log2(long val) {
+    int l = 0;
+    long p = 1;
+    while(p < val) {
+        p = p * 2;
+        l++;
+    }
+    return l;
+}
+
+// Returns true if emit_mul_imm() can multiply by val.
+bool can_mul_imm(long val) {
+    return val == (int)val;
+}
+
+// Multiplies a register by a constant.
+void emit_mul_imm(FILE *fp, char *reg, long val) {
+    long abs = val < 0 ? -val : val;
+    int k = exact_log2(abs);
+    int scale = 0;
+    if(k < 0) {
+        if(abs % 3 == 0 && exact_log2(abs / 3) >= 0) scale = 2;
+        if(abs % 5 == 0 && exact_log2(abs / 5) >= 0) scale = 4;
+        if(abs % 9 == 0 && exact_log2(abs / 9) >= 0) scale = 8;
+        if(scale) k = exact_log2(abs / (scale + 1));
+    }
+
+    if(val == 0) {
+        fprintf(fp, "  mov %s, 0\n", reg);
+        return;
+    }
+    if(k < 0) {
+        fprintf(fp, "  imul %s, %ld\n", reg, val);
+        return;
+    }
+
+    count_stat("mul-reduced");
+    if(scale) {
+        fprintf(fp, "  lea %s, [%s+%s*%d]\n", reg, reg, reg, scale);
+    }
+    if(k > 0) {
+        fprintf(fp, "  shl %s, %d\n", reg, k);
+    }
+    if(val < 0) {
+        fprintf(fp, "  neg %s\n", reg);
+    }
+}
+
+// Returns true if emit_div_imm() can divide by val.
+bool can_div_imm(long val) {
+    return val != 0 && -MAX_DIVISOR <= val && val <= MAX_DIVISOR;
+}
+
+// Returns the magic number of a divisor d that is not a power of two:
+// 1 + floor(2^(63+l) / d) - 2^64, where 2^(l-1) < d < 2^l.
+//
+// The quotient q lies in [2^63, 2^64), so it is computed bit by bit.
+// With c the complement of its low 63 bits, the magic number is
+// q + 1 - 2^64 = -c.
+static long magic(long d, int l) {
+    long rem = 0;
+    long c = 0;
+    for(int i=63+l; i>=0; i--) {
+        rem = rem * 2 + (i == 63 + l);
+        int bit = 0;
+        if(rem >= d) {
+            rem = rem - d;
+            bit = 1;
+        }
+        if(i < 63) {
+            c = c * 2 + 1 - bit;
+        }
+    }
+    return -c;
+}
+
+// rax = rax / 2^k, rounded toward zero
+static void emit_div_pow2(FILE *fp, int k) {
+    fprintf(fp, "  cqo\n");
+    fprintf(fp, "  shr rdx, %d\n", 64 - k);
+    fprintf(fp, "  add rax, rdx\n");
+    fprintf(fp, "  sar rax, %d\n", k);
+}
+
+// rax = rax / d for 2^(l-1) < d < 2^l
+static void emit_div_magic(FILE *fp, long d) {
+    int l = ceil_log2(d);
+    fprintf(fp, "  movabs rdx, %ld\n", magic(d, l));
+    fprintf(fp, "  imul rdx\n");
+    fprintf(fp, "  add rdx, rcx\n");
+    fprintf(fp, "  sar rdx, %d\n", l - 1);
+    fprintf(fp, "  mov rax, rcx\n");
+    fprintf(fp, "  sar rax, 63\n");
+    fprintf(fp, "  sub rdx, rax\n");
+    fprintf(fp, "  mov rax, rdx\n");
+}
+
+// Computes rax / val, or rax % val if is_mod, in rax. RCX and RDX are
+// clobbered.
+void emit_div_imm(FILE *fp, long val, bool is_mod) {
+    long d = val < 0 ? -val : val;
+    int k = exact_log2(d);
+    count_stat("div-reduced");
+
+    if(d == 1) {
+        if(is_mod) {
+            fprintf(fp, "  mov rax, 0\n");
+        } else if(val < 0) {
+            fprintf(fp, "  neg rax\n");
+        }
+        return;
+    }
+
+    // The dividend is kept in rcx.
+    if(is_mod || k < 0) {
+        fprintf(fp, "  mov rcx, rax\n");
+    }
+    if(k > 0) {
+        emit_div_pow2(fp, k);
+    } else {
+        emit_div_magic(fp, d);
+    }
+
+    // The remainder has the sign of the dividend, so it does not depend
+    // on the sign of the divisor.
+    if(is_mod) {
+        emit_mul_imm(fp, "rax", d);
+        fprintf(fp, "  sub rcx, rax\n");
+        fprintf(fp, "  mov rax, rcx\n");
+        return;
+    }
+    if(val < 0) {
+        fprintf(fp, "  neg rax\n");
+    }
+}
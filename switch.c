@@ -0,0 +1,88 @@
+#include "chibicc.h"
+
+// Chooses how a switch statement dispatches to its cases, for both code
+// generators.
+//
+// Few cases are compared with the value one after another. Otherwise,
+// if the case values are dense enough, the value indexes a jump table
+// after a bounds check; if not, a binary search over the sorted values
+// finds the case in a logarithmic number of compares.
+
+// A jump table is used if at least 2 in 5 of its entries are cases.
+enum {
+    TABLE_CASES = 2,
+    TABLE_ENTRIES = 5,
+};
+
+// Sorts nodes[lo..hi) by value, using tmp as scratch space.
+static void sort_cases(Node **nodes, Node **tmp, int lo, int hi) {
+    if(hi - lo < 2) return;
+    int mid = (lo + hi) / 2;
+    sort_cases(nodes, tmp, lo, mid);
+    sort_cases(nodes, tmp, mid, hi);
+
+    int i = lo;
+    int j = mid;
+    int k = lo;
+    while(i < mid || j < hi) {
+        if(j == hi || (i < mid && nodes[i]->val <= nodes[j]->val)) {
+            tmp[k++] = nodes[i++];
+        } else {
+            tmp[k++] = nodes[j++];
+        }
+    }
+    for(k=lo; k<hi; k++) {
+        nodes[k] = tmp[k];
+    }
+}
+
+static void build_table(SwitchPlan *plan) {
+    long min = plan->cases[0]->val;
+    plan->ntable = plan->cases[plan->ncases - 1]->val - min + 1;
+    plan->table = calloc(plan->ntable, sizeof(Node *));
+    for(int i=0; i<plan->ncases; i++) {
+        plan->table[plan->cases[i]->val - min] = plan->cases[i];
+    }
+}
+
+SwitchPlan *plan_switch(Node *node) {
+    SwitchPlan *plan = calloc(1, sizeof(SwitchPlan));
+    for(Node *n=node->case_next; n; n=n->case_next) {
+        plan->ncases++;
+    }
+
+    plan->cases = calloc(plan->ncases, sizeof(Node *));
+    int i = 0;
+    for(Node *n=node->case_next; n; n=n->case_next) {
+        plan->cases[i++] = n;
+    }
+
+    Node **tmp = calloc(plan->ncases, sizeof(Node *));
+    sort_cases(plan->cases, tmp, 0, plan->ncases);
+    free(tmp);
+    for(i=1; i<plan->ncases; i++) {
+        if(plan->cases[i]->val == plan->cases[i - 1]->val) {
+            error_tok(plan->cases[i]->tok, "duplicate case value");
+        }
+    }
+
+    plan->kind = SW_LINEAR;
+    if(!is_mode_enabled("switch-lowering")) {
+        return plan;
+    }
+    if(plan->ncases < SWITCH_MIN_CASES) {
+        count_stat("switch-linear");
+        return plan;
+    }
+
+    long range = plan->cases[plan->ncases - 1]->val - plan->cases[0]->val + 1;
+    if(range * TABLE_CASES <= plan->ncases * TABLE_ENTRIES) {
+        plan->kind = SW_TABLE;
+        build_table(plan);
+        count_stat("switch-table");
+    } else {
+        plan->kind = SW_BSEARCH;
+        count_stat("switch-bsearch");
+    }
+    return plan;
+}
@@ -0,0 +1,242 @@
+#include "chibicc.h"
+
+// Turns self-recursive tail calls into loops on the AST, so that both
+// code generators run them in constant stack space.
+//
+// A call of the function to itself is in tail position if it is the
+// value of a return statement, or if it is the last statement of a void
+// function. It becomes assignments of the arguments to the parameters
+// and a jump back to the start of the body:
+//
+//   return f(x, y);  =>  { t = x; b = y; a = t; goto tailrec.N; }
+//
+// An argument is assigned to its parameter directly unless a later
+// argument reads that parameter, in which case it goes through a
+// temporary. An argument equal to its own parameter is not assigned.
+//
+// The locals of all calls share one frame in the loop, which is only
+// correct if no pointer into the frame may outlive a call. Functions
+// that take the address of a local or have a local array or struct are
+// left alone, as are variadic ones.
+
+static Function *fn;
+static char *label; // at the start of the body, or NULL if not made yet
+static int nlabels;
+static int ncalls;
+static NodeStack walk;
+
+// Returns the statement `var = expr;`.
+static Node *new_store(Var *var, Node *expr) {
+    Node *node = new_binary(ND_ASSIGN, new_var_node(var, expr->tok), expr, expr->tok);
+    add_type(node);
+    return new_unary(ND_EXPR_STMT, node, expr->tok);
+}
+
+// Returns why the frame of a function may not be reused by a call in
+// tail position, or NULL if it may. The code generators use this for
+// calls of other functions too.
+char *check_frame_reuse(Function *f) {
+    if(f->has_varargs) return "variadic";
+    for(VarList *vl=f->locals; vl; vl=vl->next) {
+        Type *ty = vl->var->ty;
+        if(!is_integer(ty) && ty->kind != TY_PTR) return "has a local array or struct";
+    }
+
+    char *reason = NULL;
+    for(Node *node=f->node; node; node=node->next) {
+        push_node(&walk, node);
+    }
+    while(walk.len) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_ADDR && node->lhs->kind == ND_VAR && node->lhs->var->is_local) {
+            reason = "takes the address of a local";
+        }
+        push_children(&walk, node);
+    }
+    return reason;
+}
+
+static bool is_self_call(Node *node) {
+    if(!node || node->kind != ND_FUNCALL || strcmp(node->funcname, fn->name)) return false;
+
+    Node *arg = node->args;
+    for(VarList *vl=fn->params; vl; vl=vl->next) {
+        if(!arg) return false;
+        arg = arg->next;
+    }
+    return !arg;
+}
+
+// Returns true if an expression reads a variable.
+static bool reads_var(Node *expr, Var *var) {
+    bool found = false;
+    int base = walk.len;
+    push_node(&walk, expr);
+    while(walk.len > base) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_VAR && node->var == var) found = true;
+        push_children(&walk, node);
+    }
+    return found;
+}
+
+// Returns the statements replacing a tail call.
+static Node *rewrite_call(Node *call) {
+    if(!label) {
+        label = calloc(1, 20);
+        sprintf(label, "tailrec.%d", nlabels++);
+    }
+
+    int nparams = 0;
+    for(VarList *vl=fn->params; vl; vl=vl->next) {
+        nparams++;
+    }
+    Node **args = calloc(nparams, sizeof(Node *));
+    Var **params = calloc(nparams, sizeof(Var *));
+    Var **temps = calloc(nparams, sizeof(Var *));
+    Node *arg = call->args;
+    VarList *vl = fn->params;
+    for(int i=0; i<nparams; i++) {
+        args[i] = arg;
+        params[i] = vl->var;
+        arg = arg->next;
+        vl = vl->next;
+    }
+
+    Node head = {};
+    Node *cur = &head;
+    for(int i=0; i<nparams; i++) {
+        Node *a = args[i];
+        a->next = NULL;
+        if(a->kind == ND_VAR && a->var == params[i]) continue;
+
+        Var *dest = params[i];
+        for(int j=i+1; j<nparams; j++) {
+            if(reads_var(args[j], params[i])) {
+                temps[i] = new_local(fn, "tmp", params[i]->ty);
+                dest = temps[i];
+                break;
+            }
+        }
+        cur = cur->next = new_store(dest, a);
+    }
+    for(int i=0; i<nparams; i++) {
+        if(temps[i]) {
+            cur = cur->next = new_store(params[i], new_var_node(temps[i], call->tok));
+        }
+    }
+
+    Node *jmp = new_node(ND_GOTO, call->tok);
+    jmp->label_name = label;
+    cur->next = jmp;
+
+    Node *block = new_node(ND_BLOCK, call->tok);
+    block->body = head.next;
+    free(args);
+    free(params);
+    free(temps);
+
+    if(is_remark_enabled("tail-recursion", false)) {
+        warn_tok(call->tok, "tail call of %s turned into a loop", fn->name);
+    }
+    ncalls++;
+    return block;
+}
+
+// Rewrites the tail calls in a list of statements. is_last is true if
+// nothing runs after the list but the return from the function.
+static void rewrite_list(Node **slot, bool is_last) {
+    for(; *slot; slot=&(*slot)->next) {
+        Node *node = *slot;
+        bool is_tail = is_last && !node->next;
+        switch(node->kind) {
+            case ND_RETURN:
+                if(is_self_call(node->lhs)) {
+                    Node *block = rewrite_call(node->lhs);
+                    block->next = node->next;
+                    *slot = block;
+                }
+                break;
+            case ND_EXPR_STMT:
+                // The call has the return type of the function.
+                if(is_tail && is_self_call(node->lhs) && node->lhs->ty->kind == TY_VOID) {
+                    Node *block = rewrite_call(node->lhs);
+                    block->next = node->next;
+                    *slot = block;
+                }
+                break;
+            case ND_BLOCK:
+                rewrite_list(&node->body, is_tail);
+                break;
+            case ND_IF:
+                rewrite_list(&node->then, is_tail);
+                rewrite_list(&node->els, is_tail);
+                break;
+            case ND_WHILE:
+            case ND_FOR:
+            case ND_DO:
+            case ND_SWITCH:
+                rewrite_list(&node->then, false);
+                break;
+            case ND_LABEL:
+            case ND_CASE:
+                rewrite_list(&node->lhs, is_tail && node->kind == ND_LABEL);
+                break;
+        }
+    }
+}
+
+// Returns true if a list of statements has a self-recursive tail call.
+static bool has_tail_call(Node *node) {
+    for(; node; node=node->next) {
+        switch(node->kind) {
+            case ND_RETURN:
+                if(is_self_call(node->lhs)) return true;
+                break;
+            case ND_BLOCK:
+                if(has_tail_call(node->body)) return true;
+                break;
+            case ND_IF:
+                if(has_tail_call(node->then) || has_tail_call(node->els)) return true;
+                break;
+            case ND_WHILE:
+            case ND_FOR:
+            case ND_DO:
+            case ND_SWITCH:
+                if(has_tail_call(node->then)) return true;
+                break;
+            case ND_LABEL:
+            case ND_CASE:
+                if(has_tail_call(node->lhs)) return true;
+                break;
+        }
+    }
+    return false;
+}
+
+// Turns the self-recursive tail calls of a function into jumps. Returns
+// the number of calls turned.
+int eliminate_tail_calls(Function *f) {
+    fn = f;
+    label = NULL;
+    ncalls = 0;
+
+    char *reason = check_frame_reuse(fn);
+    if(reason) {
+        if(is_remark_enabled("tail-recursion", true) && has_tail_call(fn->node)) {
+            warn_tok(fn->node->tok, "tail calls of %s not turned into a loop: %s", fn->name, reason);
+        }
+        return 0;
+    }
+
+    rewrite_list(&fn->node, true);
+    if(!ncalls) return 0;
+
+    Node *start = new_node(ND_LABEL, fn->node->tok);
+    start->label_name = label;
+    start->lhs = new_node(ND_NULL, fn->node->tok);
+    start->next = fn->node;
+    fn->node = start;
+    assign_offsets(fn);
+    return ncalls;
+}
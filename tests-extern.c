@@ -8,6 +8,10 @@ int false_fn() { return 512; }
 int true_fn() { return 513; }
 int static_fn() { return 5; }
 
+// RSP is 16-byte aligned at a call, so the frame pointer of the callee
+// is too.
+int is_stack_aligned() { return ((long)__builtin_frame_address(0) & 15) == 0; }
+
 int add_all1(int x, ...) {
     va_list ap;
     va_start(ap, x);
@@ -39,6 +39,10 @@ int g24=3;
 int *g25=&g24;
 int g26[3] = {1, 2, 3};
 int *g27 = g26 + 1;
+long g28[4] = {1, 0, 0, -1};
+char g29[20] = {'a', 'b', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5};
+struct {char a[6]; char *p; int n;} g30 = {"ab", g17+1, 7};
+short g31[3] = {-2, 300};
 
 typedef struct Tree {
   int val;
@@ -78,10 +82,91 @@ int ret3() {
     return 5;
 }
 
+int ret_in_expr() {
+    return 1 + (2 * ({ return 5; 3; }));
+}
+
 int add2(int x, int y) {
     return x + y;
 }
 
+int gcd(int a, int b) {
+    if (b == 0)
+        return a;
+    return gcd(b, a % b);
+}
+
+long sum_to(int n, long acc) {
+    if (n == 0) return acc;
+    return sum_to(n - 1, acc + n);
+}
+
+void add_down(int *p, int n) {
+    if (n == 0) return;
+    *p = *p + n;
+    add_down(p, n - 1);
+}
+
+long sum_squares(int n) {
+    long s = 0;
+#pragma GCC unroll 4
+    for (int i = 0; i < n; i++)
+        s = s + i * i;
+    return s;
+}
+
+int sum_odd_to(int n) {
+    int s = 0;
+#pragma GCC unroll 3
+    for (int i = 1; i <= n; i += 2)
+        s = s * 2 + i;
+    return s;
+}
+
+int sum_ints(int *a, int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        s += a[i];
+    return s;
+}
+
+int count_chars(char *p, int n, char c) {
+    int k = 0;
+    for (int i = 0; i < n; i++)
+        if (p[i] == c) k++;
+    return k;
+}
+
+void add_ints(int *d, int *a, int *b, int n) {
+    for (int i = 0; i < n; i++)
+        d[i] = a[i] + b[i];
+}
+
+int is_even(int n);
+int is_odd(int n) { if (n == 0) return 0; return is_even(n - 1); }
+int is_even(int n) { if (n == 0) return 1; return is_odd(n - 1); }
+
+int bump_g1() {
+    g1++;
+    return 0;
+}
+
+int fib_sum(char c, int n) {
+    int a=0;
+    int b=1;
+    long s=0;
+    int u=0;
+    for (int i=0; i<n; i++) {
+        int t=a+b;
+        a=b;
+        b=t;
+        s+=add2(a, i);
+        u++;
+        c++;
+    }
+    return s + u + c;
+}
+
 int sub2(int x, int y) {
     return x - y;
 }
@@ -115,9 +200,22 @@ int fib(int x) {
     return fib(x-1) + fib(x-2);
 }
 
+// Keeps more values live across calls than there are registers.
+int many_live(int x) {
+    int a=x+1; int b=x+2; int c=x+3; int d=x+4; int e=x+5;
+    int f=x+6; int g=x+7; int h=x+8; int i=x+9;
+    int y = add2(a, b) + sub2(c, d) + add6(a, b, c, d, e, f);
+    return a*1 + b*2 + c*3 + d*4 + e*5 + f*6 + g*7 + h*8 + i*9 + y;
+}
+
 void ret_none() { return; }
 
 static int static_fn() { return 3; }
+static int static_max(int x, int y) { if(x > y) return x; return y; }
+static int static_sum(int n) { int s=0; for(int i=1; i<=n; i++) s=s+i; return s; }
+static int static_twice(int x) { return static_max(x, 0) * 2; }
+static int static_fib(int n) { return n < 2 ? n : static_fib(n-1) + static_fib(n-2); }
+static void static_clamp(int *p) { if(*p < 0) { *p=0; return; } *p=*p*2; }
 int param_decay(int x[]) { return x[0]; }
 
 void voidfn(void) {}
@@ -133,6 +231,7 @@ _Bool false_fn();
 
 int add_all1(int x, ...);
 int add_all3(int z, int b, int c, ...);
+int is_stack_aligned();
 
 int main() {
     assert(8, ({ int a=3; int z=5; a+z; }), "int a=3; int z=5; a+z;");
@@ -143,6 +242,13 @@ int main() {
     assert(41, 12 + 34 - 5, " 12 + 34 - 5 ");
     assert(15, 5*(9-6), "5*(9-6)");
     assert(4, (3+5)/2, "(3+5)/2");
+    assert(2, 17%5, "17%5");
+    assert(-2, -17%5, "-17%5");
+    assert(-4, ({ int x=-17; x/4; }), "int x=-17; x/4;");
+    assert(-1, ({ int x=-17; x%4; }), "int x=-17; x%4;");
+    assert(14, ({ int x=100; x/7; }), "int x=100; x/7;");
+    assert(-2, ({ int x=-100; x%-7; }), "int x=-100; x%-7;");
+    assert(90, ({ int x=9; x*10; }), "int x=9; x*10;");
     assert(-10, -10, "-10");
     assert(10, - -10, "- -10");
     assert(10, - - +10, "- - +10");
@@ -175,6 +281,7 @@ int main() {
     assert(8, ({ int foo123=3; int bar=5; foo123+bar; }), "int foo123=3; int bar=5; foo123+bar;");
 
     assert(3, ret3(), "ret3();");
+    assert(5, ret_in_expr(), "ret_in_expr();");
 
     assert(3, ({ int x=0; if (0) x=2; else x=3; x; }), "int x=0; if (0) x=2; else x=3; x;");
     assert(3, ({ int x=0; if (1-1) x=2; else x=3; x; }), "int x=0; if (1-1) x=2; else x=3; x;");
@@ -190,6 +297,7 @@ int main() {
     assert(2, sub2(5, 3), "sub(5, 3)");
     assert(21, add6(1,2,3,4,5,6), "add6(1,2,3,4,5,6)");
     assert(55, fib(9), "fib(9)");
+    assert(361, many_live(1), "many_live(1)");
 
     assert(3, ({ int x=3; *&x; }), "int x=3; *&x;");
     assert(3, ({ int x=3; int *y=&x; int **z=&y; **z; }), "int x=3; int *y=&x; int **z=&y; **z;");
@@ -344,6 +452,11 @@ int main() {
     assert(8, ({ int (*x)[3]; sizeof(x); }), "int (*x)[3]; sizeof(x);");
     assert(3, ({ int *x[3]; int y; x[0]=&y; y=3; x[0][0]; }), "int *x[3]; int y; x[0]=&y; y=3; x[0][0];");
     assert(4, ({ int x[3]; int (*y)[3]=x; y[0][0]=4; y[0][0]; }), "int x[3]; int (*y)[3]=x; y[0][0]=4; y[0][0];");
+    assert(12, ({ int (*x)[3]; sizeof(*x); }), "int (*x)[3]; sizeof(*x);");
+    assert(48, ({ int (*x[2])[3]; sizeof(x) + sizeof(*x[0]) * 2 + 8; }), "int (*x[2])[3]; sizeof(x) + sizeof(*x[0]) * 2 + 8;");
+    assert(20, ({ int ((((((((((((((((((((((((((((((((*x))))))))))))))))))))))))))))))))[3]; sizeof(*x) + sizeof(int ((((((((((((((((((((((((((((((((*))))))))))))))))))))))))))))))))[5]); }), "int ((((((((((((((((((((((((((((((((*x))))))))))))))))))))))))))))))))[3]; sizeof(*x) + sizeof(int ((((((((((((((((((((((((((((((((*))))))))))))))))))))))))))))))))[5]);");
+    assert(12, ({ int x[4]; int y[] = {1, 2, 3}; sizeof(y); }), "int x[4]; int y[] = {1, 2, 3}; sizeof(y);");
+    assert(16, ({ int y[] = {1, 2, 3}; int x[4]; sizeof(x); }), "int y[] = {1, 2, 3}; int x[4]; sizeof(x);");
 
     assert(3, *g1_ptr(), "*g1_ptr()");
 
@@ -411,8 +524,51 @@ int main() {
 
     assert(55, ({ int j=0; for (int i=0; i<=10; i=i+1) j=j+i; j; }), "int j=0; for (int i=0; i<=10; i=i+1) j=j+i; j;");
     assert(3, ({ int i=3; int j=0; for (int i=0; i<=10; i=i+1) j=j+i; i; }), "int i=3; int j=0; for (int i=0; i<=10; i=i+1) j=j+i; i;");
+    assert(105, ({ int k=5; int s=0; for (int i=0; i<3; i++) s=s+k*7; s; }), "int k=5; int s=0; for (int i=0; i<3; i++) s=s+k*7; s;");
+    assert(3, ({ g1=0; int s=0; for (int i=0; i<3; i++) { s=s+g1; g1=g1+1; } s; }), "g1=0; int s=0; for (int i=0; i<3; i++) { s=s+g1; g1=g1+1; } s;");
+    assert(12, ({ int x[4]; int *q=x; int s=0; for (int i=0; i<4; i++) { x[i]=i; s=s+q[i]*2; } s; }), "int x[4]; int *q=x; int s=0; for (int i=0; i<4; i++) { x[i]=i; s=s+q[i]*2; } s;");
+    assert(0, ({ int *q=0; int s=0; for (int i=0; i<0; i++) s=s+*q; s; }), "int *q=0; int s=0; for (int i=0; i<0; i++) s=s+*q; s;");
+    assert(-127, ({ char c=127; c++; c++; c; }), "char c=127; c++; c++; c;");
+    assert(1, ({ _Bool b=0; b=b+2; b=b+2; b; }), "_Bool b=0; b=b+2; b=b+2; b;");
+    assert(78, fib_sum(126, 10), "fib_sum(126, 10)");
+    assert(6, ({ int a[2]; a[0]=1; int x=a[0]; a[0]=5; x+a[0]; }), "int a[2]; a[0]=1; int x=a[0]; a[0]=5; x+a[0];");
+    assert(11, ({ int x=3; int *p=&x; int y=*p; *p=4; y+*p+x; }), "int x=3; int *p=&x; int y=*p; *p=4; y+*p+x;");
+    assert(23, ({ g1=2; int x=g1; bump_g1(); x*10+g1; }), "g1=2; int x=g1; bump_g1(); x*10+g1;");
+    assert(8, ({ int a[3][3]; int i=1; a[i][i+1]=3; a[i][i]=5; a[i][i+1]+a[i][i]; }), "int a[3][3]; int i=1; a[i][i+1]=3; a[i][i]=5; a[i][i+1]+a[i][i];");
+    assert(44, ({ char a[2]; a[0]=300; a[0]; }), "char a[2]; a[0]=300; a[0];");
+    assert(7, ({ int a[3]={1}; a[1]=2; a[2]=4; a[0]+a[1]+a[2]; }), "int a[3]={1}; a[1]=2; a[2]=4; a[0]+a[1]+a[2];");
+    assert(5, ({ int a[2]={1,2}; int *p=a+1; *p=5; a[1]; }), "int a[2]={1,2}; int *p=a+1; *p=5; a[1];");
+    assert(55, ({ int a[2]={0}; add_down(a, 10); a[0]; }), "int a[2]={0}; add_down(a, 10); a[0];");
+    assert(0, sum_squares(0), "sum_squares(0)");
+    assert(14, sum_squares(4), "sum_squares(4)");
+    assert(204, sum_squares(9), "sum_squares(9)");
+    assert(83, sum_odd_to(9), "sum_odd_to(9)");
+    assert(367, sum_odd_to(14), "sum_odd_to(14)");
+    assert(63, ({ int a[6];
+#pragma GCC unroll 8
+        for (int i=0; i<6; i++) a[i]=1<<i; a[0]+a[1]+a[2]+a[3]+a[4]+a[5]; }), "int a[6]; for (int i=0; i<6; i++) a[i]=1<<i; ...");
+    assert(190, ({ int a[20]; for (int i=0; i<20; i++) a[i]=i; sum_ints(a, 20); }), "int a[20]; for (int i=0; i<20; i++) a[i]=i; sum_ints(a, 20);");
+    assert(-6, ({ int a[3]={-1,-2,-3}; sum_ints(a, 3); }), "int a[3]={-1,-2,-3}; sum_ints(a, 3);");
+    assert(15, ({ char s[45]; for (int i=0; i<45; i++) s[i]=i%3; count_chars(s, 45, 2); }), "char s[45]; for (int i=0; i<45; i++) s[i]=i%3; count_chars(s, 45, 2);");
+    assert(27, ({ long a[9]; for (int i=0; i<9; i++) a[i]=3; a[0]+a[1]+a[2]+a[3]+a[4]+a[5]+a[6]+a[7]+a[8]; }), "long a[9]; for (int i=0; i<9; i++) a[i]=3; ...");
+    assert(58, ({ int a[19]; int b[19]; for (int i=0; i<19; i++) { a[i]=i; b[i]=1; } add_ints(a, a, b, 19); a[0]+a[18]+a[9]*2+a[17]; }), "int a[19]; int b[19]; ... add_ints(a, a, b, 19); a[0]+a[18]+a[9]*2+a[17];");
+    assert(18, ({ int a[18]; int b[18]; for (int i=0; i<18; i++) a[i]=b[i]=1; add_ints(a+1, a, b, 17); a[17]; }), "int a[18]; int b[18]; for (int i=0; i<18; i++) a[i]=b[i]=1; add_ints(a+1, a, b, 17); a[17];");
+    assert(6, gcd(48, 18), "gcd(48, 18)");
+    assert(50005000, sum_to(10000, 0), "sum_to(10000, 0)");
+    assert(55, ({ int x=0; add_down(&x, 10); x; }), "int x=0; add_down(&x, 10); x;");
+    assert(1, is_even(1000), "is_even(1000)");
+    assert(1, is_odd(77), "is_odd(77)");
 
     assert(3, static_fn(), "static_fn()");
+    assert(7, static_max(3, 7), "static_max(3, 7)");
+    assert(3, static_max(3, -7), "static_max(3, -7)");
+    assert(10, static_max(static_max(1, 10), static_max(2, 5)), "static_max(static_max(1, 10), static_max(2, 5))");
+    assert(55, static_sum(10), "static_sum(10)");
+    assert(8, static_twice(4), "static_twice(4)");
+    assert(0, static_twice(-4), "static_twice(-4)");
+    assert(55, static_fib(10), "static_fib(10)");
+    assert(0, ({ int x=-3; static_clamp(&x); x; }), "int x=-3; static_clamp(&x); x;");
+    assert(6, ({ int x=3; static_clamp(&x); x; }), "int x=3; static_clamp(&x); x;");
     assert(3, (1,2,3), "(1,2,3)");
 
     assert(3, ({ int i=2; ++i; }), "int i=2; ++i;");
@@ -438,6 +594,7 @@ int main() {
     assert(6, ({ int i=3; i*=2; }), "int i=3; i*=2;");
     assert(3, ({ int i=6; i/=2; i; }), "int i=6; i/=2; i;");
     assert(3, ({ int i=6; i/=2; }), "int i=6; i/=2;");
+    assert(2, ({ int i=10; i%=4; i; }), "int i=10; i%=4; i;");
 
     assert(511, 0777, "0777");
     assert(0, 0x0, "0x0");
@@ -478,6 +635,16 @@ int main() {
     assert(0, 0&&1, "0&&1");
     assert(0, (2-2)&&5, "(2-2)&&5");
     assert(1, 1&&5, "1&&5");
+    assert(1, 1&&2&&3&&4, "1&&2&&3&&4");
+    assert(0, 1&&2&&0&&4, "1&&2&&0&&4");
+    assert(1, 0||0||0||4, "0||0||0||4");
+    assert(3, ({ int a=1; int b=2; int x=0; if (a<b && !(b<=a) && a!=b) x=3; x; }), "int a=1; int b=2; int x=0; if (a<b && !(b<=a) && a!=b) x=3; x;");
+    assert(2, ({ int a=1; int b=2; int x=0; if (!(a<b || b==2)) x=1; else x=2; x; }), "int a=1; int b=2; int x=0; if (!(a<b || b==2)) x=1; else x=2; x;");
+    assert(4, ({ int i=0; while (i<10 && !(i==4)) i++; i; }), "int i=0; while (i<10 && !(i==4)) i++; i;");
+    assert(6, ({ int i=0; do i++; while (i==1 || i<6); i; }), "int i=0; do i++; while (i==1 || i<6); i;");
+    assert(7, ({ int a=3; a>=3 && a<5 ? 7 : 8; }), "int a=3; a>=3 && a<5 ? 7 : 8;");
+    assert(1, ({ int a=3; (a>2 || a<0) && a!=4; }), "int a=3; (a>2 || a<0) && a!=4;");
+    assert(5, ({ int a=1; a+a+a+a*2-a+a; }), "int a=1; a+a+a+a*2-a+a;");
 
     assert(3, ({ int x[2]; x[0]=3; param_decay(x); }), "int x[2]; x[0]=3; param_decay(x);");
 
@@ -509,6 +676,10 @@ int main() {
     assert(7, ({ int i=0; switch(1) { case 0:i=5;break; default:i=7; } i; }), "int i=0; switch(1) { case 0:i=5;break; default:i=7; } i;");
     assert(2, ({ int i=0; switch(1) { case 0: 0; case 1: 0; case 2: 0; i=2; } i; }), "int i=0; switch(1) { case 0: 0; case 1: 0; case 2: 0; i=2; } i;");
     assert(0, ({ int i=0; switch(3) { case 0: 0; case 1: 0; case 2: 0; i=2; } i; }), "int i=0; switch(3) { case 0: 0; case 1: 0; case 2: 0; i=2; } i;");
+    assert(4, ({ int x=3; int i=0; switch(x) { case 1:i=1;break; case 2:i=2;break; case 3:i=4;break; case 4:i=8;break; case 6:i=9;break; } i; }), "int x=3; int i=0; switch(x) { case 1:i=1;break; case 2:i=2;break; case 3:i=4;break; case 4:i=8;break; case 6:i=9;break; } i;");
+    assert(7, ({ int x=9; int i=0; switch(x) { case 1:i=1;break; case 2:i=2;break; case 3:i=4;break; case 4:i=8;break; default:i=7; } i; }), "int x=9; int i=0; switch(x) { case 1:i=1;break; case 2:i=2;break; case 3:i=4;break; case 4:i=8;break; default:i=7; } i;");
+    assert(3, ({ int x=-50; int i=0; switch(x) { case -50: i++; case 9: i++; case 700: i++; break; case 8000: i=9; case 90000: i=8; } i; }), "int x=-50; int i=0; switch(x) { case -50: i++; case 9: i++; case 700: i++; break; case 8000: i=9; case 90000: i=8; } i;");
+    assert(0, ({ int x=701; int i=0; switch(x) { case -50: i=1; case 9: i=2; case 700: i=3; case 8000: i=4; case 90000: i=5; } i; }), "int x=701; int i=0; switch(x) { case -50: i=1; case 9: i=2; case 700: i=3; case 8000: i=4; case 90000: i=5; } i;");
 
     voidfn();
 
@@ -527,6 +698,24 @@ int main() {
 
     assert(2, 0?1:2, "0?1:2");
     assert(1, 1?1:2, "0?1:2");
+    assert(3, ({ int i=0; goto k; if(0) { k: i=3; } i; }), "int i=0; goto k; if(0) { k: i=3; } i;");
+    assert(4, ({ int i=0; goto m; i=1; l: i=2; m: i=i+4; i; }), "int i=0; goto m; i=1; l: i=2; m: i=i+4; i;");
+    assert(3, ({ int i=0; for (i=3; 0; i++) i=7; while (0) i=8; i; }), "int i=0; for (i=3; 0; i++) i=7; while (0) i=8; i;");
+    assert(5, ({ int i=0; for (;;) { i=5; break; i=6; } i; }), "int i=0; for (;;) { i=5; break; i=6; } i;");
+    assert(2, ({ int i=0; switch (1) { case 0: i=1; break; i=9; case 1: i=2; } i; }), "int i=0; switch (1) { case 0: i=1; break; i=9; case 1: i=2; } i;");
+    assert(4, ({ int i=0; switch(1) { case 0: if(0) { case 1: i=4; } } i; }), "int i=0; switch(1) { case 0: if(0) { case 1: i=4; } } i;");
+    assert(1, ({ int x=5; (x && 1) + (0 || x) - 1; }), "int x=5; (x && 1) + (0 || x) - 1;");
+    assert(7, ({ int x=7; x*1+0; }), "int x=7; x*1+0;");
+    assert(44, (char)300+0, "(char)300+0");
+    assert(7, ({ long w=3; w=w+65536*65536; (w>>30)+w-(w>>32<<32); }), "long w=3; w=w+65536*65536; (w>>30)+w-(w>>32<<32);");
+    assert(1, ({ long w=7; w=(w+65536*65536)&65536*65536*3; w>>32; }), "long w=7; w=(w+65536*65536)&65536*65536*3; w>>32;");
+    assert(-80, (-10)<<3, "(-10)<<3");
+    assert(0, 65536*65536*65536*65536, "65536*65536*65536*65536");
+
+    assert(8, ({ int a=2; int b=3; a + (b ? b*2 : 0) + (a < b) * (b <= a); }), "int a=2; int b=3; a + (b ? b*2 : 0) + (a < b) * (b <= a);");
+    assert(26, ({ int a=2; int b=3; a * (b + add2(a, sub2(b, a+1))) * (a || b) + add6(a, b, 1, 2, 3, a*b) * 0 + 16; }), "int a=2; int b=3; a * (b + add2(a, sub2(b, a+1))) * (a || b) + add6(a, b, 1, 2, 3, a*b) * 0 + 16;");
+    assert(5, ({ int x[3]={1,2,3}; int *p=x; *++p += *(p+1); p[0]; }), "int x[3]={1,2,3}; int *p=x; *++p += *(p+1); p[0];");
+    assert(1, ({ _Bool b; int i=2; (b=i) + 0; }), "_Bool b; int i=2; (b=i) + 0;");
 
     assert(10, ({ enum { ten=1+2+3+4, }; ten; }), "enum { ten=1+2+3+4, }; ten;");
     assert(1, ({ int i=0; switch(3) { case 5-2+0*3: i++; } i; }), "int i=0; switch(3) { case 5-2+0*3: i++; ); i;");
@@ -645,6 +834,16 @@ int main() {
     assert(3, g24, "g24");
     assert(3, *g25, "*g25");
     assert(2, *g27, "*g27");
+    assert(-1, g28[3], "g28[3]");
+    assert(0, g28[1] + g28[2], "g28[1] + g28[2]");
+    assert(98, g29[1], "g29[1]");
+    assert(5, g29[12], "g29[12]");
+    assert(0, g29[19], "g29[19]");
+    assert(0, strcmp(g30.a, "ab"), "strcmp(g30.a, \"ab\")");
+    assert(111, *g30.p, "*g30.p");
+    assert(7, g30.n, "g30.n");
+    assert(-2, g31[0], "g31[0]");
+    assert(300, g31[1], "g31[1]");
 
     ext1 = 5;
     assert(5, ext1, "ext1");
@@ -694,6 +893,11 @@ int main() {
 
     assert(6, add_all1(1,2,3,0), "add_all1(1,2,3,0)");
     assert(5, add_all1(1,2,3,-1,0), "add_all1(1,2,3,-1,0)");
+    assert(1, is_stack_aligned(), "is_stack_aligned()");
+    assert(2, 1+is_stack_aligned(), "1+is_stack_aligned()");
+    assert(3, 1+(1+is_stack_aligned()), "1+(1+is_stack_aligned())");
+    assert(1, ret3() ? is_stack_aligned() : 0, "ret3() ? is_stack_aligned() : 0");
+    assert(1, ret3() && is_stack_aligned(), "ret3() && is_stack_aligned()");
 
     assert(6, add_all3(1,2,3,0), "add_all3(1,2,3,0)");
     assert(5, add_all3(1,2,3,-1,0), "add_all3(1,2,3,-1,0)");
@@ -111,7 +111,7 @@ static char *starts_with_reserved(char *p) {
     // Multi letter punctuator
     static char *ops[] = {"<<=", ">>=", "...", "==", "!=", "<=", ">=", 
                           "->", "++", "--", "<<", ">>", "+=", "-=", "*=", 
-                          "/=", "&&", "||", "&=", "|=", "^="};
+                          "/=", "%=", "&&", "||", "&=", "|=", "^="};
 
     for(int i=0; i<sizeof(ops) / sizeof(*ops); i++) {
         if(startswitch(p, ops[i])) {
@@ -235,6 +235,38 @@ static Token *read_int_literal(Token *cur, char *start) {
     return tok;
 }
 
+// Skips a word and the blanks after it. Returns NULL if p does not
+// start with the word.
+static char *skip_word(char *p, char *word) {
+    if(!startswitch(p, word) || is_alnum(p[strlen(word)])) return NULL;
+    p += strlen(word);
+    while(*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+// Reads a #pragma line. `#pragma GCC unroll N` becomes a token for the
+// loop after it; other pragmas are ignored. Returns the end of the line.
+static char *read_pragma(Token **cur, char *start) {
+    char *end = start;
+    while(*end != '\n') {
+        end++;
+    }
+
+    char *p = skip_word(start + 1, "pragma");
+    if(p) p = skip_word(p, "GCC");
+    if(p) p = skip_word(p, "unroll");
+    if(!p) return end;
+
+    if(!isdigit(*p)) {
+        error_at(p, "expected an unroll factor");
+    }
+    *cur = new_token(TK_PRAGMA, *cur, start, end - start);
+    (*cur)->val = strtol(p, &p, 10);
+    return end;
+}
+
 // 入力文字列pをトークナイズしてそれを返す
 Token *tokenize() {
 	char *p = user_input;
@@ -268,6 +300,11 @@ Token *tokenize() {
             continue;
         }
 
+        if(startswitch(p, "#pragma")) {
+            p = read_pragma(&cur, p);
+            continue;
+        }
+
         // String literal
         if(*p == '"') {
             cur = read_string_literal(cur, p);
@@ -303,7 +340,7 @@ Token *tokenize() {
 
 		// Single-letter punctuator
 		// if(ispunct(*p)) {
-		if (strchr("+-*/()<>;={}[],*&.!~|^:?", *p)) {
+		if (strchr("+-*/%()<>;={}[],*&.!~|^:?", *p)) {
 			cur = new_token(TK_RESERVED, cur, p++, 1);
 			continue;
 		}
@@ -28,16 +28,41 @@ static Type *new_type(TypeKind kind, int size, int align) {
     return ty;
 }
 
+// Derived types are hash-consed on their base type, so that `int *`
+// is allocated once no matter how many declarators and `&` operators
+// create it. Struct, enum and function types are not interned because
+// they are nominal.
 Type *pointer_to(Type *base) {
+    if(base->pointer) {
+        return base->pointer;
+    }
     Type *ty = new_type(TY_PTR, 8, 8);
     ty->base = base;
+    base->pointer = ty;
     return ty;
 }
 
 Type *array_of(Type *base, int len) {
+    for(Type *ty=base->arrays; ty; ty=ty->next_array) {
+        if(ty->array_len == len) {
+            return ty;
+        }
+    }
+
     Type *ty = new_type(TY_ARRAY, base->size * len, base->align);
     ty->base = base;
     ty->array_len = len;
+    ty->next_array = base->arrays;
+    base->arrays = ty;
+    return ty;
+}
+
+// Returns a new array type whose length is fixed later by an initializer.
+// Such a type is modified in place, so it is never shared.
+Type *incomplete_array_of(Type *base) {
+    Type *ty = new_type(TY_ARRAY, 0, base->align);
+    ty->base = base;
+    ty->is_incomplete = true;
     return ty;
 }
 
@@ -57,30 +82,156 @@ Type *struct_type() {
     return ty;
 }
 
+void push_node(NodeStack *st, Node *node) {
+    if(st->len == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 256;
+        st->data = realloc(st->data, sizeof(Node *) * st->cap);
+    }
+    st->data[st->len++] = node;
+}
+
+// Pending and visited nodes of add_type().
+static NodeStack type_stack;
+static NodeStack type_order;
+
+static void set_type(Node *node);
+
+static void push_child(NodeStack *st, Node *node) {
+    if(node) {
+        push_node(st, node);
+    }
+}
+
+// Pushes the children of a node. Only the fields that exist for the
+// node's kind may be read (see struct Node).
+void push_children(NodeStack *st, Node *node) {
+    switch(node->kind) {
+        case ND_VAR:
+            push_child(st, node->init);
+            return;
+        case ND_MEMBER:
+        case ND_LABEL:
+        case ND_CASE:
+            push_child(st, node->lhs);
+            return;
+        case ND_FUNCALL:
+            for(Node *arg=node->args; arg; arg=arg->next) {
+                push_child(st, arg);
+            }
+            return;
+        case ND_GOTO:
+            return;
+        case ND_BLOCK:
+        case ND_STMT_EXPR:
+            for(Node *stmt=node->body; stmt; stmt=stmt->next) {
+                push_child(st, stmt);
+            }
+            return;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+        case ND_DO:
+        case ND_TERNARY:
+        case ND_SWITCH:
+            push_child(st, node->cond);
+            push_child(st, node->then);
+            push_child(st, node->els);
+            push_child(st, node->init);
+            push_child(st, node->inc);
+            return;
+    }
+    push_child(st, node->lhs);
+    push_child(st, node->rhs);
+}
+
+void push_slot(SlotStack *st, Node **slot) {
+    if(!*slot) return;
+    if(st->len == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->data = realloc(st->data, sizeof(Node **) * st->cap);
+    }
+    st->data[st->len++] = slot;
+}
+
+// Pushes the slots of the children of a node, like push_children(). The
+// `next` field counts as a child slot, so a list is walked through its
+// first node.
+void push_child_slots(SlotStack *st, Node *node) {
+    push_slot(st, &node->next);
+    switch(node->kind) {
+        case ND_VAR:
+            push_slot(st, &node->init);
+            return;
+        case ND_MEMBER:
+        case ND_LABEL:
+        case ND_CASE:
+            push_slot(st, &node->lhs);
+            return;
+        case ND_FUNCALL:
+            push_slot(st, &node->args);
+            return;
+        case ND_GOTO:
+            return;
+        case ND_BLOCK:
+        case ND_STMT_EXPR:
+            push_slot(st, &node->body);
+            return;
+        case ND_IF:
+        case ND_WHILE:
+        case ND_FOR:
+        case ND_DO:
+        case ND_TERNARY:
+        case ND_SWITCH:
+            push_slot(st, &node->cond);
+            push_slot(st, &node->then);
+            push_slot(st, &node->els);
+            push_slot(st, &node->init);
+            push_slot(st, &node->inc);
+            return;
+    }
+    push_slot(st, &node->lhs);
+    push_slot(st, &node->rhs);
+}
+
+// Assigns types to a node and all of its untyped descendants.
+//
+// The tree is walked with an explicit stack instead of recursion so that
+// machine-generated code such as `a + b + c + ...` with tens of thousands
+// of operands does not overflow the C stack. Nodes are collected in
+// pre-order and then typed in reverse, which visits every child before
+// its parent.
 void add_type(Node *node) {
     if(!node || node->ty) return;
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
+    int base = type_stack.len;
+    int order_base = type_order.len;
+    push_node(&type_stack, node);
 
-    for(Node *n=node->body; n; n=n->next) {
-        add_type(n);
+    // Children are pushed in order, so the last one is visited first and,
+    // once the visit order is reversed, the first one is typed first.
+    // Typed subtrees are skipped.
+    while(type_stack.len > base) {
+        Node *n = type_stack.data[--type_stack.len];
+        if(n->ty) continue;
+        push_node(&type_order, n);
+        push_children(&type_stack, n);
     }
-    for(Node *n=node->args; n; n=n->next) {
-        add_type(n);
+
+    while(type_order.len > order_base) {
+        Node *n = type_order.data[--type_order.len];
+        if(!n->ty) set_type(n);
     }
+}
 
+// Computes the type of a node whose children are already typed.
+static void set_type(Node *node) {
     switch(node->kind) {
         case ND_ADD:
         case ND_SUB:
         case ND_PTR_DIFF:
         case ND_MUL:
         case ND_DIV:
+        case ND_MOD:
         case ND_BITAND:
         case ND_BITOR:
         case ND_BITXOR:
@@ -108,6 +259,7 @@ void add_type(Node *node) {
         case ND_PTR_SUB_EQ:
         case ND_MUL_EQ:
         case ND_DIV_EQ:
+        case ND_MOD_EQ:
         case ND_SHL_EQ:
         case ND_SHR_EQ:
         case ND_BITAND_EQ:
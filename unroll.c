@@ -0,0 +1,304 @@
+#include "chibicc.h"
+
+// Loop unrolling on the AST, so that both code generators test the
+// condition of a counted loop once per several iterations.
+//
+// A loop
+//
+//   for (init; i < n; i += s) body
+//
+// is counted if i is a local int or long, n is a constant or a local,
+// the step s is a positive constant, neither i nor n is assigned in the
+// body, and neither has its address taken. It is unrolled k times, and
+// a remainder loop runs the iterations that are left:
+//
+//   init;
+//   for (; i + (k-1)*s < n; i += s) { body; i += s; ...; body; }
+//   for (; i < n; i += s) body
+//
+// Arithmetic is done in long, so the new condition does not overflow
+// when n is close to INT_MAX. If init sets i to a constant and n is a
+// constant too, a loop whose iterations fit in the unroll budget is
+// replaced by that many copies of its body.
+//
+// Bodies with break, continue, goto, labels or switch statements are
+// left alone, since a copy of them would jump to the wrong place.
+//
+// Only loops marked with `#pragma GCC unroll k` are unrolled, unless
+// -funroll-loops is given. Then every counted loop is unrolled, by as
+// many copies as fit in UNROLL_SIZE nodes, up to MAX_FACTOR. A factor of
+// 0 or 1 in the pragma keeps a loop rolled.
+
+enum {
+    UNROLL_SIZE = 64,
+    MAX_FACTOR = 8,
+    MAX_PRAGMA_FACTOR = 64,
+};
+
+static NodeStack walk;
+
+// The counted loop being looked at
+static CountedLoop loop;
+
+static bool is_var(Node *node, Var *var) {
+    return node && node->kind == ND_VAR && node->var == var;
+}
+
+static bool is_assignment(NodeKind kind) {
+    switch(kind) {
+        case ND_ASSIGN:
+        case ND_PRE_INC:
+        case ND_PRE_DEC:
+        case ND_POST_INC:
+        case ND_POST_DEC:
+        case ND_ADD_EQ:
+        case ND_PTR_ADD_EQ:
+        case ND_SUB_EQ:
+        case ND_PTR_SUB_EQ:
+        case ND_MUL_EQ:
+        case ND_DIV_EQ:
+        case ND_MOD_EQ:
+        case ND_SHL_EQ:
+        case ND_SHR_EQ:
+        case ND_BITAND_EQ:
+        case ND_BITOR_EQ:
+        case ND_BITXOR_EQ:
+            return true;
+    }
+    return false;
+}
+
+static bool is_address_taken(Function *fn, Var *var) {
+    bool found = false;
+    int base = walk.len;
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&walk, node);
+    }
+    while(walk.len > base) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_ADDR && is_var(node->lhs, var)) found = true;
+        push_children(&walk, node);
+    }
+    return found;
+}
+
+// Returns why copies of a loop body would not run like the original, or
+// NULL if they would. The number of nodes of the body is stored to *size.
+static char *check_body(Node *body, int *size) {
+    char *reason = NULL;
+    int base = walk.len;
+    push_node(&walk, body);
+    *size = 0;
+    while(walk.len > base) {
+        Node *node = walk.data[--walk.len];
+        (*size)++;
+        switch(node->kind) {
+            case ND_BREAK:
+            case ND_CONTINUE:
+            case ND_GOTO:
+            case ND_LABEL:
+            case ND_SWITCH:
+            case ND_CASE:
+                reason = "has a break, continue, goto, label or switch";
+                break;
+        }
+        bool is_loop_var = is_var(node->lhs, loop.ivar) || (loop.bound_var && is_var(node->lhs, loop.bound_var));
+        if(is_assignment(node->kind) && is_loop_var) {
+            reason = "assigns the induction variable or the bound";
+        }
+        push_children(&walk, node);
+    }
+    return reason;
+}
+
+// Returns why a loop is not counted, or NULL if it is, filling in *cl.
+// The vectorizer uses this too.
+char *check_counted_loop(Function *fn, Node *node, CountedLoop *cl) {
+    if(node->kind != ND_FOR) return "not a for loop";
+
+    Node *cond = node->cond;
+    if(!cond || (cond->kind != ND_LT && cond->kind != ND_LE) || cond->lhs->kind != ND_VAR) {
+        return "not a counted loop";
+    }
+    Var *ivar = cond->lhs->var;
+    Node *bound = cond->rhs;
+    if(!ivar->is_local || (ivar->ty->kind != TY_INT && ivar->ty->kind != TY_LONG)) {
+        return "the induction variable is not a local int or long";
+    }
+    Var *bound_var = bound->kind == ND_VAR ? bound->var : NULL;
+    if(bound->kind != ND_NUM && !(bound_var && bound_var->is_local && is_integer(bound_var->ty))) {
+        return "the bound is not a constant or a local";
+    }
+
+    Node *inc = node->inc ? node->inc->lhs : NULL;
+    if(!inc || !is_var(inc->lhs, ivar)) return "not a counted loop";
+    if(inc->kind == ND_PRE_INC || inc->kind == ND_POST_INC) {
+        cl->step = 1;
+    } else if(inc->kind == ND_ADD_EQ && inc->rhs->kind == ND_NUM && inc->rhs->val > 0) {
+        cl->step = inc->rhs->val;
+    } else {
+        return "not a counted loop";
+    }
+
+    if(is_address_taken(fn, ivar) || (bound_var && is_address_taken(fn, bound_var))) {
+        return "the address of the induction variable or the bound is taken";
+    }
+    cl->ivar = ivar;
+    cl->bound = bound;
+    cl->bound_var = bound_var;
+    return NULL;
+}
+
+// Returns the number of iterations of a counted loop, or -1 if it is not
+// a constant.
+static long trip_count(Node *node) {
+    // init is `i = c;` or a declaration `int i = c;`, which is a block.
+    Node *init = node->init;
+    if(init && init->kind == ND_BLOCK && init->body && !init->body->next) {
+        init = init->body;
+    }
+    if(!init || init->kind != ND_EXPR_STMT || init->lhs->kind != ND_ASSIGN ||
+       !is_var(init->lhs->lhs, loop.ivar) || init->lhs->rhs->kind != ND_NUM || loop.bound->kind != ND_NUM) {
+        return -1;
+    }
+
+    long start = init->lhs->rhs->val;
+    long end = node->cond->kind == ND_LE ? loop.bound->val + 1 : loop.bound->val;
+    if(start >= end) return 0;
+    return (end - start + loop.step - 1) / loop.step;
+}
+
+// Returns n copies of a loop body, each followed by a copy of inc except
+// the last one, unless last_inc is true.
+static Node *copy_body(Node *loop, int n, bool last_inc) {
+    Node head = {};
+    Node *cur = &head;
+    for(int i=0; i<n; i++) {
+        cur = cur->next = i ? clone_node(loop->then) : loop->then;
+        if(i < n - 1 || last_inc) {
+            cur = cur->next = clone_node(loop->inc);
+        }
+    }
+    return head.next;
+}
+
+static Node *new_block(Node *body, Token *tok) {
+    Node *node = new_node(ND_BLOCK, tok);
+    node->body = body;
+    return node;
+}
+
+static Node *new_for(Node *cond, Node *inc, Node *then, Token *tok) {
+    Node *node = new_node(ND_FOR, tok);
+    node->cond = cond;
+    node->inc = inc;
+    node->then = then;
+    node->unroll = 1;
+    return node;
+}
+
+// Turns a loop node into a block running init and then a list of
+// statements.
+static void replace_loop(Node *node, Node *body) {
+    Node *init = node->init;
+    node->kind = ND_BLOCK;
+    if(init) {
+        init->next = body;
+        body = init;
+    }
+    node->body = body;
+    node->init = NULL;
+    node->cond = NULL;
+    node->then = NULL;
+    node->inc = NULL;
+}
+
+// Fully unrolls a counted loop.
+static void unroll_fully(Node *node, long trip) {
+    if(trip == 0) {
+        replace_loop(node, new_node(ND_NULL, node->tok));
+        return;
+    }
+    replace_loop(node, copy_body(node, trip, true));
+}
+
+// Unrolls a counted loop k times, with a remainder loop.
+static void unroll(Node *node, int k) {
+    Token *tok = node->tok;
+    Node *num = new_num((k - 1) * loop.step, tok);
+    Node *sum = new_binary(ND_ADD, clone_node(node->cond->lhs), num, tok);
+    Node *cond = new_binary(node->cond->kind, sum, clone_node(loop.bound), tok);
+    add_type(cond);
+
+    Node *rest = new_for(node->cond, clone_node(node->inc), clone_node(node->then), tok);
+    Node *unrolled = new_for(cond, node->inc, new_block(copy_body(node, k, false), tok), tok);
+    unrolled->next = rest;
+    replace_loop(node, unrolled);
+}
+
+// Unrolls a loop if it was asked for. Returns true if it did.
+static bool unroll_loop(Function *fn, Node *node, bool forced) {
+    int factor = node->unroll;
+    if(factor == 1 || (!factor && !forced)) return false;
+    if(factor > MAX_PRAGMA_FACTOR) factor = MAX_PRAGMA_FACTOR;
+
+    char *reason = check_counted_loop(fn, node, &loop);
+    int size = 0;
+    if(!reason) reason = check_body(node->then, &size);
+    if(!reason && !factor) {
+        factor = UNROLL_SIZE / size;
+        if(factor > MAX_FACTOR) factor = MAX_FACTOR;
+        if(factor < 2) reason = "the body is too large";
+    }
+    if(reason) {
+        if(is_remark_enabled("unroll-loops", true)) {
+            warn_tok(node->tok, "loop not unrolled: %s", reason);
+        }
+        return false;
+    }
+
+    // A pragma asks for full unrolling of up to its factor iterations.
+    long trip = trip_count(node);
+    if(trip != -1 && (node->unroll ? trip <= factor : trip * size <= UNROLL_SIZE)) {
+        if(is_remark_enabled("unroll-loops", false)) {
+            warn_tok(node->tok, "loop fully unrolled (%ld iterations)", trip);
+        }
+        unroll_fully(node, trip);
+        return true;
+    }
+
+    if(is_remark_enabled("unroll-loops", false)) {
+        warn_tok(node->tok, "loop unrolled by a factor of %d", factor);
+    }
+    unroll(node, factor);
+    return true;
+}
+
+// Unrolls the loops of a function. Returns the number of loops
+// unrolled.
+int unroll_loops(Function *fn) {
+    bool forced = is_pass_forced("unroll-loops");
+
+    // Inner loops come after outer ones in preorder and are unrolled
+    // first.
+    Node **loops = NULL;
+    int nloops = 0;
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&walk, node);
+    }
+    while(walk.len) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_FOR || node->kind == ND_WHILE || node->kind == ND_DO) {
+            loops = realloc(loops, sizeof(Node *) * (nloops + 1));
+            loops[nloops++] = node;
+        }
+        push_children(&walk, node);
+    }
+
+    int n = 0;
+    for(int i=nloops-1; i>=0; i--) {
+        if(unroll_loop(fn, loops[i], forced)) n++;
+    }
+    free(loops);
+    return n;
+}
@@ -0,0 +1,647 @@
+#include "chibicc.h"
+
+// Loop vectorization on the AST, for both code generators.
+//
+// The body of an innermost counted loop with a step of 1 is matched
+// against a few kinds of loops over arrays, where a[i] is an element of
+// a global or local array or of the array a local pointer points to, and
+// x is a constant or a local that the loop does not assign:
+//
+//   s += a[i];                            sum of ints or longs
+//   if (a[i] == x) c++;  c += a[i] == x;  count of chars or ints
+//   a[i] = x;                             fill
+//   a[i] = b[i] op c[i];  a[i] = b[i] op x;  a[i] op= b[i];
+//                                         elementwise +, -, &, | or ^
+//
+// Such a loop is split into a call of a kernel processing whole vectors
+// of L elements, and the original loop running the iterations left:
+//
+//   init;
+//   vn = n - i;
+//   if (L <= vn) { vn = vn & -L; s = s + .L.vec.sum.4(&a[i], vn); i = i + vn; }
+//   for (; i < n; i++) s += a[i];
+//
+// The kernels are written in assembly by emit_vector_kernels() after the
+// functions of the program, with SSE2 instructions, or AVX2 ones with
+// -mavx2. They load and store with unaligned moves, so the arrays need
+// no scalar prologue to align them. They use caller-saved registers only,
+// and the code generators call them like any other function.
+//
+// A store to the destination of an elementwise kernel would change
+// elements of a source not loaded yet if the destination starts less
+// than a vector after it. The kernel checks this at runtime and then
+// returns 0 without doing anything, leaving all the work to the scalar
+// loop.
+
+typedef enum {
+    VEC_SUM,
+    VEC_COUNT,
+    VEC_FILL,
+    VEC_ADD,
+    VEC_SUB,
+    VEC_AND,
+    VEC_OR,
+    VEC_XOR,
+} VecOp;
+
+static char *op_names[] = {"sum", "count", "fill", "add", "sub", "and", "or", "xor"};
+
+// A kernel called by the program
+typedef struct Kernel Kernel;
+struct Kernel {
+    Kernel *next;
+    char *name;
+    VecOp op;
+    int size; // of an element
+    bool scalar; // the second operand of an elementwise kernel is x
+};
+
+static Kernel *kernels;
+static bool avx2;
+static int vec_bytes;
+
+static Function *fn;
+static NodeStack walk;
+static int nchanges;
+
+// The loop being looked at and the parts of its body
+static CountedLoop loop;
+static VecOp op;
+static int elem_size;
+static Node *acc; // the variable of a sum or count
+static Node *dst; // addresses of elements
+static Node *src1;
+static Node *src2;
+static Node *scalar; // x
+
+static Node *new_expr_stmt(Node *expr) {
+    add_type(expr);
+    return new_unary(ND_EXPR_STMT, expr, expr->tok);
+}
+
+static bool is_var(Node *node, Var *var) {
+    return node && node->kind == ND_VAR && node->var == var;
+}
+
+static bool is_address_taken(Var *var) {
+    bool found = false;
+    int base = walk.len;
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&walk, node);
+    }
+    while(walk.len > base) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_ADDR && is_var(node->lhs, var)) found = true;
+        push_children(&walk, node);
+    }
+    return found;
+}
+
+// Returns true if a loop has no loop inside it.
+static bool is_innermost(Node *node) {
+    bool found = false;
+    int base = walk.len;
+    push_node(&walk, node->then);
+    while(walk.len > base) {
+        Node *n = walk.data[--walk.len];
+        if(n->kind == ND_FOR || n->kind == ND_WHILE || n->kind == ND_DO) found = true;
+        push_children(&walk, n);
+    }
+    return !found;
+}
+
+// Returns the address of a[i] if a node is such an element, or NULL.
+static Node *element(Node *node) {
+    if(node->kind != ND_DEREF) return NULL;
+    Node *addr = node->lhs;
+    if(addr->kind != ND_PTR_ADD || !is_var(addr->rhs, loop.ivar) || addr->lhs->kind != ND_VAR) {
+        return NULL;
+    }
+    Var *base = addr->lhs->var;
+    if(base->ty->kind == TY_PTR) {
+        if(!base->is_local || is_address_taken(base)) return NULL;
+    } else if(base->ty->kind != TY_ARRAY) {
+        return NULL;
+    }
+
+    switch(node->ty->kind) {
+        case TY_CHAR:
+        case TY_SHORT:
+        case TY_INT:
+        case TY_LONG:
+            return addr;
+    }
+    return NULL;
+}
+
+// Returns true if a node is a constant or a local the loop does not
+// assign.
+static bool is_invariant(Node *node) {
+    if(node->kind == ND_NUM) return true;
+    if(node->kind != ND_VAR) return false;
+    Var *var = node->var;
+    if(!var->is_local || !is_integer(var->ty) || var == loop.ivar) return false;
+    if(acc && var == acc->var) return false;
+    return !is_address_taken(var);
+}
+
+// Returns true if comparing x with an element gives the same result as
+// comparing it with the bytes of the element.
+static bool fits(Node *x, int size) {
+    if(x->kind == ND_VAR) return x->var->ty->size <= size;
+    long max = (long)1 << (size * 8 - 1);
+    return -max <= x->val && x->val < max;
+}
+
+// Returns true if a node may be the variable of a sum or count.
+static bool is_accumulator(Node *node) {
+    if(node->kind != ND_VAR || !is_integer(node->ty) || node->ty->kind == TY_BOOL) return false;
+    Var *var = node->var;
+    return var->is_local && var != loop.ivar && var != loop.bound_var && !is_address_taken(var);
+}
+
+// Matches `acc += e` or `acc = acc + e`, setting acc. Returns e, or NULL.
+static Node *accumulation(Node *expr) {
+    if(expr->kind == ND_ADD_EQ && is_accumulator(expr->lhs)) {
+        acc = expr->lhs;
+        return expr->rhs;
+    }
+    if(expr->kind != ND_ASSIGN || !is_accumulator(expr->lhs) || expr->rhs->kind != ND_ADD) {
+        return NULL;
+    }
+    acc = expr->lhs;
+    if(is_var(expr->rhs->lhs, acc->var)) return expr->rhs->rhs;
+    if(is_var(expr->rhs->rhs, acc->var)) return expr->rhs->lhs;
+    acc = NULL;
+    return NULL;
+}
+
+// Matches `acc++`, `acc += 1` or `acc = acc + 1`.
+static bool is_increment(Node *expr) {
+    if((expr->kind == ND_PRE_INC || expr->kind == ND_POST_INC) && is_accumulator(expr->lhs)) {
+        acc = expr->lhs;
+        return true;
+    }
+    Node *e = accumulation(expr);
+    return e && e->kind == ND_NUM && e->val == 1;
+}
+
+// Matches `a[i] == x`, setting src1 and scalar.
+static bool is_compare(Node *expr) {
+    if(expr->kind != ND_EQ) return false;
+    Node *lhs = expr->lhs;
+    Node *rhs = expr->rhs;
+    if(!element(lhs)) {
+        lhs = expr->rhs;
+        rhs = expr->lhs;
+    }
+    src1 = element(lhs);
+    if(!src1 || !is_invariant(rhs)) return false;
+    elem_size = lhs->ty->size;
+    scalar = rhs;
+    return (elem_size == 1 || elem_size == 4) && fits(scalar, elem_size);
+}
+
+static bool set_binop(NodeKind kind) {
+    switch(kind) {
+        case ND_ADD:
+        case ND_ADD_EQ:
+            op = VEC_ADD;
+            return true;
+        case ND_SUB:
+        case ND_SUB_EQ:
+            op = VEC_SUB;
+            return true;
+        case ND_BITAND:
+        case ND_BITAND_EQ:
+            op = VEC_AND;
+            return true;
+        case ND_BITOR:
+        case ND_BITOR_EQ:
+            op = VEC_OR;
+            return true;
+        case ND_BITXOR:
+        case ND_BITXOR_EQ:
+            op = VEC_XOR;
+            return true;
+    }
+    return false;
+}
+
+// Sets src2 or scalar to the second operand of an elementwise operation.
+static bool set_operand(Node *node) {
+    if(element(node)) {
+        if(node->ty->size != elem_size) return false;
+        src2 = element(node);
+        return true;
+    }
+    if(!is_invariant(node)) return false;
+    scalar = node;
+    return true;
+}
+
+static bool is_compound_assign(NodeKind kind) {
+    switch(kind) {
+        case ND_ADD_EQ:
+        case ND_SUB_EQ:
+        case ND_BITAND_EQ:
+        case ND_BITOR_EQ:
+        case ND_BITXOR_EQ:
+            return true;
+    }
+    return false;
+}
+
+// Matches a statement storing to a[i].
+static bool match_store(Node *expr) {
+    if(expr->kind != ND_ASSIGN && !is_compound_assign(expr->kind)) return false;
+    dst = element(expr->lhs);
+    if(!dst) return false;
+    elem_size = expr->lhs->ty->size;
+
+    if(expr->kind == ND_ASSIGN && is_invariant(expr->rhs)) {
+        op = VEC_FILL;
+        scalar = expr->rhs;
+        return true;
+    }
+    if(expr->kind != ND_ASSIGN) {
+        src1 = dst;
+        return set_binop(expr->kind) && set_operand(expr->rhs);
+    }
+
+    Node *rhs = expr->rhs;
+    if(!set_binop(rhs->kind)) return false;
+    Node *lhs = rhs->lhs;
+    Node *other = rhs->rhs;
+    if(!element(lhs) && op != VEC_SUB) {
+        lhs = rhs->rhs;
+        other = rhs->lhs;
+    }
+    src1 = element(lhs);
+    return src1 && lhs->ty->size == elem_size && set_operand(other);
+}
+
+// Matches the body of a loop against the loops that can be vectorized.
+// Returns why it does not match, or NULL if it does.
+static char *match_body(Node *body) {
+    acc = dst = src1 = src2 = scalar = NULL;
+    if(body->kind == ND_BLOCK && body->body && !body->body->next) body = body->body;
+
+    // if (a[i] == x) c++;
+    if(body->kind == ND_IF && !body->els) {
+        Node *then = body->then;
+        if(then->kind == ND_BLOCK && then->body && !then->body->next) then = then->body;
+        if(then->kind != ND_EXPR_STMT || !is_increment(then->lhs) || !is_compare(body->cond)) {
+            return "unsupported statement";
+        }
+        op = VEC_COUNT;
+        return NULL;
+    }
+    if(body->kind != ND_EXPR_STMT) return "unsupported statement";
+
+    Node *expr = body->lhs;
+    Node *e = accumulation(expr);
+    if(e && is_compare(e)) {
+        op = VEC_COUNT;
+        return NULL;
+    }
+    if(e && element(e)) {
+        op = VEC_SUM;
+        src1 = element(e);
+        elem_size = e->ty->size;
+        if(elem_size != 4 && elem_size != 8) return "unsupported element type";
+        if(acc->ty->size > elem_size) return "the sum is wider than the elements";
+        return NULL;
+    }
+    acc = NULL;
+    if(match_store(expr)) return NULL;
+    return "unsupported statement";
+}
+
+// Returns the name of the kernel for the matched loop.
+static char *kernel_name() {
+    bool is_scalar = op >= VEC_ADD && scalar;
+    for(Kernel *k=kernels; k; k=k->next) {
+        if(k->op == op && k->size == elem_size && k->scalar == is_scalar) return k->name;
+    }
+
+    Kernel *k = calloc(1, sizeof(Kernel));
+    k->op = op;
+    k->size = elem_size;
+    k->scalar = is_scalar;
+    k->name = calloc(1, 32);
+    sprintf(k->name, ".L.vec.%s%s.%d", op_names[op], is_scalar ? "s" : "", elem_size);
+    k->next = kernels;
+    kernels = k;
+    return k->name;
+}
+
+// Returns the statements calling the kernel for vn elements.
+static Node *call_kernel(Var *vn, Token *tok) {
+    Node *call = new_node(ND_FUNCALL, tok);
+    call->funcname = kernel_name();
+    call->ty = long_type;
+
+    Node head = {};
+    Node *cur = &head;
+    cur = cur->next = clone_node(op >= VEC_FILL ? dst : src1);
+    if(op >= VEC_ADD) cur = cur->next = clone_node(src1);
+    if(src2) {
+        cur = cur->next = clone_node(src2);
+    } else if(scalar) {
+        cur = cur->next = clone_node(scalar);
+    }
+    cur->next = new_var_node(vn, tok);
+    call->args = head.next;
+    for(Node *arg=call->args; arg; arg=arg->next) {
+        add_type(arg);
+    }
+
+    Node *ivar = new_var_node(loop.ivar, tok);
+    Node *next_i = new_binary(ND_ADD, new_var_node(loop.ivar, tok), new_var_node(vn, tok), tok);
+    if(acc) {
+        Node *sum = new_binary(ND_ADD, clone_node(acc), call, tok);
+        Node *stmt = new_expr_stmt(new_binary(ND_ASSIGN, clone_node(acc), sum, tok));
+        stmt->next = new_expr_stmt(new_binary(ND_ASSIGN, ivar, next_i, tok));
+        return stmt;
+    }
+    next_i->rhs = call;
+    return new_expr_stmt(new_binary(ND_ASSIGN, ivar, next_i, tok));
+}
+
+// Splits a loop into a kernel call and the scalar loop.
+static void vectorize(Node *node) {
+    Token *tok = node->tok;
+    int lanes = vec_bytes / elem_size;
+    Var *vn = new_local(fn, "vn", long_type);
+
+    // vn = n - i, plus 1 for `i <= n`
+    Node *count = new_binary(ND_SUB, clone_node(loop.bound), new_var_node(loop.ivar, tok), tok);
+    if(node->cond->kind == ND_LE) count = new_binary(ND_ADD, count, new_num(1, tok), tok);
+    Node *set_count = new_expr_stmt(new_binary(ND_ASSIGN, new_var_node(vn, tok), count, tok));
+
+    Node *round = new_binary(ND_BITAND, new_var_node(vn, tok), new_num(-lanes, tok), tok);
+    Node *body = new_expr_stmt(new_binary(ND_ASSIGN, new_var_node(vn, tok), round, tok));
+    body->next = call_kernel(vn, tok);
+    Node *then = new_node(ND_BLOCK, tok);
+    then->body = body;
+
+    Node *guard = new_node(ND_IF, tok);
+    guard->cond = new_binary(ND_LE, new_num(lanes, tok), new_var_node(vn, tok), tok);
+    add_type(guard->cond);
+    guard->then = then;
+
+    Node *rest = new_node(ND_FOR, tok);
+    rest->cond = node->cond;
+    rest->inc = node->inc;
+    rest->then = node->then;
+    rest->unroll = node->unroll;
+
+    set_count->next = guard;
+    guard->next = rest;
+    Node *init = node->init;
+    if(init) init->next = set_count;
+
+    node->kind = ND_BLOCK;
+    node->body = init ? init : set_count;
+    node->init = NULL;
+    node->cond = NULL;
+    node->then = NULL;
+    node->inc = NULL;
+}
+
+static void vectorize_loop(Node *node) {
+    char *reason = check_counted_loop(fn, node, &loop);
+    if(!reason && loop.step != 1) reason = "the step is not 1";
+    if(!reason && !is_innermost(node)) reason = "not an innermost loop";
+    if(!reason) reason = match_body(node->then);
+
+    if(reason) {
+        if(is_remark_enabled("vectorize", true)) {
+            warn_tok(node->tok, "loop not vectorized: %s", reason);
+        }
+        return;
+    }
+
+    if(is_remark_enabled("vectorize", false)) {
+        warn_tok(node->tok, "loop vectorized (%s, %d lanes)", op_names[op], vec_bytes / elem_size);
+    }
+    vectorize(node);
+    nchanges++;
+}
+
+// Vectorizes the loops of a function. Returns the number of loops
+// vectorized.
+int vectorize_loops(Function *f) {
+    fn = f;
+    nchanges = 0;
+    avx2 = is_mode_enabled("avx2");
+    vec_bytes = avx2 ? 32 : 16;
+
+    Node **loops = NULL;
+    int nloops = 0;
+    for(Node *node=fn->node; node; node=node->next) {
+        push_node(&walk, node);
+    }
+    while(walk.len) {
+        Node *node = walk.data[--walk.len];
+        if(node->kind == ND_FOR) {
+            loops = realloc(loops, sizeof(Node *) * (nloops + 1));
+            loops[nloops++] = node;
+        }
+        push_children(&walk, node);
+    }
+
+    for(int i=0; i<nloops; i++) {
+        vectorize_loop(loops[i]);
+    }
+    free(loops);
+    if(nchanges) assign_offsets(fn);
+    return nchanges;
+}
+
+//
+// Kernels
+//
+
+static char *xmm[] = {"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5"};
+static char *ymm[] = {"ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "ymm5"};
+
+static char *vreg(int i) {
+    return avx2 ? ymm[i] : xmm[i];
+}
+
+// Suffix of integer vector instructions for a size of lanes
+static char lane(int size) {
+    if(size == 1) return 'b';
+    if(size == 2) return 'w';
+    if(size == 4) return 'd';
+    return 'q';
+}
+
+// Emits `d = a op b`. SSE2 instructions only have two operands, so d must
+// be a there.
+static void emit_op(char *name, int d, int a, int b) {
+    if(avx2) {
+        printf("  v%s %s, %s, %s\n", name, vreg(d), vreg(a), vreg(b));
+        return;
+    }
+    assert(d == a);
+    printf("  %s %s, %s\n", name, vreg(d), vreg(b));
+}
+
+static void emit_lane_op(char *name, int size, int d, int a, int b) {
+    char buf[16];
+    sprintf(buf, "%s%c", name, lane(size));
+    emit_op(buf, d, a, b);
+}
+
+static void emit_load(int d, char *base) {
+    printf("  %smovdqu %s, [%s+r9]\n", avx2 ? "v" : "", vreg(d), base);
+}
+
+static void emit_store(char *base, int s) {
+    printf("  %smovdqu [%s+r9], %s\n", avx2 ? "v" : "", base, vreg(s));
+}
+
+// Copies a general register into every lane of a vector register.
+static void emit_broadcast(int d, char *reg, int size) {
+    if(avx2) {
+        printf("  vmovq %s, %s\n", xmm[d], reg);
+        printf("  vpbroadcast%c %s, %s\n", lane(size), ymm[d], xmm[d]);
+        return;
+    }
+    printf("  movq %s, %s\n", xmm[d], reg);
+    if(size == 8) {
+        printf("  punpcklqdq %s, %s\n", xmm[d], xmm[d]);
+        return;
+    }
+    if(size == 1) printf("  punpcklbw %s, %s\n", xmm[d], xmm[d]);
+    if(size <= 2) printf("  punpcklwd %s, %s\n", xmm[d], xmm[d]);
+    printf("  pshufd %s, %s, 0\n", xmm[d], xmm[d]);
+}
+
+// Adds up the lanes of xmm0, or of ymm0 with AVX2, into rax.
+static void emit_reduce(int size) {
+    if(avx2) {
+        printf("  vextracti128 xmm1, ymm0, 1\n");
+        printf("  vpadd%c xmm0, xmm0, xmm1\n", lane(size));
+        printf("  vzeroupper\n");
+    }
+    printf("  pshufd xmm1, xmm0, 0x4e\n");
+    printf("  padd%c xmm0, xmm1\n", lane(size));
+    if(size == 8) {
+        printf("  movq rax, xmm0\n");
+        return;
+    }
+    printf("  pshufd xmm1, xmm0, 0xb1\n");
+    printf("  paddd xmm0, xmm1\n");
+    printf("  movd eax, xmm0\n");
+    printf("  movsxd rax, eax\n");
+}
+
+// Jumps to the end of a kernel if storing to the destination in rdi may
+// overwrite the source in reg before it is loaded.
+static void emit_alias_check(Kernel *k, char *reg) {
+    printf("  mov rax, rdi\n");
+    printf("  sub rax, %s\n", reg);
+    printf("  jle %s.%s\n", k->name, reg);
+    printf("  cmp rax, %d\n", vec_bytes);
+    printf("  jl %s.alias\n", k->name);
+    printf("%s.%s:\n", k->name, reg);
+}
+
+// Emits a kernel. Its arguments are the addresses of the elements, x
+// and the number of elements, which is a positive multiple of the
+// number of lanes. r9 holds the offset of the current vector and r8
+// where it ends.
+static void emit_kernel(Kernel *k) {
+    int size = k->size;
+    char *n = "rdx";
+    if(k->op == VEC_SUM) n = "rsi";
+    if(k->op >= VEC_ADD) n = "rcx";
+
+    printf("%s:\n", k->name);
+    if(k->op >= VEC_ADD) {
+        emit_alias_check(k, "rsi");
+        if(!k->scalar) emit_alias_check(k, "rdx");
+    }
+    printf("  xor r9, r9\n");
+    printf("  imul r8, %s, %d\n", n, size);
+
+    switch(k->op) {
+        case VEC_SUM:
+            emit_op("pxor", 0, 0, 0);
+            break;
+        case VEC_COUNT:
+            emit_op("pxor", 0, 0, 0);
+            emit_op("pxor", 5, 5, 5);
+            emit_broadcast(2, "rsi", size);
+            break;
+        case VEC_FILL:
+            emit_broadcast(0, "rsi", size);
+            break;
+        default:
+            if(k->scalar) emit_broadcast(1, "rdx", size);
+    }
+
+    printf("%s.loop:\n", k->name);
+    switch(k->op) {
+        case VEC_SUM:
+            emit_load(1, "rdi");
+            emit_lane_op("padd", size, 0, 0, 1);
+            break;
+        case VEC_COUNT:
+            // A lane that is equal becomes -1, and is subtracted. Byte
+            // counts are summed into quadwords before they overflow.
+            emit_load(1, "rdi");
+            emit_lane_op("pcmpeq", size, 1, 1, 2);
+            if(size == 4) {
+                emit_op("psubd", 0, 0, 1);
+                break;
+            }
+            emit_op("pxor", 3, 3, 3);
+            emit_op("psubb", 3, 3, 1);
+            emit_op("psadbw", 3, 3, 5);
+            emit_op("paddq", 0, 0, 3);
+            break;
+        case VEC_FILL:
+            emit_store("rdi", 0);
+            break;
+        default:
+            emit_load(0, "rsi");
+            if(!k->scalar) emit_load(1, "rdx");
+            if(k->op == VEC_ADD) emit_lane_op("padd", size, 0, 0, 1);
+            if(k->op == VEC_SUB) emit_lane_op("psub", size, 0, 0, 1);
+            if(k->op == VEC_AND) emit_op("pand", 0, 0, 1);
+            if(k->op == VEC_OR) emit_op("por", 0, 0, 1);
+            if(k->op == VEC_XOR) emit_op("pxor", 0, 0, 1);
+            emit_store("rdi", 0);
+    }
+    printf("  add r9, %d\n", vec_bytes);
+    printf("  cmp r9, r8\n");
+    printf("  jl %s.loop\n", k->name);
+
+    if(k->op == VEC_SUM) {
+        emit_reduce(size);
+    } else if(k->op == VEC_COUNT) {
+        emit_reduce(size == 1 ? 8 : 4);
+    } else {
+        printf("  mov rax, %s\n", n);
+        if(avx2) printf("  vzeroupper\n");
+    }
+    printf("  ret\n");
+
+    if(k->op >= VEC_ADD) {
+        printf("%s.alias:\n", k->name);
+        printf("  xor eax, eax\n");
+        printf("  ret\n");
+    }
+}
+
+// Emits the kernels the vectorized loops call.
+void emit_vector_kernels() {
+    for(Kernel *k=kernels; k; k=k->next) {
+        emit_kernel(k);
+    }
+}